@@ -0,0 +1,278 @@
+//
+// bench.c
+//
+// Microbenchmarks for the parsing, argv construction and spawning hot paths
+// of uqparallel. Results are printed as CSV, or JSON with --json, so they can
+// be compared between builds.
+// Usage: bench/bench [--json] [--quick]
+//
+
+#define UQPARALLEL_NO_MAIN
+#include "../uqparallel.c"
+
+#define BENCH_STRING_ITERATIONS 1000000
+#define BENCH_FILE_LINES 200000
+#define BENCH_SPAWN_TASKS 2000
+#define BENCH_LATENCY_JOBS 100000
+#define BENCH_LATENCY_STEP 977
+#define BENCH_QUICK_DIVISOR 20
+#define BENCH_NUM_JOB_LIMITS 5
+
+const char *const benchLine =
+    "  convert   \"input file 0001.png\"  -resize 50%   -quality 90 "
+    "\"output file 0001.jpg\"   >out/0001.log   2>err/0001.log  ";
+const int benchJobLimits[BENCH_NUM_JOB_LIMITS] = {1, 4, 16, 64, 120};
+
+// A single benchmark measurement
+struct BenchResult {
+  const char *name;
+  const char *parameter;
+  long iterations;
+  double seconds;
+};
+
+// Returns the current time from a monotonic clock
+// Returns: time in seconds
+double bench_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / NANOSECONDS_PER_SECOND;
+}
+
+// Prints a benchmark result as a CSV row or JSON object
+// Inputs: result - measurement to print
+//         json - true to print JSON
+//         first - true if this is the first result printed
+void print_result(const struct BenchResult *result, bool json, bool first) {
+  double nsPerOp = result->seconds * NANOSECONDS_PER_SECOND /
+                   (double)result->iterations;
+  double opsPerSec = (double)result->iterations / result->seconds;
+
+  if (json) {
+    printf("%s  {\"benchmark\":\"%s\",\"parameter\":\"%s\","
+           "\"iterations\":%ld,\"seconds\":%.6f,\"ns_per_op\":%.1f,"
+           "\"ops_per_sec\":%.1f}",
+           first ? "" : ",\n", result->name, result->parameter,
+           result->iterations, result->seconds, nsPerOp, opsPerSec);
+  } else {
+    printf("%s,%s,%ld,%.6f,%.1f,%.1f\n", result->name, result->parameter,
+           result->iterations, result->seconds, nsPerOp, opsPerSec);
+  }
+  fflush(stdout);
+}
+
+// Times modify_string() on a representative argsfile line
+// Inputs: iterations - number of calls to time
+// Returns: measurement
+struct BenchResult bench_modify_string(long iterations) {
+  char *line = strdup(benchLine);
+  double start = bench_now();
+  for (long i = 0; i < iterations; i++) {
+    free(modify_string(line));
+  }
+  struct BenchResult result = {"modify_string", "line", iterations,
+                               bench_now() - start};
+  free(line);
+  return result;
+}
+
+// Times split_space_not_quote() on a processed argsfile line, including the
+// copy it needs because it modifies the line
+// Inputs: iterations - number of calls to time
+// Returns: measurement
+struct BenchResult bench_split_space_not_quote(long iterations) {
+  char *processedLine = modify_string((char *)benchLine);
+  double start = bench_now();
+  for (long i = 0; i < iterations; i++) {
+    int numTokens = 0;
+    char *line = strdup(processedLine);
+    char **tokens = split_space_not_quote(line, &numTokens);
+    free((void *)tokens);
+    free(line);
+  }
+  struct BenchResult result = {"split_space_not_quote", "line", iterations,
+                               bench_now() - start};
+  free(processedLine);
+  return result;
+}
+
+// Writes an argsfile of benchmark lines to a temporary file
+// Inputs: numLines - number of lines to write
+// Returns: path of the file, caller must unlink and free
+char *write_bench_argsfile(long numLines) {
+  char *fileName = strdup("/tmp/uqparallel-bench-XXXXXX");
+  FILE *file = fdopen(mkstemp(fileName), "w");
+  for (long i = 0; i < numLines; i++) {
+    fprintf(file, "%s\n", benchLine);
+  }
+  fclose(file);
+  return fileName;
+}
+
+// Times reading an argsfile with file_args_struct_helper()
+// Inputs: fileName - argsfile to read
+//         numLines - number of lines in the file
+// Returns: measurement, one iteration per line
+struct BenchResult bench_file_ingest(char *fileName, long numLines) {
+  struct CLArgs *cmdLineArgs = calloc(1, sizeof(struct CLArgs));
+  cmdLineArgs->argsFilePresent = true;
+  cmdLineArgs->fileName = strdup(fileName);
+
+  double start = bench_now();
+  file_args_struct_helper(cmdLineArgs);
+  struct BenchResult result = {"file_args_struct_helper", "lines", numLines,
+                               bench_now() - start};
+
+  free_command_line_struct(cmdLineArgs);
+  return result;
+}
+
+// Times building every task's argv with process_struct_creator()
+// Inputs: fileName - argsfile to build tasks from
+//         numLines - number of lines in the file
+// Returns: measurement, one iteration per task
+struct BenchResult bench_process_struct(char *fileName, long numLines) {
+  char *argv[] = {(char *)argsFile, fileName, "convert", "-strip", NULL};
+  struct CLArgs *cmdLineArgs = command_line_struct_creator(4, argv);
+
+  double start = bench_now();
+  struct PArgs *pArgs = process_struct_creator(cmdLineArgs);
+  struct BenchResult result = {"process_struct_creator", "argsfile",
+                               numLines, bench_now() - start};
+
+  free_process_struct(pArgs);
+  free_command_line_struct(cmdLineArgs);
+  return result;
+}
+
+// Times adding a latency to a histogram, the only --latency-report work done
+// for each stage of a job
+// Inputs: iterations - number of latencies to record
+// Returns: measurement
+struct BenchResult bench_latency_record(long iterations) {
+  double start = bench_now();
+  for (long i = 0; i < iterations; i++) {
+    latency_record(LATENCY_RUN, 0, (uint64_t)i * BENCH_LATENCY_STEP);
+  }
+  struct BenchResult result = {"latency_record", "stage", iterations,
+                               bench_now() - start};
+  memset(latencyReport.histograms, 0, sizeof(latencyReport.histograms));
+  return result;
+}
+
+// Times the per-job bookkeeping of --latency-report: the exec pipe, pidfd and
+// epoll watches taken around a fork and released at reap. Our own pid stands
+// in for the child, so fork and exec themselves aren't counted.
+// Inputs: iterations - number of jobs to track
+// Returns: measurement, one iteration per job
+struct BenchResult bench_latency_tracking(long iterations) {
+  struct CLArgs cmdLineArgs = {0};
+  cmdLineArgs.latencyReportPresent = true;
+  start_latency_report(&cmdLineArgs);
+  pid_t pid = getpid();
+
+  double start = bench_now();
+  for (long i = 0; i < iterations; i++) {
+    struct LatencySpawn spawn;
+    latency_prepare_spawn(&spawn, latency_now());
+    latency_spawned(&spawn, pid);
+    latency_reaped(pid);
+  }
+  struct BenchResult result = {"latency_tracking", "job", iterations,
+                               bench_now() - start};
+
+  // stop the watcher without printing a report of the fake jobs
+  close(latencyReport.wakePipe[1]);
+  pthread_join(latencyReport.thread, NULL);
+  close(latencyReport.wakePipe[0]);
+  close(latencyReport.epollFd);
+  memset(&latencyReport, 0, sizeof(latencyReport));
+  return result;
+}
+
+// Times make_babies() running /bin/true for every task
+// Inputs: numTasks - number of tasks to run
+//         jobLimitValue - job limit to run with
+//         parameter - buffer for the job limit label
+//         size - size of parameter
+// Returns: measurement, one iteration per task
+struct BenchResult bench_make_babies(long numTasks, int jobLimitValue,
+                                     char *parameter, size_t size) {
+  int argc = (int)numTasks + 4;
+  char **argv = malloc((argc + 1) * sizeof(char *));
+  char jobLimitString[STATS_BUFFER_SIZE];
+  snprintf(jobLimitString, sizeof(jobLimitString), "%d", jobLimitValue);
+  snprintf(parameter, size, "joblimit=%d", jobLimitValue);
+
+  argv[0] = (char *)jobLimit;
+  argv[1] = jobLimitString;
+  argv[2] = "/bin/true";
+  argv[3] = (char *)perTask;
+  for (int i = 4; i < argc; i++) {
+    argv[i] = "x";
+  }
+  argv[argc] = NULL;
+
+  struct CLArgs *cmdLineArgs = command_line_struct_creator(argc, argv);
+  struct PArgs *pArgs = process_struct_creator(cmdLineArgs);
+  double start = bench_now();
+  make_babies(cmdLineArgs, pArgs);
+  struct BenchResult result = {"make_babies", parameter, numTasks,
+                               bench_now() - start};
+
+  free_process_struct(pArgs);
+  free_command_line_struct(cmdLineArgs);
+  free((void *)argv);
+  return result;
+}
+
+int main(int argc, char *argv[]) {
+  bool json = false;
+  long divisor = 1;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--json") == 0) {
+      json = true;
+    } else if (strcmp(argv[i], "--quick") == 0) {
+      divisor = BENCH_QUICK_DIVISOR;
+    } else {
+      fprintf(stderr, "Usage: bench [--json] [--quick]\n");
+      return USAGE_ERROR_EXIT_NUM;
+    }
+  }
+
+  long stringIterations = BENCH_STRING_ITERATIONS / divisor;
+  long fileLines = BENCH_FILE_LINES / divisor;
+  long spawnTasks = BENCH_SPAWN_TASKS / divisor;
+  char *fileName = write_bench_argsfile(fileLines);
+  char parameters[BENCH_NUM_JOB_LIMITS][STATS_BUFFER_SIZE];
+  struct BenchResult results[6 + BENCH_NUM_JOB_LIMITS];
+  int numResults = 0;
+
+  results[numResults++] = bench_modify_string(stringIterations);
+  results[numResults++] = bench_split_space_not_quote(stringIterations);
+  results[numResults++] = bench_file_ingest(fileName, fileLines);
+  results[numResults++] = bench_process_struct(fileName, fileLines);
+  results[numResults++] = bench_latency_record(stringIterations);
+  results[numResults++] =
+      bench_latency_tracking(BENCH_LATENCY_JOBS / divisor);
+  for (int i = 0; i < BENCH_NUM_JOB_LIMITS; i++) {
+    results[numResults++] =
+        bench_make_babies(spawnTasks, benchJobLimits[i], parameters[i],
+                          sizeof(parameters[i]));
+  }
+  unlink(fileName);
+  free(fileName);
+
+  if (json) {
+    printf("[\n");
+  } else {
+    printf("benchmark,parameter,iterations,seconds,ns_per_op,ops_per_sec\n");
+  }
+  for (int i = 0; i < numResults; i++) {
+    print_result(&results[i], json, i == 0);
+  }
+  if (json) {
+    printf("\n]\n");
+  }
+  return 0;
+}
@@ -0,0 +1,29 @@
+#!/bin/sh
+#
+# dispatch.sh
+#
+# Measures spawn throughput (tasks/sec) of uqparallel with 1 to 64 dispatcher
+# threads. Prints CSV to stdout.
+# Usage: bench/dispatch.sh [num-tasks] [uqparallel-binary]
+
+numTasks=${1:-20000}
+binary=${2:-./uqparallel}
+taskFile=$(mktemp)
+trap 'rm -f "$taskFile"' EXIT
+
+# every task is an empty argument list for /bin/true
+i=0
+while [ "$i" -lt "$numTasks" ]; do
+  echo
+  i=$((i + 1))
+done > "$taskFile"
+
+echo "dispatchers,tasks,seconds,tasks_per_sec"
+for dispatchers in 1 2 4 8 16 32 64; do
+  start=$(date +%s.%N)
+  "$binary" --joblimit 64 --dispatchers "$dispatchers" \
+      --argsfile "$taskFile" /bin/true
+  end=$(date +%s.%N)
+  echo "$dispatchers $numTasks $start $end" |
+      awk '{ s = $4 - $3; printf "%d,%d,%.3f,%.0f\n", $1, $2, s, $2 / s }'
+done
@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# isolate.sh
+#
+# Compares per-task overhead of plain fork+exec against --isolate, and
+# against making fresh namespaces for every task with unshare(1). Prints CSV
+# to stdout.
+# Usage: bench/isolate.sh [num-tasks] [uqparallel-binary]
+
+numTasks=${1:-20000}
+binary=${2:-./uqparallel}
+taskFile=$(mktemp)
+trap 'rm -f "$taskFile"' EXIT
+
+i=0
+while [ "$i" -lt "$numTasks" ]; do
+  echo
+  i=$((i + 1))
+done > "$taskFile"
+
+# runs one configuration and prints a CSV row
+# Inputs: $1 - mode label, remaining arguments passed to uqparallel
+run() {
+  mode=$1
+  shift
+  start=$(date +%s.%N)
+  "$binary" --argsfile "$taskFile" "$@"
+  end=$(date +%s.%N)
+  echo "$mode $numTasks $start $end" |
+      awk '{ s = $4 - $3; printf "%s,%d,%.3f,%.1f\n", $1, $2, s, s * 1e6 / $2 }'
+}
+
+echo "mode,tasks,seconds,usec_per_task"
+run fork-exec /bin/true
+run isolate --isolate /bin/true
+run isolate-ro --isolate-ro /bin/true
+if unshare -Urmnp --fork true 2>/dev/null; then
+  run unshare-per-task unshare -Urmnp --fork --mount-proc /bin/true
+fi
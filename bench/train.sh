@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# train.sh
+#
+# Runs the same workloads as bench/bench through the uqparallel binary so an
+# instrumented build can record a profile for the pgo build: argsfile parsing,
+# compiled argsfiles, and spawning /bin/true at several job limits.
+# Usage: bench/train.sh [uqparallel-binary]
+
+binary=${1:-./uqparallel}
+workDir=$(mktemp -d)
+trap 'rm -rf "$workDir"' EXIT
+
+# quoted arguments and redirects exercise the whole line parser
+i=0
+while [ "$i" -lt 20000 ]; do
+  echo "  convert \"input file $i.png\" -resize 50%  >$workDir/out 2>$workDir/err"
+  i=$((i + 1))
+done > "$workDir/parse"
+
+i=0
+while [ "$i" -lt 2000 ]; do
+  echo "$i"
+  i=$((i + 1))
+done > "$workDir/spawn"
+
+"$binary" --dry-run --argsfile "$workDir/parse" echo > /dev/null
+"$binary" --argsfile "$workDir/parse" --compile-argsfile "$workDir/parse.bin"
+"$binary" --dry-run --argsfile "$workDir/parse.bin" echo > /dev/null
+for limit in 1 4 16 64 120; do
+  "$binary" --joblimit "$limit" --argsfile "$workDir/spawn" /bin/true
+done
+"$binary" --joblimit 64 --dispatchers 4 --argsfile "$workDir/spawn" /bin/true
+"$binary" --argsfile "$workDir/spawn" --compile-argsfile "$workDir/spawn.bin"
+"$binary" --joblimit 16 --argsfile "$workDir/spawn.bin" /bin/true
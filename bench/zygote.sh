@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# zygote.sh
+#
+# Compares per-task overhead of fork+exec against --zygote workers for a
+# trivial command. Prints CSV to stdout.
+# Usage: bench/zygote.sh [num-tasks] [uqparallel-binary]
+
+numTasks=${1:-20000}
+binary=${2:-./uqparallel}
+taskFile=$(mktemp)
+trap 'rm -f "$taskFile"' EXIT
+
+i=0
+while [ "$i" -lt "$numTasks" ]; do
+  echo
+  i=$((i + 1))
+done > "$taskFile"
+
+# runs one configuration and prints a CSV row
+# Inputs: $1 - mode label, remaining arguments passed to uqparallel
+run() {
+  mode=$1
+  shift
+  start=$(date +%s.%N)
+  "$binary" --argsfile "$taskFile" "$@"
+  end=$(date +%s.%N)
+  echo "$mode $numTasks $start $end" |
+      awk '{ s = $4 - $3; printf "%s,%d,%.3f,%.1f\n", $1, $2, s, s * 1e6 / $2 }'
+}
+
+echo "mode,tasks,seconds,usec_per_task"
+run fork-exec /bin/true
+run zygote-exec --zygote /bin/true
+run zygote-builtin --zygote true
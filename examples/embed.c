@@ -0,0 +1,39 @@
+//
+// embed.c
+//
+// Example of embedding libuqparallel: compresses the files named on the
+// command line four at a time, reporting each one as it finishes.
+//
+// Usage: examples/embed file ...
+//
+
+#include <stdio.h>
+#include "../uqparallel.h"
+
+#define EMBED_JOB_LIMIT 4
+
+// Reports a finished task
+// Inputs: task - finished task
+//         exitStatus - its exit status
+//         data - name of the file it compressed
+void report(struct UqTask *task, int exitStatus, void *data) {
+  printf("%s: pid %d exited with %d\n", (const char *)data,
+         (int)uq_task_pid(task), exitStatus);
+}
+
+int main(int argc, char **argv) {
+  struct UqScheduler *scheduler = uq_scheduler_create(EMBED_JOB_LIMIT);
+  for (int i = 1; i < argc; i++) {
+    char *const command[] = {"gzip", "-k", "-f", argv[i], NULL};
+    uq_submit(scheduler, command, NULL, NULL, report, argv[i]);
+  }
+  // tasks can also be written as argsfile lines
+  struct UqTask *listing =
+      uq_submit_line(scheduler, "ls -l >embed.txt", NULL, NULL);
+  uq_wait(scheduler, listing);
+  uq_task_free(scheduler, listing);
+
+  int status = uq_wait_all(scheduler);
+  uq_scheduler_destroy(scheduler);
+  return status;
+}
@@ -0,0 +1,395 @@
+//
+// libuqparallel.c
+//
+// libuqparallel: the API in uqparallel.h on top of the internals of
+// uqparallel.c. Tasks are started with exec_child(), so redirects and failed
+// execs behave exactly as they do for the binary. Commands are searched for
+// in each child rather than cached, as the program may change $PATH.
+//
+
+#define UQPARALLEL_NO_MAIN
+#include "uqparallel.c"
+#include "uqparallel.h"
+
+#define UQ_TASK_QUEUED 0
+#define UQ_TASK_RUNNING 1
+#define UQ_TASK_FINISHED 2
+
+// A submitted task. Every handle is on its scheduler's list until freed.
+struct UqTask {
+  char **argv;
+  char *stdoutFile;
+  char *stderrFile;
+  UqTaskCallback callback;
+  void *data;
+  int state;
+  pid_t pid;
+  // -1 while queued, or if pidfds aren't supported
+  int pidfd;
+  int exitStatus;
+  // next task in the queue, or in the list of tasks which failed to fork
+  struct UqTask *nextQueued;
+  struct UqTask *prev;
+  struct UqTask *next;
+};
+
+// Tasks of one embedding program. running, pollFds and finished all have
+// room for jobLimit entries.
+struct UqScheduler {
+  int jobLimit;
+  struct UqTask **running;
+  struct pollfd *pollFds;
+  struct UqTask **finished;
+  int numRunning;
+  struct UqTask *queueHead;
+  struct UqTask *queueTail;
+  int numQueued;
+  struct UqTask *failedHead;
+  struct UqTask *failedTail;
+  int numFailed;
+  struct UqTask *tasks;
+  int lastExitStatus;
+};
+
+// Creates a scheduler
+// Inputs: jobLimit - number of tasks which may run at once, at least 1
+// Returns: new scheduler, or NULL if jobLimit is invalid
+struct UqScheduler *uq_scheduler_create(int jobLimit) {
+  if (jobLimit < 1 || jobLimit > JOB_LIMIT_MAX) {
+    return NULL;
+  }
+  struct UqScheduler *scheduler =
+      (struct UqScheduler *)calloc(1, sizeof(struct UqScheduler));
+  scheduler->jobLimit = jobLimit;
+  scheduler->running =
+      (struct UqTask **)malloc(jobLimit * sizeof(struct UqTask *));
+  scheduler->pollFds =
+      (struct pollfd *)malloc(jobLimit * sizeof(struct pollfd));
+  scheduler->finished =
+      (struct UqTask **)malloc(jobLimit * sizeof(struct UqTask *));
+  return scheduler;
+}
+
+// Forks and execs a queued task in a free job slot. A task which can't be
+// forked gets UQ_SIGNAL_EXIT_STATUS, but is only finished by the next step.
+// Inputs: scheduler - scheduler with a free job slot
+//         task - task to start
+// Returns: true if the task is running, false if it couldn't be forked
+bool uq_start_task(struct UqScheduler *scheduler, struct UqTask *task) {
+  struct PArgs taskArgs = {0};
+  taskArgs.args = &task->argv;
+  taskArgs.numArgs = 1;
+  taskArgs.stdoutFiles = &task->stdoutFile;
+  taskArgs.stderrFiles = &task->stderrFile;
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // the embedding program may catch or ignore these, tasks get the defaults
+    signal(SIGUSR1, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    exec_child(&taskArgs, 0, NULL, NULL);
+  }
+  if (pid < 0) {
+    task->exitStatus = SIGNAL_EXIT_NUM;
+    return false;
+  }
+  task->pid = pid;
+  task->pidfd = open_pidfd(pid);
+  task->state = UQ_TASK_RUNNING;
+  scheduler->running[scheduler->numRunning++] = task;
+  return true;
+}
+
+// Records that a task has finished and runs its callback
+// Inputs: scheduler - scheduler which ran the task
+//         task - finished task, with its exitStatus set
+void uq_task_finished(struct UqScheduler *scheduler, struct UqTask *task) {
+  task->state = UQ_TASK_FINISHED;
+  scheduler->lastExitStatus = task->exitStatus;
+  if (task->callback) {
+    task->callback(task, task->exitStatus, task->data);
+  }
+}
+
+// Starts queued tasks until the job slots are full or the queue is empty.
+// Tasks which can't be forked are kept for uq_step() to finish, as this runs
+// inside uq_submit() where callbacks mustn't.
+// Inputs: scheduler - scheduler to start tasks for
+void uq_start_queued(struct UqScheduler *scheduler) {
+  while (scheduler->queueHead &&
+         scheduler->numRunning < scheduler->jobLimit) {
+    struct UqTask *task = scheduler->queueHead;
+    scheduler->queueHead = task->nextQueued;
+    if (!scheduler->queueHead) {
+      scheduler->queueTail = NULL;
+    }
+    task->nextQueued = NULL;
+    scheduler->numQueued--;
+    if (!uq_start_task(scheduler, task)) {
+      if (scheduler->failedTail) {
+        scheduler->failedTail->nextQueued = task;
+      } else {
+        scheduler->failedHead = task;
+      }
+      scheduler->failedTail = task;
+      scheduler->numFailed++;
+    }
+  }
+}
+
+// Reaps the running tasks which have finished into scheduler->finished,
+// waiting for one to first if asked to
+// Inputs: scheduler - scheduler to update
+//         block - true to wait until a task finishes
+// Returns: number of tasks reaped
+int uq_reap_finished(struct UqScheduler *scheduler, bool block) {
+  if (scheduler->numRunning == 0) {
+    return 0;
+  }
+
+  bool fallback = false;
+  for (int i = 0; i < scheduler->numRunning; i++) {
+    scheduler->pollFds[i].fd = scheduler->running[i]->pidfd;
+    scheduler->pollFds[i].events = POLLIN;
+    scheduler->pollFds[i].revents = 0;
+    fallback |= scheduler->running[i]->pidfd < 0;
+  }
+  int timeout = !block ? 0 : fallback ? PIDFD_FALLBACK_POLL_MS : -1;
+  int numFinished = 0;
+  do {
+    if (poll(scheduler->pollFds, scheduler->numRunning, timeout) == -1 &&
+        errno != EINTR) {
+      perror("poll");
+      return numFinished;
+    }
+    int kept = 0;
+    for (int i = 0; i < scheduler->numRunning; i++) {
+      struct UqTask *task = scheduler->running[i];
+      int status = 0;
+      pid_t reaped = 0;
+      if (task->pidfd >= 0) {
+        if (scheduler->pollFds[i].revents & POLLIN) {
+          reaped = waitpid(task->pid, &status, 0);
+        }
+      } else {
+        reaped = waitpid(task->pid, &status, WNOHANG);
+      }
+      if (reaped != task->pid) {
+        scheduler->running[kept] = task;
+        scheduler->pollFds[kept++] = scheduler->pollFds[i];
+        continue;
+      }
+      if (task->pidfd >= 0) {
+        close(task->pidfd);
+        task->pidfd = -1;
+      }
+      task->exitStatus =
+          WIFEXITED(status) ? WEXITSTATUS(status) : SIGNAL_EXIT_NUM;
+      scheduler->finished[numFinished++] = task;
+    }
+    scheduler->numRunning = kept;
+  } while (block && numFinished == 0);
+  return numFinished;
+}
+
+// Reaps the running tasks which have finished, waiting for one to first if
+// asked to and none failed to fork, then fills their slots from the queue and
+// runs the callbacks of the reaped tasks and those which failed to fork.
+// Callbacks run last so they may submit more tasks.
+// Inputs: scheduler - scheduler to update
+//         block - true to wait until a task finishes
+void uq_step(struct UqScheduler *scheduler, bool block) {
+  uq_start_queued(scheduler);
+  int numFinished =
+      uq_reap_finished(scheduler, block && !scheduler->failedHead);
+  uq_start_queued(scheduler);
+
+  // tasks which fail to fork from inside these callbacks wait for the next step
+  struct UqTask *failed = scheduler->failedHead;
+  scheduler->failedHead = NULL;
+  scheduler->failedTail = NULL;
+  scheduler->numFailed = 0;
+  for (int i = 0; i < numFinished; i++) {
+    uq_task_finished(scheduler, scheduler->finished[i]);
+  }
+  while (failed) {
+    struct UqTask *task = failed;
+    failed = task->nextQueued;
+    task->nextQueued = NULL;
+    uq_task_finished(scheduler, task);
+  }
+}
+
+// Submits a task, starting it straight away if there is a free job slot
+// Inputs: scheduler - scheduler to run the task
+//         argv - NULL terminated command and arguments, copied
+//         stdoutFile - file to send stdout to, or NULL to keep ours
+//         stderrFile - file to send stderr to, or NULL to keep ours
+//         callback - called when the task finishes, or NULL
+//         data - passed to callback
+// Returns: handle of the task, or NULL if argv is empty
+struct UqTask *uq_submit(struct UqScheduler *scheduler, char *const argv[],
+                         const char *stdoutFile, const char *stderrFile,
+                         UqTaskCallback callback, void *data) {
+  if (!argv || !argv[0]) {
+    return NULL;
+  }
+  struct UqTask *task = (struct UqTask *)calloc(1, sizeof(struct UqTask));
+  int numArgs = 0;
+  while (argv[numArgs]) {
+    numArgs++;
+  }
+  task->argv = (char **)malloc((numArgs + NULL_TERMINATOR) * sizeof(char *));
+  for (int i = 0; i < numArgs; i++) {
+    task->argv[i] = strdup(argv[i]);
+  }
+  task->argv[numArgs] = NULL;
+  task->stdoutFile = stdoutFile ? strdup(stdoutFile) : NULL;
+  task->stderrFile = stderrFile ? strdup(stderrFile) : NULL;
+  task->callback = callback;
+  task->data = data;
+  task->state = UQ_TASK_QUEUED;
+  task->pidfd = -1;
+  task->exitStatus = -1;
+
+  task->next = scheduler->tasks;
+  if (scheduler->tasks) {
+    scheduler->tasks->prev = task;
+  }
+  scheduler->tasks = task;
+
+  if (scheduler->queueTail) {
+    scheduler->queueTail->nextQueued = task;
+  } else {
+    scheduler->queueHead = task;
+  }
+  scheduler->queueTail = task;
+  scheduler->numQueued++;
+
+  uq_start_queued(scheduler);
+  return task;
+}
+
+// Submits a task written as an argsfile line, with the same quoting and
+// >file and 2>file redirects. @ directives are dropped, as they are for
+// tasks read from stdin.
+// Inputs: scheduler - scheduler to run the task
+//         line - task line
+//         callback - called when the task finishes, or NULL
+//         data - passed to callback
+// Returns: handle of the task, or NULL if the line has no command
+struct UqTask *uq_submit_line(struct UqScheduler *scheduler, const char *line,
+                              UqTaskCallback callback, void *data) {
+  char *copy = strdup(line);
+  copy[strcspn(copy, "\n")] = '\0';
+  char *processedLine = modify_string(copy);
+  int numTokens = 0;
+  char **tokens = split_space_not_quote(processedLine, &numTokens);
+
+  char **argv = (char **)malloc((numTokens + NULL_TERMINATOR) *
+                                sizeof(char *));
+  const char *stdoutTarget = NULL, *stderrTarget = NULL;
+  int numArgs = 0;
+  for (int j = 0; j < numTokens; j++) {
+    if (tokens[j][0] == stdoutFile) {
+      stdoutTarget = tokens[j] + STDOUT_FILE_HEADER_LENGTH;
+    } else if (strncmp(tokens[j], stderrFile, 2) == 0) {
+      stderrTarget = tokens[j] + STDERR_FILE_HEADER_LENGTH;
+    } else if (!is_task_directive(tokens[j])) {
+      argv[numArgs++] = tokens[j];
+    }
+  }
+  argv[numArgs] = NULL;
+
+  struct UqTask *task = uq_submit(scheduler, argv, stdoutTarget, stderrTarget,
+                                  callback, data);
+  free((void *)argv);
+  free((void *)tokens);
+  free(processedLine);
+  free(copy);
+  return task;
+}
+
+// Reaps finished tasks and starts queued ones without blocking
+// Inputs: scheduler - scheduler to update
+// Returns: number of tasks running or queued
+int uq_poll(struct UqScheduler *scheduler) {
+  uq_step(scheduler, false);
+  return scheduler->numRunning + scheduler->numQueued + scheduler->numFailed;
+}
+
+// Waits for a task to finish
+// Inputs: scheduler - scheduler running the task
+//         task - task to wait for
+// Returns: exit status of the task, or UQ_SIGNAL_EXIT_STATUS
+int uq_wait(struct UqScheduler *scheduler, struct UqTask *task) {
+  while (task->state != UQ_TASK_FINISHED) {
+    uq_step(scheduler, true);
+  }
+  return task->exitStatus;
+}
+
+// Waits for every submitted task to finish
+// Inputs: scheduler - scheduler to wait for
+// Returns: exit status of the last task to finish, or 0 if there were none
+int uq_wait_all(struct UqScheduler *scheduler) {
+  while (scheduler->numRunning + scheduler->numQueued + scheduler->numFailed >
+         0) {
+    uq_step(scheduler, true);
+  }
+  return scheduler->lastExitStatus;
+}
+
+// Returns the exit status of a task
+// Inputs: task - task to check
+// Returns: exit status, or -1 if the task hasn't finished
+int uq_task_status(const struct UqTask *task) {
+  return task->state == UQ_TASK_FINISHED ? task->exitStatus : -1;
+}
+
+// Returns the process running a task
+// Inputs: task - task to check
+// Returns: pid, or 0 if the task hasn't started
+pid_t uq_task_pid(const struct UqTask *task) {
+  return task->pid;
+}
+
+// Frees a finished task's handle. Handles of unfinished tasks are left alone.
+// Inputs: scheduler - scheduler which ran the task
+//         task - finished task
+void uq_task_free(struct UqScheduler *scheduler, struct UqTask *task) {
+  if (!task || task->state != UQ_TASK_FINISHED) {
+    return;
+  }
+  if (task->prev) {
+    task->prev->next = task->next;
+  } else {
+    scheduler->tasks = task->next;
+  }
+  if (task->next) {
+    task->next->prev = task->prev;
+  }
+  for (int i = 0; task->argv[i]; i++) {
+    free(task->argv[i]);
+  }
+  free((void *)task->argv);
+  free(task->stdoutFile);
+  free(task->stderrFile);
+  free(task);
+}
+
+// Waits for every task to finish, then frees the scheduler and its handles
+// Inputs: scheduler - scheduler to destroy
+void uq_scheduler_destroy(struct UqScheduler *scheduler) {
+  if (!scheduler) {
+    return;
+  }
+  uq_wait_all(scheduler);
+  while (scheduler->tasks) {
+    uq_task_free(scheduler, scheduler->tasks);
+  }
+  free((void *)scheduler->running);
+  free(scheduler->pollFds);
+  free((void *)scheduler->finished);
+  free(scheduler);
+}
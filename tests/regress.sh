@@ -0,0 +1,99 @@
+#!/bin/sh
+#
+# regress.sh
+#
+# Runs uqparallel on small task lists and checks what it does. Prints one
+# line per check and exits non-zero if any of them failed.
+# Usage: tests/regress.sh [uqparallel-binary]
+
+binary=${1:-./uqparallel}
+# some checks run from other directories
+case $binary in
+  /*) ;;
+  *) binary=$(pwd)/$binary ;;
+esac
+workDir=$(mktemp -d)
+trap 'rm -rf "$workDir"' EXIT
+failures=0
+
+# compares the result of a check with what was expected
+# Inputs: $1 - name of the check, $2 - expected, $3 - actual
+check() {
+  if [ "$2" = "$3" ]; then
+    echo "ok $1"
+  else
+    echo "FAIL $1: expected \"$2\", got \"$3\""
+    failures=$((failures + 1))
+  fi
+}
+
+# --exit-on-error starts nothing after the first failure and exits with its
+# status
+printf '%s\n' 'sh -c "exit 3"' 'echo ran' > "$workDir/fail.txt"
+output=$("$binary" --joblimit 1 --exit-on-error --argsfile "$workDir/fail.txt")
+check "exit-on-error status" 3 $?
+check "exit-on-error skips later tasks" "" "$output"
+output=$("$binary" --joblimit 2 --dispatchers 2 --exit-on-error \
+    --argsfile "$workDir/fail.txt")
+check "exit-on-error status with dispatchers" 3 $?
+
+# without --exit-on-error every task runs
+output=$("$binary" --joblimit 1 --argsfile "$workDir/fail.txt")
+check "tasks run after a failure" ran "$output"
+
+# dry runs leave directives out of the printed tasks, as running does
+printf '%s\n' 'echo a @prio=3 "x y"' '@prio=1 echo b' > "$workDir/dirs.txt"
+output=$("$binary" --dry-run --directives --argsfile "$workDir/dirs.txt")
+check "dry run hides argsfile directives" '1: echo a "x y"
+2: echo b' "$output"
+output=$("$binary" --dry-run --directives < "$workDir/dirs.txt")
+check "dry run hides stdin directives" '1: echo a "x y"
+2: echo b' "$output"
+
+# a task's working directory is also its PWD
+mkdir "$workDir/dir"
+physicalDir=$(cd "$workDir" && pwd -P)
+output=$(cd "$workDir/dir" && "$binary" --workdir .. printenv ::: PWD)
+check "workdir sets PWD" "$physicalDir" "$output"
+echo "printenv PWD @cwd=$workDir/dir" > "$workDir/cwd.txt"
+output=$("$binary" --directives --argsfile "$workDir/cwd.txt")
+check "cwd directive sets PWD" "$physicalDir/dir" "$output"
+
+# staged copies keep the execute permission
+printf '#!/bin/sh\necho staged\n' > "$workDir/script.sh"
+chmod 755 "$workDir/script.sh"
+echo "$workDir/script.sh @stage-in=$workDir/script.sh" > "$workDir/stage.txt"
+output=$("$binary" --directives --stage-dir "$workDir" \
+    --argsfile "$workDir/stage.txt")
+check "staged script runs" staged "$output"
+
+# a task's own PATH is searched for its command, not ours
+mkdir "$workDir/bin"
+printf '#!/bin/sh\necho fake\n' > "$workDir/bin/ls"
+chmod 755 "$workDir/bin/ls"
+output=$("$binary" --env "PATH=$workDir/bin" ls ::: x)
+check "env PATH finds the command" fake "$output"
+output=$("$binary" --dispatchers 2 --env "PATH=$workDir/bin" ls ::: x)
+check "env PATH finds the command with dispatchers" fake "$output"
+echo "ls @env=PATH=$workDir/bin" > "$workDir/path.txt"
+output=$("$binary" --directives --argsfile "$workDir/path.txt")
+check "env directive PATH finds the command" fake "$output"
+
+# the losing copy of a task is killed along with what it started
+cat > "$workDir/slow.sh" <<EOF
+#!/bin/sh
+if [ "\$1" = 5 ] && mkdir "$workDir/first" 2>/dev/null; then
+  (sleep 1; echo leaked > "$workDir/leak") &
+  sleep 10
+fi
+echo "\$1"
+EOF
+chmod 755 "$workDir/slow.sh"
+output=$("$binary" --joblimit 4 --speculate 2 "$workDir/slow.sh" ::: 1 2 3 4 5 |
+    sort | tr '\n' ' ')
+check "speculated task output" "1 2 3 4 5 " "$output"
+sleep 2
+output=$(cat "$workDir/leak" 2>/dev/null)
+check "killed copy leaves nothing running" "" "$output"
+
+exit $((failures > 0))
@@ -1,35 +1,299 @@
+#define _GNU_SOURCE
+
 #include <csse2310a3.h>
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/prctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+// USDT probes for perf and bpftrace, built in whenever <sys/sdt.h> exists.
+// Each probe is a single nop until a tracer attaches. Build with -DUQ_NO_TRACE
+// to leave them out.
+#if !defined(UQ_NO_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define UQ_TRACE(...) STAP_PROBEV(uqparallel, __VA_ARGS__)
+#endif
+#endif
+#ifndef UQ_TRACE
+#define UQ_TRACE(name, ...) uq_trace_disabled(0, __VA_ARGS__)
+// Stands in for a probe when tracing is not built in so that its arguments
+// still count as used
+static inline void uq_trace_disabled(int unused, ...) {
+  (void)unused;
+}
+#endif
+
 const char *const jobLimit = "--joblimit";
 const char *const pipeOption = "--pipe";
 const char *const argsFile = "--argsfile";
 const char *const dryRun = "--dry-run";
 const char *const exitOnError = "--exit-on-error";
+const char *const dispatchers = "--dispatchers";
+const char *const zygote = "--zygote";
+const char *const zygoteWorker = "--zygote-worker";
+const char *const serve = "--serve";
+const char *const workers = "--workers";
+const char *const compileArgsFile = "--compile-argsfile";
+const char *const shard = "--shard";
+const char *const progress = "--progress";
+const char *const statsFd = "--stats-fd";
+const char *const statsSocket = "--stats-socket";
+const char *const latencyReportOption = "--latency-report";
+const char *const orderOption = "--order";
+const char *const jobLogOption = "--joblog";
+const char *const isolateOption = "--isolate";
+const char *const isolateReadOnlyOption = "--isolate-ro";
+const char *const envOption = "--env";
+const char *const workdirOption = "--workdir";
+const char *const stageDirOption = "--stage-dir";
+const char *const stageAheadOption = "--stage-ahead";
+const char *const nullOption = "--null";
+const char *const nullShortOption = "-0";
+const char *const delimiterOption = "--delimiter";
+const char *const resultsOption = "--results";
+const char *const slotsGroupOption = "--slots-group";
+const char *const classOption = "--class";
+const char *const rateOption = "--rate";
+const char *const speculateOption = "--speculate";
+const char *const uniqueOption = "--unique";
+const char *const uniqueFalsePositiveOption = "--unique-fp";
+const char *const directivesOption = "--directives";
+const char *const helpOption = "--help";
 const char *const perTask = ":::";
 const char stdoutFile = '>';
 const char *const stderrFile = "2>";
+// Argsfile tokens which set a property of their task instead of being passed
+// to the command. They are only looked for with --directives, otherwise they
+// are ordinary arguments.
+const char *const priorityDirective = "@prio=";
+const char *const idDirective = "@id=";
+const char *const afterDirective = "@after=";
+const char *const replicasDirective = "@replicas=";
+const char *const splitDirective = "@split=";
+const char *const envDirective = "@env=";
+const char *const cwdDirective = "@cwd=";
+const char *const stageInDirective = "@stage-in=";
+const char *const stageOutDirective = "@stage-out=";
+const char *const classDirective = "@class=";
+const char *const taskDirectives[] = {
+    "@prio=", "@id=",  "@after=",     "@replicas=",   "@split=",
+    "@env=",  "@cwd=", "@stage-in=", "@stage-out=", "@class=", NULL};
+// Ways a --pipe stage with replicas shares its input, indexed by SPLIT_*
+const char *const splitNames[] = {"rr", "hash", "tee", NULL};
 const char *const usageErrorMessage =
     "Usage: ./uqparallel [--pipe] [--exit-on-error] [--joblimit n] "
-    "[--dry-run] [--argsfile argument-file] [cmd [fixed-args ...]] [::: "
+    "[--dispatchers n] [--zygote] [--zygote-worker worker-cmd] "
+    "[--workers address,...] [--serve address] [--dry-run] "
+    "[--argsfile argument-file] [--compile-argsfile output-file] "
+    "[--shard k/n[:mod|:range|:hash]] [--progress] [--stats-fd fd] "
+    "[--stats-socket address] [--latency-report] "
+    "[--order priority|ljf:joblog|shuffle[:seed]] [--joblog file] "
+    "[--isolate] [--isolate-ro] [--env name=value] [--workdir dir] "
+    "[--stage-dir dir] [--stage-ahead n] [-0|--null|--delimiter c] "
+    "[--results dir] [--slots-group name[:n]] [--class name=n] "
+    "[--rate n/s|n/m|n/h] [--speculate factor] [--unique] "
+    "[--unique-fp rate] [--directives] "
+    "[cmd [fixed-args ...]] [::: "
     "per-task-args ...]\n";
+// Printed after the usage line by --help, see readme.md for details
+const char *const helpMessage =
+    "  --joblimit n           run at most n tasks at once (1-120)\n"
+    "  --dispatchers n        start tasks from n threads\n"
+    "  --pipe                 chain the tasks into one pipeline\n"
+    "  --exit-on-error        start no more tasks after one fails\n"
+    "  --zygote               run tasks on long-lived shell workers\n"
+    "  --zygote-worker cmd    use cmd as the zygote worker script\n"
+    "  --serve address        run tasks sent by --workers clients\n"
+    "  --workers address,...  send tasks to --serve daemons\n"
+    "  --dry-run              print the tasks instead of running them\n"
+    "  --argsfile file        read one task per line from file\n"
+    "  --compile-argsfile out write the argsfile's tasks to out, compiled\n"
+    "  --shard k/n            run only the kth of n parts of the tasks\n"
+    "  --progress             show progress on stderr\n"
+    "  --stats-fd fd          write JSON statistics to fd\n"
+    "  --stats-socket address answer statistics requests on address\n"
+    "  --latency-report       print scheduling latency percentiles at\n"
+    "                         exit; tracking costs about 15us per task\n"
+    "  --order mode           run tasks by priority, ljf:joblog or shuffle\n"
+    "  --joblog file          log each task's start, runtime and status\n"
+    "  --isolate              run tasks in per-slot namespaces\n"
+    "  --isolate-ro           --isolate with a read-only working directory\n"
+    "  --env name=value       set a variable for every task\n"
+    "  --workdir dir          run every task in dir\n"
+    "  --stage-dir dir        stage task files through dir\n"
+    "  --stage-ahead n        stage inputs of up to n tasks ahead\n"
+    "  -0, --null             read NUL separated records\n"
+    "  --delimiter c          read records separated by c\n"
+    "  --results dir          keep each task's output and status in dir\n"
+    "  --slots-group name[:n] share n task slots with other instances\n"
+    "  --class name=n         run at most n tasks of a class at once\n"
+    "  --rate n/s|n/m|n/h     start at most n tasks per second/minute/hour\n"
+    "  --speculate factor     rerun tasks slower than factor times median\n"
+    "  --unique               run each distinct task once\n"
+    "  --unique-fp rate       --unique false positive rate, 0 for exact\n"
+    "  --directives           read @name= tokens as task directives\n";
+// First bytes of a compiled argsfile, followed by a version number
+const char compiledMagic[] = "UQPTASKS";
+// Shared memory file of a --slots-group, followed by the group's name
+const char *const slotGroupPathPrefix = "/dev/shm/uqparallel-";
+// Worker run by --zygote: runs each task line in a subshell, so no exec is
+// needed for builtins, with uqparallel's stdin on fd 4, and reports its exit
+// status on fd 3. A command which can't be run exits with SIGNAL_EXIT_NUM as
+// it would from exec_child(), and a task killed by a signal is reported as
+// "signal N".
+const char *const zygoteShellScript =
+    "uqparallelRun() { "
+    "case $1 in */*) [ -f \"$1\" ] && [ -x \"$1\" ];; "
+    "*) command -v \"$1\" >/dev/null;; esac || "
+    "{ echo \"uqparallel: cannot execute \\\"$1\\\"\" >&2; exit 78; }; "
+    "\"$@\"; }; "
+    "while IFS= read -r uqparallelTask; do "
+    "(eval \"uqparallelRun $uqparallelTask\") <&4 4<&- 3>&-; "
+    "uqparallelStatus=$?; "
+    "if [ $uqparallelStatus -gt 128 ]; then "
+    "echo \"signal $((uqparallelStatus - 128))\" >&3; "
+    "else echo $uqparallelStatus >&3; fi; done";
 
 #define JOB_LIMIT_MIN 1
 #define JOB_LIMIT_MAX 120
 #define JOB_LIMIT_DEFAULT 120
+#define DISPATCHERS_MIN 1
+#define DISPATCHERS_MAX 64
+#define DISPATCHERS_DEFAULT 1
+#define STEAL_RETRY (-2)
+#define NO_TASK (-1)
+#define PIDFD_FALLBACK_POLL_MS 10
+#define ZYGOTE_STATUS_FD 3
+#define ZYGOTE_INPUT_FD 4
+#define ZYGOTE_SIGNAL_PREFIX "signal "
+#define ZYGOTE_STATUS_BUFFER 32
+#define SHELL_QUOTE_ESCAPE_LENGTH 4
+#define WORKER_ERROR_EXIT_NUM 20
+#define DEPENDENCY_ERROR_EXIT_NUM 21
+#define ISOLATION_ERROR_EXIT_NUM 22
+#define ENV_SPARE_SLOTS 16
+#define STAGE_AHEAD_MIN 1
+#define STAGE_AHEAD_MAX 1024
+#define STAGE_AHEAD_DEFAULT 4
+#define STAGE_PENDING 0
+#define STAGE_BUSY 1
+#define STAGE_READY 2
+#define STAGE_FAILED 3
+#define RECORD_BLOCK_SIZE 65536
+#define COMMAND_PATHS_MIN 16
+#define REDIRECT_TARGETS_MIN 16
+#define RELAY_MAX_EVENTS 64
+#define SLOT_GROUP_MAX 4096
+#define SLOT_GROUP_NAME_MAX 200
+#define SLOT_GROUP_RECLAIM_MS 100
+#define SLOT_GROUP_POLL_MS 10
+#define NO_CLASS (-1)
+#define SPECULATE_MIN_RUNTIMES 3
+#define NO_COPY 0
+#define NEVER_COPY (-1)
+#define NUM_FORWARDED_SIGNALS 5
+#define UNIQUE_SET_MIN 1024
+#define UNIQUE_EXACT_MAX (1 << 20)
+#define UNIQUE_DEFAULT_FP_RATE 0.000001
+#define UNIQUE_MAX_FILTERS 4
+#define BLOOM_WORD_BITS 64
+// bits per line for each hash function, 1 / ln 2
+#define BLOOM_BITS_PER_HASH 1.4427
+#define HEX_BASE 16
+#define TASK_WAITING 0
+#define TASK_STARTED 1
+#define TASK_CANCELLED 2
+#define TASK_ID_TABLE_MIN 64
+#define SPLIT_RR 0
+#define SPLIT_HASH 1
+#define SPLIT_TEE 2
+#define SPLICE_CHUNK 65536
+#define FRAME_HELLO 1
+#define FRAME_TASK 2
+#define FRAME_OUTPUT 3
+#define FRAME_RESULT 4
+#define FRAME_PREFIX_LENGTH 5
+#define FRAME_READ_SIZE 65536
+#define NUM_OUTPUT_STREAMS 2
+#define POLLFDS_PER_REMOTE_TASK 3
+#define COMPILED_MAGIC_LENGTH 8
+#define COMPILED_VERSION 1
+#define COMPILED_COUNT_OFFSET 16
+#define COMPILED_HEADER_LENGTH 24
+#define SHARD_MOD 0
+#define SHARD_RANGE 1
+#define SHARD_HASH 2
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+#define HASH_MIX_SHIFT 33
+#define HASH_MIX_MULTIPLIER 0xff51afd7ed558ccdULL
+#define PROGRESS_INTERVAL_MS 500
+#define STATS_REQUEST_TIMEOUT_MS 100
+#define STATS_BUFFER_SIZE 64
+#define STATS_RESPONSE_SIZE 1024
+#define NANOSECONDS_PER_SECOND 1e9
+#define NANOSECONDS_PER_MICROSECOND 1000
+#define NANOSECONDS_PER_MILLISECOND 1000000
+#define NANOSECONDS_PER_SECOND_U64 1000000000ULL
+#define LATENCY_QUEUE 0
+#define LATENCY_EXEC 1
+#define LATENCY_RUN 2
+#define LATENCY_REAP 3
+#define NUM_LATENCY_STAGES 4
+#define LATENCY_SUB_BUCKET_BITS 4
+#define LATENCY_SUB_BUCKETS 16
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)
+#define LATENCY_EVENT_EXEC 0
+#define LATENCY_EVENT_EXIT 1
+#define LATENCY_EVENT_WAKE UINT64_MAX
+#define LATENCY_MAX_EVENTS 64
+#define LATENCY_DURATION_SIZE 16
+#define ORDER_NONE 0
+#define ORDER_PRIORITY 1
+#define ORDER_LJF 2
+#define ORDER_SHUFFLE 3
+#define NUM_ORDER_MODES 4
+#define SPLITMIX_INCREMENT 0x9e3779b97f4a7c15ULL
+#define SPLITMIX_MULTIPLIER_1 0xbf58476d1ce4e5b9ULL
+#define SPLITMIX_MULTIPLIER_2 0x94d049bb133111ebULL
+#define JOBLOG_FIELDS 9
+#define JOBLOG_RUNTIME_FIELD 3
+#define MILLISECONDS_PER_SECOND 1000
+#define SECONDS_PER_MINUTE 60
+#define SECONDS_PER_HOUR 3600
 #define USAGE_ERROR_EXIT_NUM 10
 #define FILE_READ_ERROR_EXIT_NUM 18
+#define FILE_WRITE_ERROR_EXIT_NUM 19
 #define EMPTY_COMMAND_EXIT_NUM 94
 #define SIGNAL_EXIT_NUM 78
 #define PER_TASK_LENGTH 3
@@ -44,6 +308,37 @@ const char *const usageErrorMessage =
 #define FILE_ARGS 0
 #define STDIN_ARG 1
 #define READ_WRITE_PERMISSIONS 0600
+#define FILE_PERMISSION_BITS 0777
+
+// An argsfile written by --compile-argsfile and mapped into memory. The file
+// holds a header (magic, version, task count), an index of task offsets and
+// then each task as argc, stdout and stderr targets and the arguments, all in
+// host byte order.
+struct CompiledArgsFile {
+  char *data;
+  size_t size;
+  uint64_t numTasks;
+  const uint64_t *index;
+
+  // tasks belonging to this shard, either every stride'th task from first or
+  // the listed tasks when selected isn't NULL
+  uint64_t numSelected;
+  uint64_t first;
+  uint64_t stride;
+  uint64_t *selected;
+};
+
+// Names of the --order policies, indexed by ORDER_*
+const char *const orderNames[NUM_ORDER_MODES] = {"", "priority", "ljf",
+                                                 "shuffle"};
+// Column headings of a --joblog file, the same as GNU parallel's
+const char *const jobLogHeader =
+    "Seq\tHost\tStarttime\tJobRuntime\tSend\tReceive\tExitval\tSignal\t"
+    "Command\n";
+
+// Names of the --latency-report stages, indexed by LATENCY_*
+const char *const latencyStageNames[NUM_LATENCY_STAGES] = {
+    "queue-to-fork", "fork-to-exec", "runtime", "exit-to-reap"};
 
 // Structure which contains given command line arguments, aka CLArgs
 struct CLArgs {
@@ -52,11 +347,63 @@ struct CLArgs {
   bool exitOnErrorPresent;
   bool jobLimitPresent;
   int jobLimit;
+  bool dispatchersPresent;
+  int numDispatchers;
+  bool zygotePresent;
+  char *zygoteWorker;
+  char *serveAddress;
+  char *workerAddresses;
 
   bool argsFilePresent;
   char *fileName;
   int numFileArgs;
   char **fileArgs;
+  struct CompiledArgsFile *compiledFile;
+  char *compileOutput;
+
+  bool shardPresent;
+  int shardIndex;
+  int shardCount;
+  int shardMode;
+
+  bool progressPresent;
+  int statsFd;
+  char *statsSocket;
+  bool latencyReportPresent;
+
+  int orderMode;
+  char *orderJobLog;
+  uint64_t orderSeed;
+  char *jobLogFile;
+
+  bool isolatePresent;
+  bool isolateReadOnly;
+  int numEnvTemplates;
+  char **envTemplates;
+  char *workdirTemplate;
+  char *stageDir;
+  bool stageAheadPresent;
+  int stageAhead;
+  // set by -0 and --delimiter, every record is then exactly one argument
+  bool delimiterPresent;
+  char delimiter;
+  char *resultsDir;
+  char *slotsGroup;
+  int slotsGroupSize;
+  // --class can be given once for each class, as NAME=N
+  int numClassLimits;
+  char **classLimits;
+  // nanoseconds between spawns allowed by --rate, 0 if there is no limit
+  uint64_t rateInterval;
+  // multiple of the median runtime given to --speculate, 0 if not speculating
+  double speculateFactor;
+  // set by --unique and --unique-fp, either turns on --unique. A rate of 0
+  // keeps every line exactly.
+  bool uniquePresent;
+  bool uniqueFalsePositivePresent;
+  double uniqueFalsePositiveRate;
+  // set by --directives, @name= tokens on a line are read as task directives
+  bool directivesPresent;
 
   bool commandPresent;
   char *command;
@@ -76,8 +423,1025 @@ struct PArgs {
   int stdinArgsPosition;
   char **stdoutFiles;
   char **stderrFiles;
+  const struct CompiledArgsFile *compiledFile;
+  char **prefixArgs;
+  int numPrefixArgs;
+
+  // set by @prio= directives, NULL if no task has one
+  long *priorities;
+  // tasks in the order --order runs them, NULL to run them as given
+  int *order;
+  // set by @id= and @after= directives, NULL if no task has one
+  char **taskIds;
+  char **taskAfter;
+  struct TaskGraph *graph;
+  // set by @replicas= and @split= directives on --pipe stages
+  int *replicas;
+  int *splitModes;
+  // set by @env= and @cwd= directives, each taskEnv entry is NULL terminated
+  char ***taskEnv;
+  char **taskCwd;
+  // set by @stage-in= and @stage-out= directives, each entry NULL terminated
+  char ***stageIn;
+  char ***stageOut;
+  // set by @class= directives, NULL if no task has one
+  char **classNames;
+};
+
+// Dependencies between tasks declared with @id= and @after=, in compressed
+// sparse row form: the tasks which wait for task i are
+// dependents[firstDependent[i]] up to dependents[firstDependent[i + 1]]
+struct TaskGraph {
+  int *firstDependent;
+  int *dependents;
+  int *numParents;
+};
+
+// Counters describing the progress of a run. They are only ever updated with
+// relaxed atomic adds, so recording never slows down the spawn loops.
+struct RunStats {
+  long total;
+  long started;
+  long done;
+  long failed;
+};
+
+// A copy of RunStats taken for reporting, with derived rates
+struct StatsSnapshot {
+  long total;
+  long started;
+  long running;
+  long done;
+  long failed;
+  double elapsed;
+  double rate;
+  double eta;
+};
+
+// State of the thread which prints progress and serves statistics
+struct StatsReporter {
+  bool running;
+  pthread_t thread;
+  int wakePipe[2];
+  int listenFd;
+  int statsFd;
+  bool progress;
+  struct timespec startTime;
+};
+
+// Log-bucketed histogram of nanosecond latencies in the style of
+// HdrHistogram. Values below LATENCY_SUB_BUCKETS are exact and larger values
+// keep their top LATENCY_SUB_BUCKET_BITS bits after the leading one, so a
+// bucket is always within 1/16 of the values in it.
+struct LatencyHistogram {
+  uint64_t counts[LATENCY_BUCKETS];
+  uint64_t total;
+  uint64_t max;
+};
+
+// Timestamps of one running job for --latency-report
+struct LatencyJob {
+  bool inUse;
+  uint32_t generation;
+  pid_t pid;
+  int execFd;
+  int pidfd;
+  uint64_t forkedAt;
+  uint64_t execAt;
+  uint64_t exitedAt;
+};
+
+// Taken just before a fork and handed to latency_spawned() afterwards
+struct LatencySpawn {
+  int execPipe[2];
+  uint64_t queuedAt;
+  uint64_t forkedAt;
+};
+
+// State of --latency-report. A watcher thread timestamps the exec and exit of
+// each job from a CLOEXEC pipe and a pidfd, so the spawn loops never block.
+struct LatencyReport {
+  bool enabled;
+  pthread_t thread;
+  int epollFd;
+  int wakePipe[2];
+  pthread_mutex_t lock;
+  struct LatencyJob jobs[JOB_LIMIT_MAX];
+  struct LatencyHistogram histograms[NUM_LATENCY_STAGES];
+};
+
+// A task which is running while --joblog is writing a job log
+struct JobLogEntry {
+  bool inUse;
+  pid_t pid;
+  int task;
+  double startTime;
+  struct timespec started;
+  char *command;
+};
+
+// State of --joblog. Entries are matched to finished tasks by pid, or by task
+// index for tasks run by --serve daemons.
+struct JobLog {
+  FILE *file;
+  pthread_mutex_t lock;
+  struct JobLogEntry *running;
+  int capacity;
+};
+
+// Shares the output of one --pipe stage between the replicas of the next.
+// A thread moves the data with tee and splice, so it never passes through a
+// userspace buffer except to find line boundaries.
+struct Distributor {
+  int source;
+  int *targets;
+  int numTargets;
+  int mode;
+  pthread_t thread;
+};
+
+// Merges the outputs of the replicas of one --pipe stage into the next stage's
+// input a line at a time, so lines written by different replicas never mix.
+struct Collector {
+  int *sources;
+  int numSources;
+  int target;
+  pthread_t thread;
+};
+
+// Binary max-heap of task indices ordered by a key per task. Ties go to the
+// lower index, so tasks with equal keys keep their given order.
+struct TaskHeap {
+  int *tasks;
+  int size;
+  const long *keys;
+};
+
+// Runtimes of the commands in a job log, in an open addressing hash table
+struct RuntimeEstimates {
+  char **commands;
+  long *runtimes;
+  size_t capacity;
+  size_t count;
+  long maxRuntime;
+};
+
+// Namespaces kept alive for one job slot by --isolate. A holder process
+// owns the mount and network namespaces and its child is init of the PID
+// namespace, so the slot lives until the holder goes.
+struct IsolationSlot {
+  bool created;
+  pid_t holder;
+  pid_t job;
+  int pidNs;
+  int netNs;
+  int mntNs;
+};
+
+// State of --isolate. Each slot's namespaces are made the first time it is
+// used, after which starting a job in them only takes a few setns calls.
+struct Isolation {
+  bool enabled;
+  bool readOnly;
+  pthread_mutex_t lock;
+  char *workdir;
+  int ownPidNs;
+  int keeperPipe[2];
+  struct IsolationSlot slots[JOB_LIMIT_MAX];
+};
+
+// Environment shared by every task, built once by build_task_environment().
+// A child patches its own copy of the pointer array, so no task copies
+// environ.
+struct TaskEnvironment {
+  char **base;
+  int numBase;
+  int capacity;
+  char **templates;
+  int numTemplates;
+  char *workdir;
+  int numPrefixArgs;
+};
+
+// A running task with staged files, so they can be collected once it's reaped
+struct StagedJob {
+  pid_t pid;
+  int task;
+};
+
+// State of input and output staging. A stager thread copies the inputs of
+// tasks a few places ahead of the one being started into a scratch directory,
+// and moves outputs back and cleans up after tasks finish, so the copying
+// overlaps with tasks running.
+struct Staging {
+  bool enabled;
+  struct PArgs *pArgs;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  char *root;
+  int ahead;
+  // STAGE_* state and the staged paths of the inputs then outputs of each task
+  int *states;
+  char ***stagedPaths;
+  int nextPosition;
+  int numStarted;
+  int *finished;
+  int numFinished;
+  struct StagedJob running[JOB_LIMIT_MAX];
+  bool stopping;
+};
+
+// Output files named by > and 2> on argsfile lines, in an open addressing
+// hash table. A file used by more than one redirect is opened and truncated
+// once by the parent, and tasks write to it through pipes to a relay thread.
+// The relay only writes whole lines, so lines from tasks sharing the file
+// never mix. With --isolate, tasks open shared files themselves instead.
+struct Redirects {
+  pthread_mutex_t lock;
+  char **paths;
+  // redirects counted while parsing, 0 for targets first seen at spawn time
+  int *uses;
+  int *fds;
+  size_t capacity;
+  size_t count;
+  bool relayStarted;
+  pthread_t relayThread;
+  int epollFd;
+  int wakePipe[2];
+  // pipes the relay still reads, guarded by lock
+  struct RelaySource *sources;
+};
+
+// One task's output pipe read by the relay, with the part of a line which
+// hasn't been written yet
+struct RelaySource {
+  int fd;
+  int target;
+  char *carry;
+  size_t carryLength;
+  size_t carryCapacity;
+  struct RelaySource *prev;
+  struct RelaySource *next;
+};
+
+// Descriptors a child's stdout and stderr go to, from redirect_prepare().
+// Relayed descriptors are pipes which the parent closes after forking.
+// Targets the child opens itself are appended to rather than truncated when
+// append is set.
+struct TaskRedirects {
+  int fds[NUM_OUTPUT_STREAMS];
+  bool relayed[NUM_OUTPUT_STREAMS];
+  bool append[NUM_OUTPUT_STREAMS];
+};
+
+// Status of a finished task waiting to be written by the --results writer
+struct ResultRecord {
+  int number;
+  int exitStatus;
+  int signalNumber;
+  double startTime;
+  double runtime;
+};
+
+// A task which is running while --results is storing its output
+struct ResultJob {
+  pid_t pid;
+  int number;
+  double startTime;
+  struct timespec started;
+};
+
+// State of --results. Children write their output straight into their task's
+// directory, and a writer thread writes the status files of finished tasks a
+// batch at a time, so the spawn loops never wait on the filesystem.
+struct Results {
+  bool enabled;
+  char *dir;
+  int dirFd;
+  // stdin tasks all run as task 0, so they are numbered as they start
+  bool countTasks;
+  int numTasks;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  struct ResultRecord *queue;
+  int queueLength;
+  int queueCapacity;
+  struct ResultJob running[JOB_LIMIT_MAX];
+  bool stopping;
+};
+
+// Shared memory of a --slots-group. An instance takes a lease before starting
+// a task and hands it to the task's process once it is forked, so leases
+// whose owner no longer exists can be taken back after a crash.
+struct SlotGroupTable {
+  uint32_t capacity;
+  // bumped on every release, and waited on as a futex when the group is full
+  uint32_t generation;
+  uint32_t waiters;
+  pid_t owners[SLOT_GROUP_MAX];
+};
+
+// Where each command name tasks run was found on $PATH, in an open addressing
+// hash table. A name which wasn't found, or whose search reached a relative
+// $PATH entry, has a NULL path. Entries are never removed, so the paths handed
+// to children stay valid.
+struct CommandPaths {
+  pthread_mutex_t lock;
+  char **names;
+  char **paths;
+  size_t capacity;
+  size_t count;
+};
+
+// Concurrency classes from --class. A task belongs to the class named by its
+// @class= directive, or else to the one named after its command, and a class
+// never runs more than its limit of tasks at once. Tasks passed over because
+// their class is full are held in a queue for the class, so they still start
+// before anything later in the run order once it has room.
+struct TaskClasses {
+  bool enabled;
+  int count;
+  char **names;
+  int *limits;
+  int *running;
+  // class of each task, or NO_CLASS if its class has no limit
+  int *taskClass;
+  // positions in the run order of held tasks, linked through nextHeld
+  int *heldHead;
+  int *heldTail;
+  int *nextHeld;
+  // class of each running task with one, by process id
+  pid_t pids[JOB_LIMIT_MAX];
+  int pidClasses[JOB_LIMIT_MAX];
+};
+
+// Token bucket of --rate, which holds a single token. Each spawn reserves the
+// next token and sleeps until it is due, so spawns are spaced out without
+// polling and dispatcher threads share the one rate.
+struct SpawnRate {
+  bool enabled;
+  uint64_t interval;
+  uint64_t nextAt;
+  pthread_mutex_t lock;
+};
+
+// One Bloom filter of --unique, sized for capacity lines
+struct BloomFilter {
+  uint64_t *bits;
+  uint64_t numBits;
+  int numHashes;
+  uint64_t capacity;
+  uint64_t count;
+};
+
+// Tasks seen by --unique. Lines are kept exactly, in an open addressing hash
+// set, until there are UNIQUE_EXACT_MAX of them. After that, unless --unique-fp
+// gave a rate of 0, their hashes move to a scalable Bloom filter: a
+// chain of filters, each twice the size of the last with half its false
+// positive rate, so the total rate stays within the one asked for. The chain
+// stops at UNIQUE_MAX_FILTERS to bound memory, and the last filter then takes
+// every new line, its false positive rate rising as it fills.
+struct UniqueFilter {
+  bool enabled;
+  double falsePositiveRate;
+  char **lines;
+  size_t *lengths;
+  uint64_t *hashes;
+  size_t capacity;
+  size_t count;
+  struct BloomFilter *filters;
+  int numFilters;
+  bool overfull;
+};
+
+// What one process of a task under --speculate has written to stdout and
+// stderr, held back until it is known whether the process won. fds are -1
+// once closed.
+struct SpeculativeOutput {
+  int fds[NUM_OUTPUT_STREAMS];
+  char *data[NUM_OUTPUT_STREAMS];
+  size_t lengths[NUM_OUTPUT_STREAMS];
+  size_t capacities[NUM_OUTPUT_STREAMS];
+};
+
+// A task running under --speculate, and the copy of it started once it fell
+// behind. copyPid is NO_COPY until then, or NEVER_COPY if the task can't be
+// copied.
+struct SpeculativeTask {
+  int task;
+  pid_t pid;
+  int pidfd;
+  struct SpeculativeOutput output;
+  pid_t copyPid;
+  int copyPidfd;
+  struct SpeculativeOutput copyOutput;
+  struct timespec started;
+};
+
+// A process which lost to its twin and was killed, but isn't reaped yet
+struct SpeculativeLoser {
+  pid_t pid;
+  int pidfd;
+};
+
+// Signals from the terminal which --speculate passes on to its tasks
+const int forwardedSignals[NUM_FORWARDED_SIGNALS] = {SIGINT, SIGQUIT, SIGTERM,
+                                                     SIGHUP, SIGTSTP};
+
+// State of --speculate. The runtimes of finished tasks give the median, and
+// once every task has started, tasks running longer than factor times the
+// median get a copy in an idle slot. Whichever of the two finishes first is
+// the task's result, and the other is killed along with its process group.
+// Only the winner's output is passed on. Terminal signals caught while the
+// tasks are in groups of their own come through signalPipe.
+struct Speculation {
+  bool enabled;
+  double factor;
+  double *runtimes;
+  int numRuntimes;
+  double median;
+  int medianRuntimes;
+  struct SpeculativeTask running[JOB_LIMIT_MAX];
+  int numRunning;
+  struct SpeculativeLoser losers[JOB_LIMIT_MAX];
+  int numLosers;
+  // output pipes of the process being forked, from speculation_prepare()
+  struct SpeculativeOutput pending;
+  int signalPipe[2];
+  struct sigaction oldActions[NUM_FORWARDED_SIGNALS];
+  struct pollfd pollFds[3 * JOB_LIMIT_MAX + 1];
 };
 
+struct RunStats runStats;
+struct StatsReporter statsReporter;
+struct LatencyReport latencyReport;
+struct JobLog jobLog;
+struct Isolation isolation;
+struct TaskEnvironment taskEnvironment;
+struct Staging staging;
+struct CommandPaths commandPaths = {.lock = PTHREAD_MUTEX_INITIALIZER};
+struct Results results;
+struct SlotGroupTable *slotGroup;
+struct Redirects redirects = {.lock = PTHREAD_MUTEX_INITIALIZER};
+struct TaskClasses taskClasses;
+struct SpawnRate spawnRate = {.lock = PTHREAD_MUTEX_INITIALIZER};
+struct Speculation speculation;
+struct UniqueFilter uniqueFilter;
+
+// Parses a --shard value of the form k/n with an optional :mod, :range or
+// :hash suffix
+// Inputs: spec - value given to --shard
+//         index - set to the 0-based shard index
+//         count - set to the number of shards
+//         mode - set to the SHARD_* mode
+// Returns: true if spec is valid
+bool parse_shard(const char *spec, int *index, int *count, int *mode) {
+  int k;
+  int n;
+  int length = 0;
+  if (sscanf(spec, "%d/%d%n", &k, &n, &length) != 2 || n < 1 || k < 1 ||
+      k > n) {
+    return false;
+  }
+
+  *index = k - 1;
+  *count = n;
+  if (spec[length] == '\0' || strcmp(spec + length, ":mod") == 0) {
+    *mode = SHARD_MOD;
+  } else if (strcmp(spec + length, ":range") == 0) {
+    *mode = SHARD_RANGE;
+  } else if (strcmp(spec + length, ":hash") == 0) {
+    *mode = SHARD_HASH;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Hashes a block of memory with 64-bit FNV-1a, finished with an avalanche
+// step so that the low bits are usable for small moduli
+// Inputs: data - bytes to hash
+//         length - number of bytes
+// Returns: hash value
+uint64_t hash_bytes(const char *data, size_t length) {
+  uint64_t hash = FNV_OFFSET_BASIS;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (unsigned char)data[i]) * FNV_PRIME;
+  }
+  hash ^= hash >> HASH_MIX_SHIFT;
+  hash *= HASH_MIX_MULTIPLIER;
+  hash ^= hash >> HASH_MIX_SHIFT;
+  return hash;
+}
+
+// Parses an --order value: priority, ljf:joblog, or shuffle with an optional
+// :seed
+// Inputs: spec - value given to --order
+//         mode - set to the ORDER_* mode
+//         argument - set to the text after the colon, or NULL if there is none
+// Returns: true if spec is valid
+bool parse_order(const char *spec, int *mode, const char **argument) {
+  const char *colon = strchr(spec, ':');
+  size_t nameLength = colon ? (size_t)(colon - spec) : strlen(spec);
+  *argument = colon ? colon + 1 : NULL;
+
+  *mode = ORDER_NONE;
+  for (int i = ORDER_PRIORITY; i < NUM_ORDER_MODES; i++) {
+    if (strlen(orderNames[i]) == nameLength &&
+        strncmp(spec, orderNames[i], nameLength) == 0) {
+      *mode = i;
+    }
+  }
+
+  if (*mode == ORDER_PRIORITY) {
+    return !colon;
+  }
+  if (*mode == ORDER_LJF) {
+    return colon && colon[1] != '\0';
+  }
+  if (*mode == ORDER_SHUFFLE) {
+    return !colon || (colon[1] != '\0' &&
+                      strspn(colon + 1, "0123456789") == strlen(colon + 1));
+  }
+  return false;
+}
+
+// Parses a --delimiter value, which is a single character or one of the
+// escapes \0, \n, \t, \r, \\ and \xHH
+// Inputs: spec - value given to --delimiter
+//         delimiter - set to the delimiter byte
+// Returns: true if spec is valid
+bool parse_delimiter(const char *spec, char *delimiter) {
+  if (spec[0] != '\\' || spec[1] == '\0') {
+    *delimiter = spec[0];
+    return spec[0] != '\0' && spec[1] == '\0';
+  }
+  const char *escapes = "0\0n\nt\tr\r\\\\";
+  for (int i = 0; escapes[i]; i += 2) {
+    if (spec[1] == escapes[i] && spec[2] == '\0') {
+      *delimiter = escapes[i + 1];
+      return true;
+    }
+  }
+  if (spec[1] == 'x' && isxdigit((unsigned char)spec[2]) &&
+      isxdigit((unsigned char)spec[3]) && spec[4] == '\0') {
+    *delimiter = (char)strtol(spec + 2, NULL, HEX_BASE);
+    return true;
+  }
+  return false;
+}
+
+// Parses a --slots-group value of the form NAME or NAME:N
+// Inputs: spec - value given to --slots-group
+//         nameLength - set to the length of the group's name
+//         size - set to N, or 0 if it wasn't given
+// Returns: true if spec is valid
+bool parse_slots_group(const char *spec, size_t *nameLength, int *size) {
+  const char *colon = strchr(spec, ':');
+  *nameLength = colon ? (size_t)(colon - spec) : strlen(spec);
+  *size = 0;
+  if (*nameLength == 0 || *nameLength > SLOT_GROUP_NAME_MAX ||
+      memchr(spec, '/', *nameLength)) {
+    return false;
+  }
+  if (!colon) {
+    return true;
+  }
+  if (colon[1] == '\0' ||
+      strspn(colon + 1, "0123456789") != strlen(colon + 1)) {
+    return false;
+  }
+  long value = strtol(colon + 1, NULL, 10);
+  *size = value > SLOT_GROUP_MAX ? 0 : (int)value;
+  return *size >= 1;
+}
+
+// Parses a --class value of the form NAME=N
+// Inputs: spec - value given to --class
+//         nameLength - set to the length of the class name
+//         limit - set to the number of the class's tasks which may run at once
+// Returns: true if the value is valid
+bool parse_class_limit(const char *spec, size_t *nameLength, int *limit) {
+  const char *equals = strchr(spec, '=');
+  if (!equals || equals == spec || equals[1] == '\0' ||
+      strspn(equals + 1, "0123456789") != strlen(equals + 1)) {
+    return false;
+  }
+  *nameLength = (size_t)(equals - spec);
+  long value = strtol(equals + 1, NULL, 10);
+  *limit = value > JOB_LIMIT_MAX ? 0 : (int)value;
+  return *limit >= JOB_LIMIT_MIN;
+}
+
+// Parses a --rate value of the form N/s, N/m or N/h, where N may have a
+// fraction
+// Inputs: spec - value given to --rate
+//         interval - set to the nanoseconds between spawns
+// Returns: true if the value is valid
+bool parse_rate(const char *spec, uint64_t *interval) {
+  char *end;
+  errno = 0;
+  double count = strtod(spec, &end);
+  if (end == spec || errno != 0 || !(count > 0) || end[0] != '/' ||
+      end[1] == '\0' || end[2] != '\0') {
+    return false;
+  }
+  double seconds = end[1] == 's'   ? 1
+                   : end[1] == 'm' ? SECONDS_PER_MINUTE
+                   : end[1] == 'h' ? SECONDS_PER_HOUR
+                                   : 0;
+  double nanoseconds = seconds * NANOSECONDS_PER_SECOND / count;
+  if (seconds == 0 || nanoseconds > (double)UINT64_MAX / 2) {
+    return false;
+  }
+  *interval = nanoseconds < 1 ? 1 : (uint64_t)nanoseconds;
+  return true;
+}
+
+// Returns true if an argsfile token is a task directive such as @prio=N
+// Inputs: token - token from an argsfile line
+// Returns: true if the token is a directive rather than an argument
+bool is_task_directive(const char *token) {
+  for (int i = 0; taskDirectives[i]; i++) {
+    if (strncmp(token, taskDirectives[i], strlen(taskDirectives[i])) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Stores the value of a directive which names tasks
+// Inputs: pArgs - pointer to PArgs struct
+//         values - pointer to the array of values, allocated if NULL
+//         i - index of task
+//         value - value to store a copy of
+void set_task_directive_value(const struct PArgs *pArgs, char ***values, int i,
+                              const char *value) {
+  if (!*values) {
+    *values = (char **)calloc(pArgs->numArgs, sizeof(char *));
+  }
+  free((*values)[i]);
+  (*values)[i] = strdup(value);
+}
+
+// Adds a value to a list of values of a directive which can be repeated
+// Inputs: pArgs - pointer to PArgs struct
+//         lists - pointer to the NULL terminated list of each task, allocated
+//                 if NULL
+//         i - index of task
+//         value - value to add a copy of
+void append_task_directive_value(const struct PArgs *pArgs, char ****lists,
+                                 int i, const char *value) {
+  if (!*lists) {
+    *lists = (char ***)calloc(pArgs->numArgs, sizeof(char **));
+  }
+  int count = 0;
+  while ((*lists)[i] && (*lists)[i][count]) {
+    count++;
+  }
+  (*lists)[i] = (char **)realloc(
+      (void *)(*lists)[i], (count + 1 + NULL_TERMINATOR) * sizeof(char *));
+  (*lists)[i][count] = strdup(value);
+  (*lists)[i][count + 1] = NULL;
+}
+
+// Frees the lists of a directive which can be repeated
+// Inputs: lists - list of each task, may be NULL
+//         numArgs - number of tasks
+void free_task_directive_lists(char ***lists, int numArgs) {
+  if (!lists) {
+    return;
+  }
+  for (int i = 0; i < numArgs; i++) {
+    for (int j = 0; lists[i] && lists[i][j]; j++) {
+      free(lists[i][j]);
+    }
+    free((void *)lists[i]);
+  }
+  free((void *)lists);
+}
+
+// Exits because a task directive has an invalid value
+// Inputs: token - the directive
+void invalid_task_directive(const char *token) {
+  fprintf(stderr, "uqparallel: invalid task directive \"%s\"\n", token);
+  exit(USAGE_ERROR_EXIT_NUM);
+}
+
+// Applies a task directive to a task
+// Inputs: pArgs - pointer to PArgs struct
+//         i - index of task
+//         token - directive token
+void apply_task_directive(struct PArgs *pArgs, int i, const char *token) {
+  if (strncmp(token, priorityDirective, strlen(priorityDirective)) == 0) {
+    if (!pArgs->priorities) {
+      pArgs->priorities = (long *)calloc(pArgs->numArgs, sizeof(long));
+    }
+    pArgs->priorities[i] =
+        strtol(token + strlen(priorityDirective), NULL, 10);
+  } else if (strncmp(token, idDirective, strlen(idDirective)) == 0) {
+    set_task_directive_value(pArgs, &pArgs->taskIds, i,
+                             token + strlen(idDirective));
+  } else if (strncmp(token, afterDirective, strlen(afterDirective)) == 0) {
+    set_task_directive_value(pArgs, &pArgs->taskAfter, i,
+                             token + strlen(afterDirective));
+  } else if (strncmp(token, replicasDirective, strlen(replicasDirective)) ==
+             0) {
+    int replicas = atoi(token + strlen(replicasDirective));
+    if (replicas < 1 || replicas > JOB_LIMIT_MAX) {
+      invalid_task_directive(token);
+    }
+    if (!pArgs->replicas) {
+      pArgs->replicas = (int *)malloc(pArgs->numArgs * sizeof(int));
+      for (int j = 0; j < pArgs->numArgs; j++) {
+        pArgs->replicas[j] = 1;
+      }
+    }
+    pArgs->replicas[i] = replicas;
+  } else if (strncmp(token, splitDirective, strlen(splitDirective)) == 0) {
+    int mode = 0;
+    while (splitNames[mode] &&
+           strcmp(splitNames[mode], token + strlen(splitDirective)) != 0) {
+      mode++;
+    }
+    if (!splitNames[mode]) {
+      invalid_task_directive(token);
+    }
+    if (!pArgs->splitModes) {
+      pArgs->splitModes = (int *)calloc(pArgs->numArgs, sizeof(int));
+    }
+    pArgs->splitModes[i] = mode;
+  } else if (strncmp(token, envDirective, strlen(envDirective)) == 0) {
+    const char *variable = token + strlen(envDirective);
+    if (variable[0] == '=' || !strchr(variable, '=')) {
+      invalid_task_directive(token);
+    }
+    append_task_directive_value(pArgs, &pArgs->taskEnv, i, variable);
+  } else if (strncmp(token, cwdDirective, strlen(cwdDirective)) == 0) {
+    set_task_directive_value(pArgs, &pArgs->taskCwd, i,
+                             token + strlen(cwdDirective));
+  } else if (strncmp(token, stageInDirective, strlen(stageInDirective)) == 0) {
+    append_task_directive_value(pArgs, &pArgs->stageIn, i,
+                                token + strlen(stageInDirective));
+  } else if (strncmp(token, stageOutDirective, strlen(stageOutDirective)) ==
+             0) {
+    append_task_directive_value(pArgs, &pArgs->stageOut, i,
+                                token + strlen(stageOutDirective));
+  } else if (strncmp(token, classDirective, strlen(classDirective)) == 0) {
+    if (token[strlen(classDirective)] == '\0') {
+      invalid_task_directive(token);
+    }
+    set_task_directive_value(pArgs, &pArgs->classNames, i,
+                             token + strlen(classDirective));
+  }
+}
+
+// Returns true if a task belongs to this instance's shard
+// Inputs: cmdLineArgs - CLArgs struct with the shard settings
+//         taskNumber - 0-based position of the task in the input
+//         numTasks - number of tasks in the input, only used by range shards
+//         data - task contents, only used by hash shards
+//         length - size of data
+// Returns: true if the task should be run by this instance
+bool in_shard(const struct CLArgs *cmdLineArgs, uint64_t taskNumber,
+              uint64_t numTasks, const char *data, size_t length) {
+  uint64_t index = (uint64_t)cmdLineArgs->shardIndex;
+  uint64_t count = (uint64_t)cmdLineArgs->shardCount;
+
+  if (!cmdLineArgs->shardPresent) {
+    return true;
+  }
+  if (cmdLineArgs->shardMode == SHARD_RANGE) {
+    return taskNumber >= numTasks * index / count &&
+           taskNumber < numTasks * (index + 1) / count;
+  }
+  if (cmdLineArgs->shardMode == SHARD_HASH) {
+    return hash_bytes(data, length) % count == index;
+  }
+  return taskNumber % count == index;
+}
+
+// Parses a --unique-fp value, a false positive rate between 0 and 1. A rate of
+// 0 keeps --unique exact however many lines there are.
+// Inputs: spec - value given to --unique-fp
+//         rate - set to the rate
+// Returns: true if the value is valid
+bool parse_false_positive_rate(const char *spec, double *rate) {
+  char *end;
+  *rate = strtod(spec, &end);
+  return end != spec && *end == '\0' && *rate >= 0 && *rate < 1;
+}
+
+// Sets up --unique before any tasks are read. Without --unique-fp, the exact
+// set gives way to Bloom filters with UNIQUE_DEFAULT_FP_RATE once it is full.
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+void start_unique_filter(const struct CLArgs *cmdLineArgs) {
+  if (!cmdLineArgs->uniquePresent &&
+      !cmdLineArgs->uniqueFalsePositivePresent) {
+    return;
+  }
+  uniqueFilter.enabled = true;
+  uniqueFilter.falsePositiveRate = cmdLineArgs->uniqueFalsePositivePresent
+                                       ? cmdLineArgs->uniqueFalsePositiveRate
+                                       : UNIQUE_DEFAULT_FP_RATE;
+  uniqueFilter.capacity = UNIQUE_SET_MIN;
+  uniqueFilter.lines = (char **)calloc(UNIQUE_SET_MIN, sizeof(char *));
+  uniqueFilter.lengths = (size_t *)malloc(UNIQUE_SET_MIN * sizeof(size_t));
+  uniqueFilter.hashes = (uint64_t *)malloc(UNIQUE_SET_MIN * sizeof(uint64_t));
+}
+
+// Doubles the exact set of --unique, which is kept at most half full
+void grow_unique_set(void) {
+  size_t capacity = uniqueFilter.capacity * 2;
+  char **lines = (char **)calloc(capacity, sizeof(char *));
+  size_t *lengths = (size_t *)malloc(capacity * sizeof(size_t));
+  uint64_t *hashes = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+  for (size_t i = 0; i < uniqueFilter.capacity; i++) {
+    if (!uniqueFilter.lines[i]) {
+      continue;
+    }
+    size_t slot = uniqueFilter.hashes[i] & (capacity - 1);
+    while (lines[slot]) {
+      slot = (slot + 1) & (capacity - 1);
+    }
+    lines[slot] = uniqueFilter.lines[i];
+    lengths[slot] = uniqueFilter.lengths[i];
+    hashes[slot] = uniqueFilter.hashes[i];
+  }
+  free((void *)uniqueFilter.lines);
+  free(uniqueFilter.lengths);
+  free(uniqueFilter.hashes);
+  uniqueFilter.lines = lines;
+  uniqueFilter.lengths = lengths;
+  uniqueFilter.hashes = hashes;
+  uniqueFilter.capacity = capacity;
+}
+
+// Adds a line to the exact set of --unique
+// Inputs: line - line to add
+//         length - length of line
+//         hash - hash_bytes() of line
+// Returns: true if the line wasn't in the set already
+bool unique_set_insert(const char *line, size_t length, uint64_t hash) {
+  if (2 * (uniqueFilter.count + 1) > uniqueFilter.capacity) {
+    grow_unique_set();
+  }
+  size_t mask = uniqueFilter.capacity - 1;
+  size_t slot = hash & mask;
+  while (uniqueFilter.lines[slot]) {
+    if (uniqueFilter.hashes[slot] == hash &&
+        uniqueFilter.lengths[slot] == length &&
+        memcmp(uniqueFilter.lines[slot], line, length) == 0) {
+      return false;
+    }
+    slot = (slot + 1) & mask;
+  }
+  // compiled tasks may hold NULs, so the line is copied whole
+  uniqueFilter.lines[slot] = malloc(length + 1);
+  memcpy(uniqueFilter.lines[slot], line, length);
+  uniqueFilter.lengths[slot] = length;
+  uniqueFilter.hashes[slot] = hash;
+  uniqueFilter.count++;
+  return true;
+}
+
+// Adds another, larger, Bloom filter to the end of the chain of --unique
+void add_bloom_filter(void) {
+  int i = uniqueFilter.numFilters++;
+  uniqueFilter.filters = (struct BloomFilter *)realloc(
+      uniqueFilter.filters,
+      uniqueFilter.numFilters * sizeof(struct BloomFilter));
+  struct BloomFilter *filter = &uniqueFilter.filters[i];
+  filter->capacity = (uint64_t)UNIQUE_EXACT_MAX << (i + 1);
+  filter->count = 0;
+
+  // filter i gets half the rate of the one before, starting from half the
+  // total, and needs one hash function for each halving of its rate
+  double rate = uniqueFilter.falsePositiveRate / 2;
+  for (int j = 0; j < i; j++) {
+    rate /= 2;
+  }
+  filter->numHashes = 0;
+  for (double bound = 1; bound > rate; bound /= 2) {
+    filter->numHashes++;
+  }
+  uint64_t numBits = (uint64_t)((double)filter->capacity *
+                                filter->numHashes * BLOOM_BITS_PER_HASH);
+  filter->numBits = (numBits / BLOOM_WORD_BITS + 1) * BLOOM_WORD_BITS;
+  filter->bits = (uint64_t *)calloc(filter->numBits / BLOOM_WORD_BITS,
+                                    sizeof(uint64_t));
+}
+
+// Checks a hash against a Bloom filter, and sets its bits if asked to
+// Inputs: filter - filter to use
+//         hash - hash_bytes() of a line
+//         set - true to add the line to the filter
+// Returns: true if every bit of the hash was already set
+bool bloom_test(struct BloomFilter *filter, uint64_t hash, bool set) {
+  // each bit is picked by double hashing with a second, odd, hash
+  uint64_t step = (hash ^ hash >> HASH_MIX_SHIFT) * HASH_MIX_MULTIPLIER | 1;
+  bool present = true;
+  for (int k = 0; k < filter->numHashes; k++) {
+    uint64_t bit = (hash + (uint64_t)k * step) % filter->numBits;
+    uint64_t mask = 1ULL << (bit % BLOOM_WORD_BITS);
+    present &= (filter->bits[bit / BLOOM_WORD_BITS] & mask) != 0;
+    if (set) {
+      filter->bits[bit / BLOOM_WORD_BITS] |= mask;
+    }
+  }
+  if (set && !present) {
+    filter->count++;
+  }
+  return present;
+}
+
+// Adds a hash to the Bloom filters of --unique, unless one of them holds it.
+// Once the last filter allowed is full, it goes on taking hashes, and says so
+// the first time.
+// Inputs: hash - hash_bytes() of a line
+// Returns: true if the hash wasn't in any filter
+bool bloom_insert(uint64_t hash) {
+  for (int i = 0; i < uniqueFilter.numFilters - 1; i++) {
+    if (bloom_test(&uniqueFilter.filters[i], hash, false)) {
+      return false;
+    }
+  }
+  struct BloomFilter *last = &uniqueFilter.filters[uniqueFilter.numFilters - 1];
+  if (last->count >= last->capacity) {
+    if (bloom_test(last, hash, false)) {
+      return false;
+    }
+    if (uniqueFilter.numFilters < UNIQUE_MAX_FILTERS) {
+      add_bloom_filter();
+      last = &uniqueFilter.filters[uniqueFilter.numFilters - 1];
+    } else if (!uniqueFilter.overfull) {
+      uniqueFilter.overfull = true;
+      fprintf(stderr,
+              "uqparallel: --unique is full, more new tasks will be taken "
+              "for repeats from now on\n");
+    }
+  }
+  return !bloom_test(last, hash, true);
+}
+
+// Moves the exact set of --unique into a Bloom filter once it is full
+void unique_set_to_bloom(void) {
+  add_bloom_filter();
+  for (size_t i = 0; i < uniqueFilter.capacity; i++) {
+    if (uniqueFilter.lines[i]) {
+      bloom_test(&uniqueFilter.filters[0], uniqueFilter.hashes[i], true);
+      free(uniqueFilter.lines[i]);
+    }
+  }
+  free((void *)uniqueFilter.lines);
+  free(uniqueFilter.lengths);
+  free(uniqueFilter.hashes);
+  uniqueFilter.lines = NULL;
+  uniqueFilter.lengths = NULL;
+  uniqueFilter.hashes = NULL;
+}
+
+// Returns true if a task should run as far as --unique is concerned, and
+// remembers it so that repeats of it don't
+// Inputs: line - task line after modify_string(), or record
+//         length - length of line
+// Returns: true if --unique is off or the task hasn't been seen before
+bool unique_task_is_new(const char *line, size_t length) {
+  if (!uniqueFilter.enabled) {
+    return true;
+  }
+  uint64_t hash = hash_bytes(line, length);
+  if (uniqueFilter.numFilters > 0) {
+    return bloom_insert(hash);
+  }
+  bool isNew = unique_set_insert(line, length, hash);
+  if (uniqueFilter.count >= UNIQUE_EXACT_MAX &&
+      uniqueFilter.falsePositiveRate > 0) {
+    unique_set_to_bloom();
+  }
+  return isNew;
+}
+
+// Frees the state of --unique
+void stop_unique_filter(void) {
+  if (!uniqueFilter.enabled) {
+    return;
+  }
+  for (size_t i = 0; uniqueFilter.lines && i < uniqueFilter.capacity; i++) {
+    free(uniqueFilter.lines[i]);
+  }
+  free((void *)uniqueFilter.lines);
+  free(uniqueFilter.lengths);
+  free(uniqueFilter.hashes);
+  for (int i = 0; i < uniqueFilter.numFilters; i++) {
+    free(uniqueFilter.filters[i].bits);
+  }
+  free(uniqueFilter.filters);
+  memset(&uniqueFilter, 0, sizeof(uniqueFilter));
+}
+
 // Fills in per-task arguments in a CLArgs struct from argv[]
 // Inputs: cmdLineArgs - pointer to CLArgs struct to populate
 //         argc - number of per-task args
@@ -88,13 +1452,16 @@ void per_task_arg_struct_helper(struct CLArgs *cmdLineArgs, int argc,
     return;
   }
 
-  cmdLineArgs->numPerTaskArgs = argc;
-
-  cmdLineArgs->perTaskArgs =
-      (char **)malloc(cmdLineArgs->numPerTaskArgs * sizeof(char *));
+  cmdLineArgs->perTaskArgs = (char **)malloc(argc * sizeof(char *));
 
+  // only keep arguments belonging to this instance's shard, once each with
+  // --unique
   for (int i = 0; i < argc; i++) {
-    cmdLineArgs->perTaskArgs[i] = strdup(argv[i]);
+    if (in_shard(cmdLineArgs, i, argc, argv[i], strlen(argv[i])) &&
+        unique_task_is_new(argv[i], strlen(argv[i]))) {
+      cmdLineArgs->perTaskArgs[cmdLineArgs->numPerTaskArgs++] =
+          strdup(argv[i]);
+    }
   }
 }
 
@@ -190,32 +1557,429 @@ char *modify_string(char *line) {
 
   return processedLine;
 }
-// Reads lines from argsfile and populates fileArgs and numFileArgs in CLArgs
-// Inputs: cmdLineArgs - CLArgs struct with fileName set
-void file_args_struct_helper(struct CLArgs *cmdLineArgs) {
-  FILE *file = fopen(cmdLineArgs->fileName, "r");
-
-  char line[LINE_BUFFER];
-  int processedLineCount = 0;
-
-  while (fgets(line, LINE_BUFFER, file) != NULL) {
-    line[strcspn(line, "\n")] = '\0';  // remove newline
-    char *processedLine = modify_string(line);
+// Reads records separated by a delimiter byte from a file descriptor. The
+// input is read in large blocks and searched with memchr, so records can be
+// any length.
+struct RecordReader {
+  int fd;
+  char delimiter;
+  char *buffer;
+  size_t start;
+  size_t end;
+  size_t capacity;
+  bool eof;
+};
 
-    char **temp = (char **)realloc((void *)cmdLineArgs->fileArgs,
-                                   (processedLineCount + 1) * sizeof(char *));
-    cmdLineArgs->fileArgs = temp;
+// Returns the next non-empty record. The record is terminated in place and
+// stays valid until the next call.
+// Inputs: reader - reader to read from
+//         length - set to the length of the record
+// Returns: record, or NULL at the end of the input
+char *read_record(struct RecordReader *reader, size_t *length) {
+  while (true) {
+    char *found = memchr(reader->buffer + reader->start, reader->delimiter,
+                         reader->end - reader->start);
+    if (found || (reader->eof && reader->start < reader->end)) {
+      // the last record may not be followed by a delimiter
+      char *record = reader->buffer + reader->start;
+      if (!found) {
+        found = reader->buffer + reader->end;
+      }
+      *found = '\0';
+      *length = (size_t)(found - record);
+      reader->start = (size_t)(found - reader->buffer) + 1;
+      if (reader->start > reader->end) {
+        reader->start = reader->end;
+      }
+      if (*length > 0) {
+        return record;
+      }
+      continue;
+    }
+    if (reader->eof) {
+      return NULL;
+    }
 
-    cmdLineArgs->fileArgs[processedLineCount++] = strdup(processedLine);
-    free(processedLine);
+    // keep the partial record and make room for at least a block more
+    memmove(reader->buffer, reader->buffer + reader->start,
+            reader->end - reader->start);
+    reader->end -= reader->start;
+    reader->start = 0;
+    if (reader->capacity - reader->end < RECORD_BLOCK_SIZE) {
+      reader->capacity = reader->end + 2 * RECORD_BLOCK_SIZE;
+      reader->buffer = realloc(reader->buffer, reader->capacity);
+    }
+    // one byte is kept free to terminate a last record in place
+    ssize_t numRead = read(reader->fd, reader->buffer + reader->end,
+                           reader->capacity - reader->end - 1);
+    if (numRead < 0 && errno == EINTR) {
+      continue;
+    }
+    if (numRead <= 0) {
+      reader->eof = true;
+    } else {
+      reader->end += (size_t)numRead;
+    }
   }
-
-  cmdLineArgs->numFileArgs = processedLineCount;
-  fclose(file);
 }
 
-// Validates that the file in cmdLineArgs->fileName exists and can be opened
-// Inputs: cmdLineArgs - CLArgs struct with fileName
+// Reads the records of an argsfile given with -0 or --delimiter into fileArgs
+// without tokenising them. Lines belonging to other shards are dropped.
+// Inputs: cmdLineArgs - CLArgs struct with fileName set
+void file_records_struct_helper(struct CLArgs *cmdLineArgs) {
+  struct RecordReader reader = {0};
+  reader.fd = open(cmdLineArgs->fileName, O_RDONLY | O_CLOEXEC);
+  reader.delimiter = cmdLineArgs->delimiter;
+
+  // range shards need to know where the input ends, so read it all first
+  char **records = NULL;
+  uint64_t numRecords = 0;
+  uint64_t capacity = 0;
+  char *record;
+  size_t length;
+  while ((record = read_record(&reader, &length))) {
+    if (numRecords == capacity) {
+      capacity = capacity ? 2 * capacity : RECORD_BLOCK_SIZE / sizeof(char *);
+      records = (char **)realloc((void *)records, capacity * sizeof(char *));
+    }
+    records[numRecords++] = strdup(record);
+  }
+  close(reader.fd);
+  free(reader.buffer);
+
+  int numKept = 0;
+  for (uint64_t i = 0; i < numRecords; i++) {
+    if (in_shard(cmdLineArgs, i, numRecords, records[i], strlen(records[i])) &&
+        unique_task_is_new(records[i], strlen(records[i]))) {
+      records[numKept++] = records[i];
+    } else {
+      free(records[i]);
+    }
+  }
+  cmdLineArgs->fileArgs = records;
+  cmdLineArgs->numFileArgs = numKept;
+}
+
+// Counts the lines in a file the same way file_args_struct_helper() reads them
+// Inputs: file - open file, rewound to the start afterwards
+// Returns: number of lines
+uint64_t count_file_lines(FILE *file) {
+  char line[LINE_BUFFER];
+  uint64_t numLines = 0;
+  while (fgets(line, LINE_BUFFER, file) != NULL) {
+    numLines++;
+  }
+  rewind(file);
+  return numLines;
+}
+
+// Writes a single argsfile line as a compiled task blob
+// Inputs: file - compiled argsfile being written
+//         fileArg - processed argsfile line
+//         directives - true if task directives are dropped from the line
+// Returns: true if the line had any task directives
+bool write_compiled_task(FILE *file, const char *fileArg, bool directives) {
+  bool hasDirectives = false;
+  int numTokens = 0;
+  char *line = strdup(fileArg);
+  char **tokens = split_space_not_quote(line, &numTokens);
+  const char *targets[NUM_OUTPUT_STREAMS] = {"", ""};
+  uint32_t argc = 0;
+
+  // redirect targets are stored separately from the arguments
+  for (int j = 0; j < numTokens; j++) {
+    if (tokens[j][0] == stdoutFile) {
+      targets[0] = tokens[j] + STDOUT_FILE_HEADER_LENGTH;
+    } else if (strncmp(tokens[j], stderrFile, STDERRFILE_LENGTH) == 0) {
+      targets[1] = tokens[j] + STDERR_FILE_HEADER_LENGTH;
+    } else if (directives && is_task_directive(tokens[j])) {
+      hasDirectives = true;
+    } else {
+      argc++;
+    }
+  }
+
+  fwrite(&argc, sizeof(argc), 1, file);
+  for (int stream = 0; stream < NUM_OUTPUT_STREAMS; stream++) {
+    fwrite(targets[stream], strlen(targets[stream]) + NULL_TERMINATOR, 1,
+           file);
+  }
+  for (int j = 0; j < numTokens; j++) {
+    if (tokens[j][0] != stdoutFile &&
+        strncmp(tokens[j], stderrFile, STDERRFILE_LENGTH) != 0 &&
+        !(directives && is_task_directive(tokens[j]))) {
+      fwrite(tokens[j], strlen(tokens[j]) + NULL_TERMINATOR, 1, file);
+    }
+  }
+
+  free((void *)tokens);
+  free(line);
+  return hasDirectives;
+}
+
+// Returns true if an argsfile or stdin line belongs to this instance's hash
+// shard. The line's compiled blob is hashed rather than its text, so a task
+// lands in the same shard whether it is read as text or from a compiled
+// argsfile.
+// Inputs: cmdLineArgs - CLArgs struct with the shard settings
+//         line - line after modify_string()
+// Returns: true if the task should be run by this instance
+bool line_in_hash_shard(const struct CLArgs *cmdLineArgs, const char *line) {
+  char *blob = NULL;
+  size_t length = 0;
+  FILE *stream = open_memstream(&blob, &length);
+  write_compiled_task(stream, line, cmdLineArgs->directivesPresent);
+  fclose(stream);
+  bool inShard = in_shard(cmdLineArgs, 0, 0, blob, length);
+  free(blob);
+  return inShard;
+}
+
+// Reads lines from argsfile and populates fileArgs and numFileArgs in CLArgs.
+// Lines belonging to other index or range shards are skipped without being
+// processed.
+// Inputs: cmdLineArgs - CLArgs struct with fileName set
+void file_args_struct_helper(struct CLArgs *cmdLineArgs) {
+  FILE *file = fopen(cmdLineArgs->fileName, "r");
+
+  char line[LINE_BUFFER];
+  int processedLineCount = 0;
+  uint64_t lineNumber = 0;
+  uint64_t numLines = 0;
+
+  // range shards need to know where the file ends before reading it
+  if (cmdLineArgs->shardPresent && cmdLineArgs->shardMode == SHARD_RANGE) {
+    numLines = count_file_lines(file);
+  }
+
+  bool hashShards =
+      cmdLineArgs->shardPresent && cmdLineArgs->shardMode == SHARD_HASH;
+  while (fgets(line, LINE_BUFFER, file) != NULL) {
+    size_t length = strcspn(line, "\n");
+    line[length] = '\0';  // remove newline
+    if (!hashShards &&
+        !in_shard(cmdLineArgs, lineNumber++, numLines, line, length)) {
+      continue;
+    }
+    char *processedLine = modify_string(line);
+    if ((hashShards && !line_in_hash_shard(cmdLineArgs, processedLine)) ||
+        !unique_task_is_new(processedLine, strlen(processedLine))) {
+      free(processedLine);
+      continue;
+    }
+
+    char **temp = (char **)realloc((void *)cmdLineArgs->fileArgs,
+                                   (processedLineCount + 1) * sizeof(char *));
+    cmdLineArgs->fileArgs = temp;
+
+    cmdLineArgs->fileArgs[processedLineCount++] = strdup(processedLine);
+    free(processedLine);
+  }
+
+  cmdLineArgs->numFileArgs = processedLineCount;
+  fclose(file);
+}
+
+// Returns true if a file starts with the compiled argsfile magic
+// Inputs: fileName - path of the argsfile
+// Returns: true if the file was written by --compile-argsfile
+bool is_compiled_argsfile(const char *fileName) {
+  char magic[COMPILED_MAGIC_LENGTH];
+  FILE *file = fopen(fileName, "r");
+  if (!file) {
+    return false;
+  }
+  bool compiled = fread(magic, 1, COMPILED_MAGIC_LENGTH, file) ==
+                      COMPILED_MAGIC_LENGTH &&
+                  memcmp(magic, compiledMagic, COMPILED_MAGIC_LENGTH) == 0;
+  fclose(file);
+  return compiled;
+}
+
+// Works out which tasks of a compiled argsfile belong to this instance's
+// shard. Index and range shards are computed, only hash shards and --unique
+// have to look at each task.
+// Inputs: cmdLineArgs - CLArgs struct with compiledFile mapped
+void select_compiled_shard(struct CLArgs *cmdLineArgs) {
+  struct CompiledArgsFile *compiled = cmdLineArgs->compiledFile;
+  uint64_t index = (uint64_t)cmdLineArgs->shardIndex;
+  uint64_t count = (uint64_t)cmdLineArgs->shardCount;
+
+  compiled->first = 0;
+  compiled->stride = 1;
+  compiled->numSelected = compiled->numTasks;
+  if (!cmdLineArgs->shardPresent && !uniqueFilter.enabled) {
+    return;
+  }
+
+  if (!uniqueFilter.enabled && cmdLineArgs->shardMode == SHARD_MOD) {
+    compiled->first = index;
+    compiled->stride = count;
+    compiled->numSelected =
+        compiled->numTasks > index
+            ? (compiled->numTasks - index + count - 1) / count
+            : 0;
+  } else if (!uniqueFilter.enabled &&
+             cmdLineArgs->shardMode == SHARD_RANGE) {
+    compiled->first = compiled->numTasks * index / count;
+    compiled->numSelected =
+        compiled->numTasks * (index + 1) / count - compiled->first;
+  } else {
+    // the original lines aren't stored, so hash and compare each task's blob
+    // instead. Lines which only differ in spacing compile to the same blob.
+    compiled->selected = malloc(compiled->numTasks * sizeof(uint64_t));
+    compiled->numSelected = 0;
+    for (uint64_t i = 0; i < compiled->numTasks; i++) {
+      uint64_t start = compiled->index[i];
+      uint64_t end = i + 1 < compiled->numTasks ? compiled->index[i + 1]
+                                                : compiled->size;
+      if (start <= end && end <= compiled->size &&
+          in_shard(cmdLineArgs, i, compiled->numTasks, compiled->data + start,
+                   end - start) &&
+          unique_task_is_new(compiled->data + start, end - start)) {
+        compiled->selected[compiled->numSelected++] = i;
+      }
+    }
+  }
+}
+
+// Returns the position in a compiled argsfile of one of this shard's tasks
+// Inputs: compiled - mapped compiled argsfile
+//         i - index of the task within the shard
+// Returns: index of the task in the file
+uint64_t compiled_task_index(const struct CompiledArgsFile *compiled,
+                             uint64_t i) {
+  if (compiled->selected) {
+    return compiled->selected[i];
+  }
+  return compiled->first + i * compiled->stride;
+}
+
+// Maps a compiled argsfile into memory without reading any of its tasks
+// Inputs: cmdLineArgs - CLArgs struct with fileName set
+// Exits with FILE_READ_ERROR_EXIT_NUM if the file is unusable
+void map_compiled_argsfile(struct CLArgs *cmdLineArgs) {
+  struct CompiledArgsFile *compiled = calloc(1, sizeof(*compiled));
+  int fd = open(cmdLineArgs->fileName, O_RDONLY | O_CLOEXEC);
+  struct stat fileStat;
+  uint32_t version = 0;
+
+  if (fd >= 0 && fstat(fd, &fileStat) == 0 &&
+      (size_t)fileStat.st_size >= COMPILED_HEADER_LENGTH) {
+    compiled->size = fileStat.st_size;
+    compiled->data =
+        mmap(NULL, compiled->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  if (compiled->data && compiled->data != MAP_FAILED) {
+    memcpy(&version, compiled->data + COMPILED_MAGIC_LENGTH, sizeof(version));
+    memcpy(&compiled->numTasks, compiled->data + COMPILED_COUNT_OFFSET,
+           sizeof(compiled->numTasks));
+  }
+  // only the header and index size are checked here, tasks are checked as
+  // they are loaded
+  if (version != COMPILED_VERSION ||
+      compiled->numTasks > (compiled->size - COMPILED_HEADER_LENGTH) /
+                               sizeof(uint64_t)) {
+    fprintf(stderr, "uqparallel: Invalid compiled argsfile \"%s\"\n",
+            cmdLineArgs->fileName);
+    exit(FILE_READ_ERROR_EXIT_NUM);
+  }
+
+  compiled->index =
+      (const uint64_t *)(compiled->data + COMPILED_HEADER_LENGTH);
+  cmdLineArgs->compiledFile = compiled;
+  select_compiled_shard(cmdLineArgs);
+}
+
+// Finds the argument count, redirect targets and first argument of a task in
+// a compiled argsfile
+// Inputs: compiled - mapped compiled argsfile
+//         i - index of task
+//         argc - set to number of arguments
+//         targets - set to the stdout and stderr targets, empty if unused
+// Returns: pointer to the first argument, or NULL if the task is corrupt
+char *find_compiled_task(const struct CompiledArgsFile *compiled, uint64_t i,
+                         uint32_t *argc, char *targets[NUM_OUTPUT_STREAMS]) {
+  uint64_t offset = compiled->index[i];
+  if (offset > compiled->size - sizeof(*argc)) {
+    return NULL;
+  }
+  memcpy(argc, compiled->data + offset, sizeof(*argc));
+
+  // every string must be NUL terminated inside the file
+  char *position = compiled->data + offset + sizeof(*argc);
+  char *end = compiled->data + compiled->size;
+  for (uint32_t j = 0; j < *argc + NUM_OUTPUT_STREAMS; j++) {
+    char *terminator = memchr(position, '\0', end - position);
+    if (!terminator) {
+      return NULL;
+    }
+    if (j < NUM_OUTPUT_STREAMS) {
+      targets[j] = position;
+    }
+    position = terminator + NULL_TERMINATOR;
+  }
+  return targets[NUM_OUTPUT_STREAMS - 1] +
+         strlen(targets[NUM_OUTPUT_STREAMS - 1]) + NULL_TERMINATOR;
+}
+
+// Writes the lines read from --argsfile as a compiled argsfile: a header,
+// an index of task offsets and a pre-tokenized blob for each task
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+// Returns: exit code
+int compile_argsfile(const struct CLArgs *cmdLineArgs) {
+  if (cmdLineArgs->compiledFile) {
+    fprintf(stderr, "uqparallel: \"%s\" is already compiled\n",
+            cmdLineArgs->fileName);
+    return FILE_READ_ERROR_EXIT_NUM;
+  }
+
+  FILE *file = fopen(cmdLineArgs->compileOutput, "wb");
+  if (!file) {
+    fprintf(stderr, "uqparallel: Cannot open file \"%s\" for writing\n",
+            cmdLineArgs->compileOutput);
+    return FILE_WRITE_ERROR_EXIT_NUM;
+  }
+
+  uint32_t version = COMPILED_VERSION;
+  uint32_t reserved = 0;
+  uint64_t numTasks = cmdLineArgs->numFileArgs;
+  uint64_t *index = calloc(numTasks + 1, sizeof(uint64_t));
+  fwrite(compiledMagic, COMPILED_MAGIC_LENGTH, 1, file);
+  fwrite(&version, sizeof(version), 1, file);
+  fwrite(&reserved, sizeof(reserved), 1, file);
+  fwrite(&numTasks, sizeof(numTasks), 1, file);
+
+  // leave room for the index, which is filled in once offsets are known
+  fwrite(index, sizeof(uint64_t), numTasks, file);
+  bool hasDirectives = false;
+  for (uint64_t i = 0; i < numTasks; i++) {
+    index[i] = (uint64_t)ftell(file);
+    hasDirectives |= write_compiled_task(file, cmdLineArgs->fileArgs[i],
+                                         cmdLineArgs->directivesPresent);
+  }
+  if (hasDirectives) {
+    fprintf(stderr, "uqparallel: task directives are not kept in compiled "
+                    "argsfiles\n");
+  }
+  fseek(file, COMPILED_HEADER_LENGTH, SEEK_SET);
+  fwrite(index, sizeof(uint64_t), numTasks, file);
+  free(index);
+
+  if (fclose(file) != 0) {
+    fprintf(stderr, "uqparallel: Cannot open file \"%s\" for writing\n",
+            cmdLineArgs->compileOutput);
+    return FILE_WRITE_ERROR_EXIT_NUM;
+  }
+  return 0;
+}
+
+// Validates that the file in cmdLineArgs->fileName exists and can be opened
+// Inputs: cmdLineArgs - CLArgs struct with fileName
 // Exits with FILE_READ_ERROR_EXIT_NUM on error
 void validate_file(const struct CLArgs *cmdLineArgs) {
   FILE *file = fopen(cmdLineArgs->fileName, "r");
@@ -247,6 +2011,9 @@ struct CLArgs *command_line_struct_creator(int argc, char *argv[]) {
   int i = 0;
 
   cmdLineArgs->jobLimit = JOB_LIMIT_DEFAULT;
+  cmdLineArgs->numDispatchers = DISPATCHERS_DEFAULT;
+  cmdLineArgs->statsFd = -1;
+  cmdLineArgs->stageAhead = STAGE_AHEAD_DEFAULT;
 
   // check for optional commands and update booleans to true if seen
   for (; i < argc; i++) {
@@ -254,6 +2021,129 @@ struct CLArgs *command_line_struct_creator(int argc, char *argv[]) {
       check_duplicate_option(cmdLineArgs->jobLimitPresent);
       cmdLineArgs->jobLimitPresent = true;
       cmdLineArgs->jobLimit = atoi(argv[++i]);
+    } else if (strcmp(argv[i], dispatchers) == 0) {
+      check_duplicate_option(cmdLineArgs->dispatchersPresent);
+      cmdLineArgs->dispatchersPresent = true;
+      cmdLineArgs->numDispatchers = atoi(argv[++i]);
+    } else if (strcmp(argv[i], zygote) == 0) {
+      check_duplicate_option(cmdLineArgs->zygotePresent);
+      cmdLineArgs->zygotePresent = true;
+    } else if (strcmp(argv[i], zygoteWorker) == 0) {
+      check_duplicate_option(cmdLineArgs->zygoteWorker != NULL);
+      cmdLineArgs->zygotePresent = true;
+      cmdLineArgs->zygoteWorker = strdup(argv[++i]);
+    } else if (strcmp(argv[i], serve) == 0) {
+      check_duplicate_option(cmdLineArgs->serveAddress != NULL);
+      cmdLineArgs->serveAddress = strdup(argv[++i]);
+    } else if (strcmp(argv[i], workers) == 0) {
+      check_duplicate_option(cmdLineArgs->workerAddresses != NULL);
+      cmdLineArgs->workerAddresses = strdup(argv[++i]);
+    } else if (strcmp(argv[i], compileArgsFile) == 0) {
+      check_duplicate_option(cmdLineArgs->compileOutput != NULL);
+      cmdLineArgs->compileOutput = strdup(argv[++i]);
+    } else if (strcmp(argv[i], shard) == 0) {
+      check_duplicate_option(cmdLineArgs->shardPresent);
+      cmdLineArgs->shardPresent = true;
+      parse_shard(argv[++i], &cmdLineArgs->shardIndex,
+                  &cmdLineArgs->shardCount, &cmdLineArgs->shardMode);
+    } else if (strcmp(argv[i], progress) == 0) {
+      check_duplicate_option(cmdLineArgs->progressPresent);
+      cmdLineArgs->progressPresent = true;
+    } else if (strcmp(argv[i], statsFd) == 0) {
+      check_duplicate_option(cmdLineArgs->statsFd >= 0);
+      cmdLineArgs->statsFd = atoi(argv[++i]);
+    } else if (strcmp(argv[i], statsSocket) == 0) {
+      check_duplicate_option(cmdLineArgs->statsSocket != NULL);
+      cmdLineArgs->statsSocket = strdup(argv[++i]);
+    } else if (strcmp(argv[i], latencyReportOption) == 0) {
+      check_duplicate_option(cmdLineArgs->latencyReportPresent);
+      cmdLineArgs->latencyReportPresent = true;
+    } else if (strcmp(argv[i], orderOption) == 0) {
+      check_duplicate_option(cmdLineArgs->orderMode != ORDER_NONE);
+      const char *argument;
+      parse_order(argv[++i], &cmdLineArgs->orderMode, &argument);
+      if (cmdLineArgs->orderMode == ORDER_LJF) {
+        cmdLineArgs->orderJobLog = strdup(argument);
+      } else if (cmdLineArgs->orderMode == ORDER_SHUFFLE) {
+        // without a seed every run gets a different order
+        cmdLineArgs->orderSeed = argument ? strtoull(argument, NULL, 10)
+                                          : (uint64_t)time(NULL) ^
+                                                (uint64_t)getpid();
+      }
+    } else if (strcmp(argv[i], jobLogOption) == 0) {
+      check_duplicate_option(cmdLineArgs->jobLogFile != NULL);
+      cmdLineArgs->jobLogFile = strdup(argv[++i]);
+    } else if (strcmp(argv[i], isolateOption) == 0) {
+      check_duplicate_option(cmdLineArgs->isolatePresent);
+      cmdLineArgs->isolatePresent = true;
+    } else if (strcmp(argv[i], isolateReadOnlyOption) == 0) {
+      check_duplicate_option(cmdLineArgs->isolateReadOnly);
+      cmdLineArgs->isolatePresent = true;
+      cmdLineArgs->isolateReadOnly = true;
+    } else if (strcmp(argv[i], envOption) == 0) {
+      // --env can be given once for each variable
+      cmdLineArgs->envTemplates = (char **)realloc(
+          (void *)cmdLineArgs->envTemplates,
+          (cmdLineArgs->numEnvTemplates + 1) * sizeof(char *));
+      cmdLineArgs->envTemplates[cmdLineArgs->numEnvTemplates++] =
+          strdup(argv[++i]);
+    } else if (strcmp(argv[i], workdirOption) == 0) {
+      check_duplicate_option(cmdLineArgs->workdirTemplate != NULL);
+      cmdLineArgs->workdirTemplate = strdup(argv[++i]);
+    } else if (strcmp(argv[i], stageDirOption) == 0) {
+      check_duplicate_option(cmdLineArgs->stageDir != NULL);
+      cmdLineArgs->stageDir = strdup(argv[++i]);
+    } else if (strcmp(argv[i], resultsOption) == 0) {
+      check_duplicate_option(cmdLineArgs->resultsDir != NULL);
+      cmdLineArgs->resultsDir = strdup(argv[++i]);
+    } else if (strcmp(argv[i], slotsGroupOption) == 0) {
+      check_duplicate_option(cmdLineArgs->slotsGroup != NULL);
+      size_t nameLength;
+      parse_slots_group(argv[++i], &nameLength, &cmdLineArgs->slotsGroupSize);
+      cmdLineArgs->slotsGroup = strndup(argv[i], nameLength);
+      // without a size the group gets one slot per CPU
+      if (cmdLineArgs->slotsGroupSize == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        cmdLineArgs->slotsGroupSize =
+            cpus < 1 ? 1 : (cpus > SLOT_GROUP_MAX ? SLOT_GROUP_MAX : (int)cpus);
+      }
+    } else if (strcmp(argv[i], classOption) == 0) {
+      // --class can be given once for each class
+      cmdLineArgs->classLimits = (char **)realloc(
+          (void *)cmdLineArgs->classLimits,
+          (cmdLineArgs->numClassLimits + 1) * sizeof(char *));
+      cmdLineArgs->classLimits[cmdLineArgs->numClassLimits++] =
+          strdup(argv[++i]);
+    } else if (strcmp(argv[i], rateOption) == 0) {
+      check_duplicate_option(cmdLineArgs->rateInterval != 0);
+      parse_rate(argv[++i], &cmdLineArgs->rateInterval);
+    } else if (strcmp(argv[i], uniqueOption) == 0) {
+      check_duplicate_option(cmdLineArgs->uniquePresent);
+      cmdLineArgs->uniquePresent = true;
+    } else if (strcmp(argv[i], uniqueFalsePositiveOption) == 0) {
+      check_duplicate_option(cmdLineArgs->uniqueFalsePositivePresent);
+      cmdLineArgs->uniqueFalsePositivePresent = true;
+      parse_false_positive_rate(argv[++i],
+                                &cmdLineArgs->uniqueFalsePositiveRate);
+    } else if (strcmp(argv[i], directivesOption) == 0) {
+      check_duplicate_option(cmdLineArgs->directivesPresent);
+      cmdLineArgs->directivesPresent = true;
+    } else if (strcmp(argv[i], speculateOption) == 0) {
+      check_duplicate_option(cmdLineArgs->speculateFactor != 0);
+      cmdLineArgs->speculateFactor = strtod(argv[++i], NULL);
+    } else if (strcmp(argv[i], stageAheadOption) == 0) {
+      check_duplicate_option(cmdLineArgs->stageAheadPresent);
+      cmdLineArgs->stageAheadPresent = true;
+      cmdLineArgs->stageAhead = atoi(argv[++i]);
+    } else if (strcmp(argv[i], nullOption) == 0 ||
+               strcmp(argv[i], nullShortOption) == 0) {
+      check_duplicate_option(cmdLineArgs->delimiterPresent);
+      cmdLineArgs->delimiterPresent = true;
+      cmdLineArgs->delimiter = '\0';
+    } else if (strcmp(argv[i], delimiterOption) == 0) {
+      check_duplicate_option(cmdLineArgs->delimiterPresent);
+      cmdLineArgs->delimiterPresent = true;
+      parse_delimiter(argv[++i], &cmdLineArgs->delimiter);
     } else if (strcmp(argv[i], pipeOption) == 0) {
       check_duplicate_option(cmdLineArgs->pipePresent);
       cmdLineArgs->pipePresent = true;
@@ -262,7 +2152,6 @@ struct CLArgs *command_line_struct_creator(int argc, char *argv[]) {
       cmdLineArgs->argsFilePresent = true;
       cmdLineArgs->fileName = strdup(argv[++i]);
       validate_file(cmdLineArgs);
-      file_args_struct_helper(cmdLineArgs);
     } else if (strcmp(argv[i], dryRun) == 0) {
       check_duplicate_option(cmdLineArgs->dryRunPresent);
       cmdLineArgs->dryRunPresent = true;
@@ -275,6 +2164,17 @@ struct CLArgs *command_line_struct_creator(int argc, char *argv[]) {
       break;
     }
   }
+  // the argsfile is read once every option is known, so sharding applies
+  start_unique_filter(cmdLineArgs);
+  if (cmdLineArgs->argsFilePresent) {
+    if (cmdLineArgs->delimiterPresent) {
+      file_records_struct_helper(cmdLineArgs);
+    } else if (is_compiled_argsfile(cmdLineArgs->fileName)) {
+      map_compiled_argsfile(cmdLineArgs);
+    } else {
+      file_args_struct_helper(cmdLineArgs);
+    }
+  }
   // allocate command and per task handling to helper functions
   if (i < argc) {
     if (strcmp(argv[i], perTask) == 0) {
@@ -339,6 +2239,64 @@ void process_struct_per_task_helper(const struct CLArgs *cmdLineArgs,
   }
 }
 
+// Finds the slot of a path in the table of redirect targets
+// Inputs: path - redirect target to look for
+// Returns: slot holding the path, or the empty slot where it belongs
+size_t probe_redirect_slot(const char *path) {
+  size_t mask = redirects.capacity - 1;
+  size_t slot = hash_bytes(path, strlen(path)) & mask;
+  while (redirects.paths[slot] && strcmp(redirects.paths[slot], path) != 0) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+// Finds the slot of a redirect target, adding it if it is new. The caller
+// holds redirects.lock.
+// Inputs: path - redirect target
+// Returns: slot holding the path
+size_t find_redirect_slot(const char *path) {
+  // keep the table at most half full so probe sequences stay short
+  if (2 * (redirects.count + 1) > redirects.capacity) {
+    struct Redirects old = redirects;
+    redirects.capacity = old.capacity ? 2 * old.capacity : REDIRECT_TARGETS_MIN;
+    redirects.paths = (char **)calloc(redirects.capacity, sizeof(char *));
+    redirects.uses = (int *)calloc(redirects.capacity, sizeof(int));
+    redirects.fds = (int *)malloc(redirects.capacity * sizeof(int));
+    for (size_t i = 0; i < redirects.capacity; i++) {
+      redirects.fds[i] = -1;
+    }
+    for (size_t i = 0; i < old.capacity; i++) {
+      if (old.paths[i]) {
+        size_t slot = probe_redirect_slot(old.paths[i]);
+        redirects.paths[slot] = old.paths[i];
+        redirects.uses[slot] = old.uses[i];
+        redirects.fds[slot] = old.fds[i];
+      }
+    }
+    free((void *)old.paths);
+    free(old.uses);
+    free(old.fds);
+  }
+
+  size_t slot = probe_redirect_slot(path);
+  if (!redirects.paths[slot]) {
+    redirects.paths[slot] = strdup(path);
+    redirects.count++;
+  }
+  return slot;
+}
+
+// Counts a redirect to a file while the argsfile is parsed, so a task which is
+// the only writer of its file can still open it itself
+// Inputs: path - redirect target
+void intern_redirect_target(const char *path) {
+  pthread_mutex_lock(&redirects.lock);
+  size_t slot = find_redirect_slot(path);
+  redirects.uses[slot]++;
+  pthread_mutex_unlock(&redirects.lock);
+}
+
 // Parses tokens to update args, stdoutFile, and stderrFile for a single task
 // Inputs: cmdLineArgs - pointer to CLArgs struct
 //         pArgs - pointer to PArgs struct
@@ -361,6 +2319,7 @@ void file_arg_helper_helper(const struct CLArgs *cmdLineArgs,
       if (!cmdLineArgs->pipePresent) {
         free(pArgs->stdoutFiles[i]);
         pArgs->stdoutFiles[i] = strdup(tokens[j] + STDOUT_FILE_HEADER_LENGTH);
+        intern_redirect_target(pArgs->stdoutFiles[i]);
       }
     } else if (strncmp(tokens[j], stderrFile, 2) == 0) {
       pArgs->numElements[i]--;
@@ -369,7 +2328,14 @@ void file_arg_helper_helper(const struct CLArgs *cmdLineArgs,
       if (!cmdLineArgs->pipePresent) {
         free(pArgs->stderrFiles[i]);
         pArgs->stderrFiles[i] = strdup(tokens[j] + STDERR_FILE_HEADER_LENGTH);
+        intern_redirect_target(pArgs->stderrFiles[i]);
       }
+    } else if (cmdLineArgs->directivesPresent &&
+               is_task_directive(tokens[j])) {
+      pArgs->numElements[i]--;
+      pArgs->args[i] = (char **)realloc((void *)pArgs->args[i],
+                                        pArgs->numElements[i] * sizeof(char *));
+      apply_task_directive(pArgs, i, tokens[j]);
     } else {
       pArgs->args[i][(*writePointer)++] = strdup(tokens[j]);
     }
@@ -383,6 +2349,16 @@ void file_arg_helper_helper(const struct CLArgs *cmdLineArgs,
 //         i - index of the task
 void file_arg_helper(const struct CLArgs *cmdLineArgs, struct PArgs *pArgs,
                      int writePointer, int i) {
+  // a delimited record is a single argument as it is
+  if (cmdLineArgs->delimiterPresent) {
+    pArgs->numElements[i] = writePointer + PER_TASK_ARG + NULL_TERMINATOR;
+    pArgs->args[i] = (char **)realloc((void *)pArgs->args[i],
+                                      pArgs->numElements[i] * sizeof(char *));
+    pArgs->args[i][writePointer] = strdup(cmdLineArgs->fileArgs[i]);
+    pArgs->args[i][writePointer + 1] = NULL;
+    return;
+  }
+
   // tokenise the line arguments
   int numTokens = 0;
   char *line = strdup(cmdLineArgs->fileArgs[i]);
@@ -500,6 +2476,97 @@ void process_struct_stdin_helper(const struct CLArgs *cmdLineArgs,
   }
 }
 
+// Populates PArgs struct for a compiled argsfile. Tasks are only loaded from
+// the mapped file when they are about to run, so startup doesn't depend on
+// the number of tasks.
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+//         pArgs - pointer to PArgs struct
+void process_struct_compiled_helper(const struct CLArgs *cmdLineArgs,
+                                    struct PArgs *pArgs) {
+  pArgs->compiledFile = cmdLineArgs->compiledFile;
+  pArgs->numPrefixArgs =
+      cmdLineArgs->commandPresent ? COMMAND + cmdLineArgs->numFixedArgs : 0;
+  pArgs->prefixArgs =
+      (char **)calloc(pArgs->numPrefixArgs + NULL_TERMINATOR, sizeof(char *));
+
+  if (cmdLineArgs->commandPresent) {
+    pArgs->prefixArgs[0] = strdup(cmdLineArgs->command);
+    for (int j = 0; j < cmdLineArgs->numFixedArgs; j++) {
+      pArgs->prefixArgs[COMMAND + j] = strdup(cmdLineArgs->fixedArgs[j]);
+    }
+  }
+
+  // redirect targets are ignored in pipe mode, as they are for text argsfiles
+  if (!cmdLineArgs->pipePresent) {
+    pArgs->stdoutFiles = (char **)calloc(pArgs->numArgs, sizeof(char *));
+    pArgs->stderrFiles = (char **)calloc(pArgs->numArgs, sizeof(char *));
+  }
+}
+
+// Builds a task's argv from a compiled argsfile just before it is run. The
+// arguments point into the mapped file, so nothing is copied.
+// Inputs: pArgs - pointer to PArgs struct
+//         i - index of task
+void load_compiled_task(struct PArgs *pArgs, int i) {
+  if (!pArgs->compiledFile || pArgs->args[i]) {
+    return;
+  }
+
+  uint32_t argc = 0;
+  char *targets[NUM_OUTPUT_STREAMS];
+  char *arg = find_compiled_task(
+      pArgs->compiledFile, compiled_task_index(pArgs->compiledFile, i), &argc,
+      targets);
+  if (!arg) {
+    // a corrupt task runs as an empty command, which is reported by the child
+    fprintf(stderr, "uqparallel: Invalid task %d in compiled argsfile\n",
+            i + 1);
+    argc = 0;
+  }
+
+  pArgs->numElements[i] = pArgs->numPrefixArgs + argc + NULL_TERMINATOR;
+  pArgs->args[i] = (char **)malloc(pArgs->numElements[i] * sizeof(char *));
+  int writePointer = 0;
+  for (; writePointer < pArgs->numPrefixArgs; writePointer++) {
+    pArgs->args[i][writePointer] = pArgs->prefixArgs[writePointer];
+  }
+  for (uint32_t j = 0; j < argc; j++) {
+    pArgs->args[i][writePointer++] = arg;
+    arg += strlen(arg) + NULL_TERMINATOR;
+  }
+  pArgs->args[i][writePointer] = NULL;
+
+  if (pArgs->stdoutFiles && argc > 0) {
+    pArgs->stdoutFiles[i] = targets[0][0] != '\0' ? targets[0] : NULL;
+    pArgs->stderrFiles[i] = targets[1][0] != '\0' ? targets[1] : NULL;
+  }
+}
+
+// Releases a task loaded by load_compiled_task() once it has been spawned
+// Inputs: pArgs - pointer to PArgs struct
+//         i - index of task
+void unload_compiled_task(struct PArgs *pArgs, int i) {
+  if (!pArgs->compiledFile) {
+    return;
+  }
+  free((void *)pArgs->args[i]);
+  pArgs->args[i] = NULL;
+  if (pArgs->stdoutFiles) {
+    pArgs->stdoutFiles[i] = NULL;
+    pArgs->stderrFiles[i] = NULL;
+  }
+}
+
+// Exits when there are no tasks to run. An empty share of a sharded task list
+// isn't an error.
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+void exit_no_tasks(const struct CLArgs *cmdLineArgs) {
+  if (cmdLineArgs->shardPresent) {
+    exit(0);
+  }
+  exit(EMPTY_COMMAND_EXIT_NUM);
+}
+
 // Creates and populates a PArgs struct based on mode in CLArgs
 // Inputs: cmdLineArgs - pointer to CLArgs struct
 // Returns: pointer to a newly allocated PArgs struct
@@ -510,7 +2577,7 @@ struct PArgs *process_struct_creator(const struct CLArgs *cmdLineArgs) {
   if (cmdLineArgs->perTaskPresent) {
     // Exit if perTask option is present but there are no perTask args
     if (cmdLineArgs->numPerTaskArgs == 0) {
-      exit(EMPTY_COMMAND_EXIT_NUM);
+      exit_no_tasks(cmdLineArgs);
     }
 
     // Allocate memory depending on number of perTask arguments
@@ -519,9 +2586,20 @@ struct PArgs *process_struct_creator(const struct CLArgs *cmdLineArgs) {
     pArgs->numElements = (int *)calloc(pArgs->numArgs, sizeof(int));
 
     process_struct_per_task_helper(cmdLineArgs, pArgs);
+  } else if (cmdLineArgs->compiledFile) {
+    if (cmdLineArgs->compiledFile->numSelected == 0) {
+      exit_no_tasks(cmdLineArgs);
+    }
+
+    // task arrays are filled in as tasks are loaded
+    pArgs->numArgs = (int)cmdLineArgs->compiledFile->numSelected;
+    pArgs->args = (char ***)calloc(pArgs->numArgs, sizeof(char **));
+    pArgs->numElements = (int *)calloc(pArgs->numArgs, sizeof(int));
+
+    process_struct_compiled_helper(cmdLineArgs, pArgs);
   } else if (cmdLineArgs->argsFilePresent) {
     if (cmdLineArgs->numFileArgs == 0) {
-      exit(EMPTY_COMMAND_EXIT_NUM);
+      exit_no_tasks(cmdLineArgs);
     }
 
     // Allocate memory based on number of lines in the file
@@ -543,6 +2621,7 @@ struct PArgs *process_struct_creator(const struct CLArgs *cmdLineArgs) {
     process_struct_stdin_helper(cmdLineArgs, pArgs);
   }
 
+  UQ_TRACE(parse, pArgs->numArgs);
   return pArgs;
 }
 
@@ -557,6 +2636,33 @@ void free_command_line_struct(struct CLArgs *cmdLineArgs) {
     free(cmdLineArgs->command);
   }
 
+  free(cmdLineArgs->zygoteWorker);
+  free(cmdLineArgs->serveAddress);
+  free(cmdLineArgs->workerAddresses);
+  free(cmdLineArgs->compileOutput);
+  free(cmdLineArgs->statsSocket);
+  free(cmdLineArgs->orderJobLog);
+  free(cmdLineArgs->jobLogFile);
+  free(cmdLineArgs->workdirTemplate);
+  free(cmdLineArgs->stageDir);
+  free(cmdLineArgs->resultsDir);
+  free(cmdLineArgs->slotsGroup);
+  for (int i = 0; i < cmdLineArgs->numEnvTemplates; i++) {
+    free(cmdLineArgs->envTemplates[i]);
+  }
+  free((void *)cmdLineArgs->envTemplates);
+  for (int i = 0; i < cmdLineArgs->numClassLimits; i++) {
+    free(cmdLineArgs->classLimits[i]);
+  }
+  free((void *)cmdLineArgs->classLimits);
+  stop_unique_filter();
+
+  if (cmdLineArgs->compiledFile) {
+    munmap(cmdLineArgs->compiledFile->data, cmdLineArgs->compiledFile->size);
+    free(cmdLineArgs->compiledFile->selected);
+    free(cmdLineArgs->compiledFile);
+  }
+
   if (cmdLineArgs->numFixedArgs > 0) {
     for (int i = 0; i < cmdLineArgs->numFixedArgs; i++) {
       free(cmdLineArgs->fixedArgs[i]);
@@ -588,6 +2694,52 @@ void free_process_struct(struct PArgs *pArgs) {
     return;
   }
 
+  free(pArgs->priorities);
+  free(pArgs->order);
+  for (int i = 0; i < pArgs->numArgs; i++) {
+    if (pArgs->taskIds) {
+      free(pArgs->taskIds[i]);
+    }
+    if (pArgs->taskAfter) {
+      free(pArgs->taskAfter[i]);
+    }
+    if (pArgs->taskCwd) {
+      free(pArgs->taskCwd[i]);
+    }
+    if (pArgs->classNames) {
+      free(pArgs->classNames[i]);
+    }
+  }
+  free((void *)pArgs->taskIds);
+  free((void *)pArgs->taskAfter);
+  free((void *)pArgs->taskCwd);
+  free((void *)pArgs->classNames);
+  free_task_directive_lists(pArgs->taskEnv, pArgs->numArgs);
+  free_task_directive_lists(pArgs->stageIn, pArgs->numArgs);
+  free_task_directive_lists(pArgs->stageOut, pArgs->numArgs);
+  free(pArgs->replicas);
+  free(pArgs->splitModes);
+  if (pArgs->graph) {
+    free(pArgs->graph->firstDependent);
+    free(pArgs->graph->dependents);
+    free(pArgs->graph->numParents);
+    free(pArgs->graph);
+  }
+
+  // compiled tasks point into the mapped file, only the arrays are ours
+  if (pArgs->compiledFile) {
+    for (int i = 0; i < pArgs->numPrefixArgs; i++) {
+      free(pArgs->prefixArgs[i]);
+    }
+    free((void *)pArgs->prefixArgs);
+    free((void *)pArgs->args);
+    free((void *)pArgs->stdoutFiles);
+    free((void *)pArgs->stderrFiles);
+    free(pArgs->numElements);
+    free(pArgs);
+    return;
+  }
+
   // Free args if any exist
   if (pArgs->args) {
     for (int i = 0; i < pArgs->numArgs; i++) {
@@ -624,15 +2776,15 @@ void free_process_struct(struct PArgs *pArgs) {
 //         numArrayElements - number of elements in array
 // Returns: space-separated string, caller must free
 char *create_string_from_array(char **array, int numArrayElements) {
-  int stringSize = 0;
+  size_t stringSize = 0;
 
   // get length of all strings in the given array for initialisation
   for (int i = 0; i < numArrayElements; i++) {
-    stringSize += (int)strlen(array[i]);
+    stringSize += strlen(array[i]);
   }
 
   // numArrayElements-1 account for spaces and a null terminator
-  char *string = malloc(stringSize + numArrayElements);
+  char *string = malloc(stringSize + (size_t)numArrayElements);
   int writePointer = 0;
 
   for (int i = 0; i < numArrayElements; i++) {
@@ -700,6 +2852,42 @@ bool is_blank_line(const char *line) {
   return true;
 }
 
+// Copies a line without its task directive tokens, for dry runs with
+// --directives. Other tokens are kept as written, quotes included.
+// Inputs: line - argsfile or stdin line
+// Returns: newly allocated line, ending in a newline if line did
+char *strip_task_directives(const char *line) {
+  char *result = malloc(strlen(line) + 1);
+  size_t length = 0;
+  const char *position = line;
+
+  while (*position && *position != '\n') {
+    if (*position == ' ') {
+      position++;
+      continue;
+    }
+    // a token runs to the next space which is not inside quotes
+    const char *start = position;
+    bool quoted = false;
+    while (*position && *position != '\n' && (quoted || *position != ' ')) {
+      quoted ^= *position == '"';
+      position++;
+    }
+    if (!is_task_directive(start)) {
+      if (length > 0) {
+        result[length++] = ' ';
+      }
+      memcpy(result + length, start, position - start);
+      length += position - start;
+    }
+  }
+  if (*position == '\n') {
+    result[length++] = '\n';
+  }
+  result[length] = '\0';
+  return result;
+}
+
 // Performs dry-run printing for file mode
 // Inputs: cmdLineArgs - pointer to CLArgs struct
 void file_dry_run(const struct CLArgs *cmdLineArgs) {
@@ -708,23 +2896,27 @@ void file_dry_run(const struct CLArgs *cmdLineArgs) {
   for (int i = 0; i < cmdLineArgs->numFileArgs; i++) {
     // only print commands if dry run is present
     if (cmdLineArgs->dryRunPresent) {
+      // directives are not arguments, so they are left out as when running
+      char *fileArg = cmdLineArgs->directivesPresent
+                          ? strip_task_directives(cmdLineArgs->fileArgs[i])
+                          : strdup(cmdLineArgs->fileArgs[i]);
       if (cmdLineArgs->numFixedArgs > 0) {
         char *fixedArgString = create_string_from_array(
             cmdLineArgs->fixedArgs, cmdLineArgs->numFixedArgs);
         printf("%i: %s %s %s\n", count, cmdLineArgs->command, fixedArgString,
-               cmdLineArgs->fileArgs[i]);
+               fileArg);
         count += 1;
         free(fixedArgString);
       } else if (cmdLineArgs->commandPresent) {
-        printf("%i: %s %s\n", count, cmdLineArgs->command,
-               cmdLineArgs->fileArgs[i]);
+        printf("%i: %s %s\n", count, cmdLineArgs->command, fileArg);
         count += 1;
       } else {
-        if (!(is_blank_line(cmdLineArgs->fileArgs[i]))) {
-          printf("%i: %s\n", count, cmdLineArgs->fileArgs[i]);
+        if (!(is_blank_line(fileArg))) {
+          printf("%i: %s\n", count, fileArg);
           count += 1;
         }
       }
+      free(fileArg);
       fflush(stdout);
       // why is this here
     } else {
@@ -735,13 +2927,64 @@ void file_dry_run(const struct CLArgs *cmdLineArgs) {
   }
 }
 
+// Prints an argument for a dry run, quoting it if it contains a space
+// Inputs: arg - argument to print
+//         separator - string printed after the argument
+void print_dry_run_arg(const char *arg, const char *separator) {
+  if (strchr(arg, ' ')) {
+    printf("\"%s\"%s", arg, separator);
+  } else {
+    printf("%s%s", arg, separator);
+  }
+}
+
+// Performs dry-run printing for records read from stdin with -0 or
+// --delimiter
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+void stdin_record_dry_run(const struct CLArgs *cmdLineArgs) {
+  struct RecordReader reader = {0};
+  reader.fd = STDIN_FILENO;
+  reader.delimiter = cmdLineArgs->delimiter;
+  int count = 1;
+  char *record;
+  size_t length;
+  while ((record = read_record(&reader, &length))) {
+    if (!unique_task_is_new(record, length)) {
+      continue;
+    }
+    printf("%i: ", count++);
+    if (cmdLineArgs->commandPresent) {
+      print_dry_run_arg(cmdLineArgs->command, " ");
+    }
+    for (int i = 0; i < cmdLineArgs->numFixedArgs; i++) {
+      print_dry_run_arg(cmdLineArgs->fixedArgs[i], " ");
+    }
+    print_dry_run_arg(record, "\n");
+  }
+  free(reader.buffer);
+  fflush(stdout);
+}
+
 // Performs dry-run printing for stdin mode
 // Inputs: cmdLineArgs - pointer to CLArgs struct
 void stdin_dry_run(const struct CLArgs *cmdLineArgs) {
+  if (cmdLineArgs->delimiterPresent) {
+    stdin_record_dry_run(cmdLineArgs);
+    return;
+  }
   char line[LINE_BUFFER];
   int count = 1;
   while (fgets(line, sizeof(line), stdin)) {
     char *processedLine = modify_string(line);
+    if (!unique_task_is_new(processedLine, strcspn(processedLine, "\n"))) {
+      free(processedLine);
+      continue;
+    }
+    if (cmdLineArgs->directivesPresent) {
+      char *strippedLine = strip_task_directives(processedLine);
+      free(processedLine);
+      processedLine = strippedLine;
+    }
 
     if (cmdLineArgs->dryRunPresent) {
       if (cmdLineArgs->numFixedArgs > 0) {
@@ -765,11 +3008,58 @@ void stdin_dry_run(const struct CLArgs *cmdLineArgs) {
   }
 }
 
+// Performs dry-run printing for a compiled argsfile
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+void compiled_dry_run(const struct CLArgs *cmdLineArgs) {
+  const struct CompiledArgsFile *compiled = cmdLineArgs->compiledFile;
+  int count = 1;
+
+  for (uint64_t i = 0; i < compiled->numSelected; i++) {
+    uint32_t argc = 0;
+    char *targets[NUM_OUTPUT_STREAMS];
+    char *arg = find_compiled_task(compiled, compiled_task_index(compiled, i),
+                                   &argc, targets);
+    if (!arg) {
+      continue;
+    }
+    // blank lines are skipped when there is no command, as in file_dry_run()
+    if (!cmdLineArgs->commandPresent && argc == 0 && targets[0][0] == '\0' &&
+        targets[1][0] == '\0') {
+      continue;
+    }
+
+    printf("%i:", count++);
+    if (cmdLineArgs->commandPresent) {
+      printf(" ");
+      print_dry_run_arg(cmdLineArgs->command, "");
+    }
+    for (int j = 0; j < cmdLineArgs->numFixedArgs; j++) {
+      printf(" ");
+      print_dry_run_arg(cmdLineArgs->fixedArgs[j], "");
+    }
+    for (uint32_t j = 0; j < argc; j++) {
+      printf(" ");
+      print_dry_run_arg(arg, "");
+      arg += strlen(arg) + NULL_TERMINATOR;
+    }
+    if (targets[0][0] != '\0') {
+      printf(" %c%s", stdoutFile, targets[0]);
+    }
+    if (targets[1][0] != '\0') {
+      printf(" %s%s", stderrFile, targets[1]);
+    }
+    printf("\n");
+    fflush(stdout);
+  }
+}
+
 // Executes the appropriate dry-run printing function
 // Inputs: cmdLineArgs - pointer to CLArgs struct
 void execute_dry_run(const struct CLArgs *cmdLineArgs) {
   if (cmdLineArgs->perTaskPresent) {
     per_task_dry_run(cmdLineArgs);
+  } else if (cmdLineArgs->compiledFile) {
+    compiled_dry_run(cmdLineArgs);
   } else if (cmdLineArgs->argsFilePresent) {
     file_dry_run(cmdLineArgs);
   } else {
@@ -777,179 +3067,5751 @@ void execute_dry_run(const struct CLArgs *cmdLineArgs) {
   }
 }
 
-// Executes a single child process for a pipe
-// Inputs: pArgs - pointer to PArgs struct
+// Records that a task has been started
+void stats_task_started(void) {
+  __atomic_fetch_add(&runStats.started, 1, __ATOMIC_RELAXED);
+}
+
+// Records that a task has finished
+// Inputs: exitStatus - exit status of the task, non-zero counts as failed
+void stats_task_finished(int exitStatus) {
+  __atomic_fetch_add(&runStats.done, 1, __ATOMIC_RELAXED);
+  if (exitStatus != 0) {
+    __atomic_fetch_add(&runStats.failed, 1, __ATOMIC_RELAXED);
+  }
+}
+
+// Records tasks which will never run because a task they depend on failed.
+// They count as started and failed so the run still adds up to its total.
+// Inputs: numTasks - number of tasks cancelled
+void stats_tasks_cancelled(int numTasks) {
+  __atomic_fetch_add(&runStats.started, numTasks, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&runStats.done, numTasks, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&runStats.failed, numTasks, __ATOMIC_RELAXED);
+}
+
+// Records that started tasks have been handed back to be run again
+// Inputs: numTasks - number of tasks returned
+void stats_tasks_requeued(int numTasks) {
+  __atomic_fetch_sub(&runStats.started, numTasks, __ATOMIC_RELAXED);
+}
+
+// Opens a pidfd for a child so it can be polled for termination
+// Inputs: pid - process id of the child
+// Returns: pidfd, or -1 if pidfds aren't supported by the kernel
+int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+  return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+  (void)pid;
+  return -1;
+#endif
+}
+
+// Returns a monotonic timestamp for --latency-report
+// Returns: nanoseconds, or 0 if latency reporting is off
+uint64_t latency_now(void) {
+  if (!latencyReport.enabled) {
+    return 0;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * NANOSECONDS_PER_SECOND_U64 +
+         (uint64_t)now.tv_nsec;
+}
+
+// Finds the histogram bucket for a latency
+// Inputs: value - latency in nanoseconds
+// Returns: bucket index
+int latency_bucket(uint64_t value) {
+  if (value < LATENCY_SUB_BUCKETS) {
+    return (int)value;
+  }
+  int shift = 63 - __builtin_clzll(value) - LATENCY_SUB_BUCKET_BITS;
+  return shift * LATENCY_SUB_BUCKETS + (int)(value >> shift);
+}
+
+// Returns the largest latency which falls into a histogram bucket
+// Inputs: bucket - bucket index
+// Returns: latency in nanoseconds
+uint64_t latency_bucket_limit(int bucket) {
+  if (bucket < LATENCY_SUB_BUCKETS) {
+    return (uint64_t)bucket;
+  }
+  int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+  uint64_t mantissa = (uint64_t)(bucket % LATENCY_SUB_BUCKETS) +
+                      LATENCY_SUB_BUCKETS;
+  return ((mantissa + 1) << shift) - 1;
+}
+
+// Adds a latency to a stage's histogram. Safe to call from any thread.
+// Inputs: stage - LATENCY_* stage
+//         start - timestamp the stage started at
+//         end - timestamp the stage ended at
+void latency_record(int stage, uint64_t start, uint64_t end) {
+  struct LatencyHistogram *histogram = &latencyReport.histograms[stage];
+  uint64_t value = end > start ? end - start : 0;
+  __atomic_fetch_add(&histogram->counts[latency_bucket(value)], 1,
+                     __ATOMIC_RELAXED);
+  __atomic_fetch_add(&histogram->total, 1, __ATOMIC_RELAXED);
+
+  uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+  while (value > max &&
+         !__atomic_compare_exchange_n(&histogram->max, &max, value, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+// Closes a job's descriptor. Its watch is one-shot, and closing the last
+// reference removes it from the epoll set, so no EPOLL_CTL_DEL is needed.
+// Inputs: fd - pointer to the descriptor, set to -1
+void latency_close_fd(int *fd) {
+  if (*fd >= 0) {
+    close(*fd);
+    *fd = -1;
+  }
+}
+
+// Asks the watcher thread to report once when a descriptor of a job is ready.
+// A child forked meanwhile may keep the descriptor alive after we close it,
+// so its one event may arrive late, and the generation marks it stale.
+// Inputs: job - job the descriptor belongs to
+//         fd - exec pipe or pidfd of the job
+//         kind - LATENCY_EVENT_EXEC or LATENCY_EVENT_EXIT
+void latency_watch_fd(const struct LatencyJob *job, int fd, int kind) {
+  struct epoll_event event = {0};
+  uint64_t slot = (uint64_t)(job - latencyReport.jobs);
+  event.events = EPOLLIN | EPOLLONESHOT;
+  event.data.u64 = ((uint64_t)job->generation << 32) | (slot << 1) |
+                   (uint64_t)kind;
+  epoll_ctl(latencyReport.epollFd, EPOLL_CTL_ADD, fd, &event);
+}
+
+// Takes the timestamps and exec status pipe needed before forking a job
+// Inputs: spawn - filled in for latency_spawned()
+//         queuedAt - when the job could first have been started
+void latency_prepare_spawn(struct LatencySpawn *spawn, uint64_t queuedAt) {
+  spawn->execPipe[0] = -1;
+  spawn->execPipe[1] = -1;
+  if (!latencyReport.enabled) {
+    return;
+  }
+  // both ends close on exec, so the read end sees EOF once exec succeeds
+  if (pipe2(spawn->execPipe, O_CLOEXEC) == -1) {
+    spawn->execPipe[0] = -1;
+    spawn->execPipe[1] = -1;
+  }
+  spawn->queuedAt = queuedAt;
+  spawn->forkedAt = latency_now();
+}
+
+// Starts tracking a job after it has been forked
+// Inputs: spawn - state from latency_prepare_spawn()
+//         pid - pid returned by fork
+void latency_spawned(struct LatencySpawn *spawn, pid_t pid) {
+  if (!latencyReport.enabled) {
+    return;
+  }
+  if (spawn->execPipe[1] >= 0) {
+    close(spawn->execPipe[1]);
+  }
+  if (pid < 0) {
+    if (spawn->execPipe[0] >= 0) {
+      close(spawn->execPipe[0]);
+    }
+    return;
+  }
+  latency_record(LATENCY_QUEUE, spawn->queuedAt, spawn->forkedAt);
+
+  pthread_mutex_lock(&latencyReport.lock);
+  struct LatencyJob *job = NULL;
+  for (int i = 0; i < JOB_LIMIT_MAX && !job; i++) {
+    if (!latencyReport.jobs[i].inUse) {
+      job = &latencyReport.jobs[i];
+    }
+  }
+  if (!job) {
+    // every slot is taken, only the queue time is recorded for this job
+    if (spawn->execPipe[0] >= 0) {
+      close(spawn->execPipe[0]);
+    }
+    pthread_mutex_unlock(&latencyReport.lock);
+    return;
+  }
+
+  job->inUse = true;
+  job->generation++;
+  job->pid = pid;
+  job->forkedAt = spawn->forkedAt;
+  job->execAt = 0;
+  job->exitedAt = 0;
+  job->execFd = spawn->execPipe[0];
+  job->pidfd = open_pidfd(pid);
+  if (job->execFd >= 0) {
+    latency_watch_fd(job, job->execFd, LATENCY_EVENT_EXEC);
+  }
+  if (job->pidfd >= 0) {
+    latency_watch_fd(job, job->pidfd, LATENCY_EVENT_EXIT);
+  }
+  pthread_mutex_unlock(&latencyReport.lock);
+}
+
+// Records the remaining stages of a job once it has been reaped. Anything the
+// watcher thread hasn't seen yet is taken to have happened at reap time.
+// Inputs: pid - pid of the reaped job
+void latency_reaped(pid_t pid) {
+  if (!latencyReport.enabled) {
+    return;
+  }
+  uint64_t reapedAt = latency_now();
+
+  pthread_mutex_lock(&latencyReport.lock);
+  for (int i = 0; i < JOB_LIMIT_MAX; i++) {
+    struct LatencyJob *job = &latencyReport.jobs[i];
+    if (!job->inUse || job->pid != pid) {
+      continue;
+    }
+    if (!job->exitedAt) {
+      job->exitedAt = reapedAt;
+    }
+    if (!job->execAt) {
+      job->execAt = job->exitedAt;
+      latency_record(LATENCY_EXEC, job->forkedAt, job->execAt);
+    }
+    latency_record(LATENCY_RUN, job->execAt, job->exitedAt);
+    latency_record(LATENCY_REAP, job->exitedAt, reapedAt);
+    latency_close_fd(&job->execFd);
+    latency_close_fd(&job->pidfd);
+    job->inUse = false;
+    break;
+  }
+  pthread_mutex_unlock(&latencyReport.lock);
+}
+
+// Main loop of the latency watcher thread, timestamps execs and exits
+// Inputs: arg - unused
+// Returns: NULL
+void *latency_watcher_thread(void *arg) {
+  (void)arg;
+  struct epoll_event events[LATENCY_MAX_EVENTS];
+
+  while (true) {
+    int ready = epoll_wait(latencyReport.epollFd, events, LATENCY_MAX_EVENTS,
+                           -1);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return NULL;
+    }
+    pthread_mutex_lock(&latencyReport.lock);
+    for (int i = 0; i < ready; i++) {
+      // a job's exec and exit may arrive together, so each gets its own time
+      uint64_t now = latency_now();
+      uint64_t data = events[i].data.u64;
+      if (data == LATENCY_EVENT_WAKE) {
+        pthread_mutex_unlock(&latencyReport.lock);
+        return NULL;
+      }
+      // events for a slot which has since been reused are stale
+      struct LatencyJob *job = &latencyReport.jobs[(uint32_t)data >> 1];
+      if (!job->inUse || job->generation != (uint32_t)(data >> 32)) {
+        continue;
+      }
+      if ((data & 1) == LATENCY_EVENT_EXEC) {
+        job->execAt = now;
+        latency_record(LATENCY_EXEC, job->forkedAt, now);
+        latency_close_fd(&job->execFd);
+      } else {
+        job->exitedAt = now;
+        latency_close_fd(&job->pidfd);
+      }
+    }
+    pthread_mutex_unlock(&latencyReport.lock);
+  }
+}
+
+// Starts the latency watcher thread if --latency-report was given
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+void start_latency_report(const struct CLArgs *cmdLineArgs) {
+  if (!cmdLineArgs->latencyReportPresent) {
+    return;
+  }
+  pthread_mutex_init(&latencyReport.lock, NULL);
+  latencyReport.epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (latencyReport.epollFd < 0 ||
+      pipe2(latencyReport.wakePipe, O_CLOEXEC) == -1) {
+    return;
+  }
+  struct epoll_event event = {0};
+  event.events = EPOLLIN;
+  event.data.u64 = LATENCY_EVENT_WAKE;
+  epoll_ctl(latencyReport.epollFd, EPOLL_CTL_ADD, latencyReport.wakePipe[0],
+            &event);
+
+  latencyReport.enabled = true;
+  if (pthread_create(&latencyReport.thread, NULL, latency_watcher_thread,
+                     NULL) != 0) {
+    latencyReport.enabled = false;
+  }
+}
+
+// Formats a latency with a unit suited to its size
+// Inputs: value - latency in nanoseconds
+//         buffer - buffer to write to
+//         size - size of buffer
+void format_latency(uint64_t value, char *buffer, size_t size) {
+  if (value < NANOSECONDS_PER_MICROSECOND) {
+    snprintf(buffer, size, "%luns", (unsigned long)value);
+  } else if (value < NANOSECONDS_PER_MILLISECOND) {
+    snprintf(buffer, size, "%.1fus",
+             (double)value / NANOSECONDS_PER_MICROSECOND);
+  } else if (value < NANOSECONDS_PER_SECOND_U64) {
+    snprintf(buffer, size, "%.1fms",
+             (double)value / NANOSECONDS_PER_MILLISECOND);
+  } else {
+    snprintf(buffer, size, "%.2fs", (double)value / NANOSECONDS_PER_SECOND);
+  }
+}
+
+// Finds a percentile of a histogram
+// Inputs: histogram - histogram to search
+//         fraction - percentile as a fraction, e.g. 0.99
+// Returns: latency in nanoseconds, accurate to the bucket width
+uint64_t latency_percentile(const struct LatencyHistogram *histogram,
+                            double fraction) {
+  // rank of the percentile value, rounded up
+  double rank = fraction * (double)histogram->total;
+  uint64_t target = (uint64_t)rank;
+  if ((double)target < rank || target < 1) {
+    target++;
+  }
+  uint64_t seen = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += histogram->counts[i];
+    if (seen >= target) {
+      uint64_t limit = latency_bucket_limit(i);
+      return limit < histogram->max ? limit : histogram->max;
+    }
+  }
+  return histogram->max;
+}
+
+// Prints p50, p99, p999 and max of every latency stage to stderr
+void print_latency_report(void) {
+  const double percentiles[] = {0.5, 0.99, 0.999};
+  fprintf(stderr, "%-14s %8s %10s %10s %10s %10s\n", "latency", "count",
+          "p50", "p99", "p999", "max");
+
+  for (int stage = 0; stage < NUM_LATENCY_STAGES; stage++) {
+    const struct LatencyHistogram *histogram =
+        &latencyReport.histograms[stage];
+    fprintf(stderr, "%-14s %8lu", latencyStageNames[stage],
+            (unsigned long)histogram->total);
+    if (histogram->total == 0) {
+      fprintf(stderr, " %10s %10s %10s %10s\n", "-", "-", "-", "-");
+      continue;
+    }
+    char value[LATENCY_DURATION_SIZE];
+    for (int i = 0; i < 3; i++) {
+      format_latency(latency_percentile(histogram, percentiles[i]), value,
+                     sizeof(value));
+      fprintf(stderr, " %10s", value);
+    }
+    format_latency(histogram->max, value, sizeof(value));
+    fprintf(stderr, " %10s\n", value);
+  }
+}
+
+// Stops the latency watcher thread and prints the latency report
+void stop_latency_report(void) {
+  if (!latencyReport.enabled) {
+    return;
+  }
+  close(latencyReport.wakePipe[1]);
+  pthread_join(latencyReport.thread, NULL);
+  close(latencyReport.wakePipe[0]);
+  close(latencyReport.epollFd);
+  latencyReport.enabled = false;
+  print_latency_report();
+}
+
+// Returns the task to run at a position in the run order
+// Inputs: pArgs - pointer to PArgs struct
+//         i - position in the run order
+// Returns: index of the task
+int task_at(const struct PArgs *pArgs, int i) {
+  return pArgs->order ? pArgs->order[i] : i;
+}
+
+// Returns true if task a should come out of a heap before task b
+// Inputs: heap - heap the tasks are in
+//         a - index of a task
+//         b - index of a task
+// Returns: true if a has a larger key, or the same key and a lower index
+bool task_heap_before(const struct TaskHeap *heap, int a, int b) {
+  return heap->keys[a] > heap->keys[b] ||
+         (heap->keys[a] == heap->keys[b] && a < b);
+}
+
+// Adds a task to a heap, which must have room for it
+// Inputs: heap - heap to add to
+//         task - index of the task
+void task_heap_push(struct TaskHeap *heap, int task) {
+  int child = heap->size++;
+  while (child > 0) {
+    int parent = (child - 1) / 2;
+    if (!task_heap_before(heap, task, heap->tasks[parent])) {
+      break;
+    }
+    heap->tasks[child] = heap->tasks[parent];
+    child = parent;
+  }
+  heap->tasks[child] = task;
+}
+
+// Removes the task with the largest key from a non-empty heap
+// Inputs: heap - heap to remove from
+// Returns: index of the task
+int task_heap_pop(struct TaskHeap *heap) {
+  int top = heap->tasks[0];
+  int last = heap->tasks[--heap->size];
+  int parent = 0;
+
+  while (true) {
+    int child = 2 * parent + 1;
+    if (child >= heap->size) {
+      break;
+    }
+    if (child + 1 < heap->size &&
+        task_heap_before(heap, heap->tasks[child + 1], heap->tasks[child])) {
+      child++;
+    }
+    if (!task_heap_before(heap, heap->tasks[child], last)) {
+      break;
+    }
+    heap->tasks[parent] = heap->tasks[child];
+    parent = child;
+  }
+  heap->tasks[parent] = last;
+  return top;
+}
+
+// Returns the next value of a splitmix64 pseudo-random sequence
+// Inputs: state - sequence state, advanced by one step
+// Returns: pseudo-random value
+uint64_t splitmix64(uint64_t *state) {
+  uint64_t value = (*state += SPLITMIX_INCREMENT);
+  value = (value ^ (value >> 30)) * SPLITMIX_MULTIPLIER_1;
+  value = (value ^ (value >> 27)) * SPLITMIX_MULTIPLIER_2;
+  return value ^ (value >> 31);
+}
+
+// Returns the command line a task runs, as written to the job log
+// Inputs: pArgs - pointer to PArgs struct with the task loaded
+//         i - index of task
+// Returns: space-separated command, caller must free
+char *task_command(const struct PArgs *pArgs, int i) {
+  int numArgs = 0;
+  while (pArgs->args[i] && pArgs->args[i][numArgs]) {
+    numArgs++;
+  }
+  return create_string_from_array(pArgs->args[i], numArgs);
+}
+
+// Finds the slot of a command in a table of runtime estimates
+// Inputs: estimates - table to search, which must have a free slot
+//         command - command to look for
+// Returns: slot holding the command, or the empty slot where it belongs
+size_t find_runtime_slot(const struct RuntimeEstimates *estimates,
+                         const char *command) {
+  size_t mask = estimates->capacity - 1;
+  size_t slot = hash_bytes(command, strlen(command)) & mask;
+  while (estimates->commands[slot] &&
+         strcmp(estimates->commands[slot], command) != 0) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+// Records the runtime of a command, replacing any earlier runtime for it
+// Inputs: estimates - table to add to
+//         command - command, copied into the table
+//         runtime - runtime in milliseconds
+void add_runtime_estimate(struct RuntimeEstimates *estimates,
+                          const char *command, long runtime) {
+  // keep the table at most half full so probe sequences stay short
+  if (2 * (estimates->count + 1) > estimates->capacity) {
+    struct RuntimeEstimates grown = *estimates;
+    grown.capacity = estimates->capacity ? 2 * estimates->capacity : 64;
+    grown.commands = (char **)calloc(grown.capacity, sizeof(char *));
+    grown.runtimes = (long *)calloc(grown.capacity, sizeof(long));
+    for (size_t i = 0; i < estimates->capacity; i++) {
+      if (estimates->commands[i]) {
+        size_t slot = find_runtime_slot(&grown, estimates->commands[i]);
+        grown.commands[slot] = estimates->commands[i];
+        grown.runtimes[slot] = estimates->runtimes[i];
+      }
+    }
+    free((void *)estimates->commands);
+    free(estimates->runtimes);
+    *estimates = grown;
+  }
+
+  size_t slot = find_runtime_slot(estimates, command);
+  if (!estimates->commands[slot]) {
+    estimates->commands[slot] = strdup(command);
+    estimates->count++;
+  }
+  estimates->runtimes[slot] = runtime;
+  if (runtime > estimates->maxRuntime) {
+    estimates->maxRuntime = runtime;
+  }
+}
+
+// Reads the runtime of every command in a job log written by --joblog
+// Inputs: fileName - job log to read
+//         estimates - table to fill in
+// Exits with FILE_READ_ERROR_EXIT_NUM if the job log can't be read
+void read_runtime_estimates(const char *fileName,
+                            struct RuntimeEstimates *estimates) {
+  FILE *file = fopen(fileName, "r");
+  if (!file) {
+    fprintf(stderr, "uqparallel: Cannot open file \"%s\" for reading\n",
+            fileName);
+    exit(FILE_READ_ERROR_EXIT_NUM);
+  }
+
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t length;
+  while ((length = getline(&line, &size, file)) > 0) {
+    if (line[length - 1] == '\n') {
+      line[length - 1] = '\0';
+    }
+    // the command is the last field and may itself contain tabs
+    char *fields[JOBLOG_FIELDS];
+    int numFields = 0;
+    char *field = line;
+    while (numFields < JOBLOG_FIELDS - 1 && (field = strchr(field, '\t'))) {
+      *field++ = '\0';
+      fields[++numFields] = field;
+    }
+    fields[0] = line;
+    if (numFields != JOBLOG_FIELDS - 1 || strcmp(fields[0], "Seq") == 0) {
+      continue;
+    }
+    double runtime = strtod(fields[JOBLOG_RUNTIME_FIELD], NULL);
+    add_runtime_estimate(estimates, fields[JOBLOG_FIELDS - 1],
+                         (long)(runtime * MILLISECONDS_PER_SECOND));
+  }
+  free(line);
+  fclose(file);
+}
+
+// Fills in each task's estimated runtime from a previous job log. Tasks which
+// aren't in the log are assumed to be as long as the longest one that is.
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+//         pArgs - pointer to PArgs struct
+//         keys - array of keys to fill in, one per task
+void estimate_task_runtimes(const struct CLArgs *cmdLineArgs,
+                            struct PArgs *pArgs, long *keys) {
+  struct RuntimeEstimates estimates = {0};
+  read_runtime_estimates(cmdLineArgs->orderJobLog, &estimates);
+
+  for (int i = 0; i < pArgs->numArgs; i++) {
+    keys[i] = estimates.maxRuntime;
+    if (estimates.count == 0) {
+      continue;
+    }
+    load_compiled_task(pArgs, i);
+    char *command = task_command(pArgs, i);
+    unload_compiled_task(pArgs, i);
+    size_t slot = find_runtime_slot(&estimates, command);
+    if (estimates.commands[slot]) {
+      keys[i] = estimates.runtimes[slot];
+    }
+    free(command);
+  }
+
+  for (size_t i = 0; i < estimates.capacity; i++) {
+    free(estimates.commands[i]);
+  }
+  free((void *)estimates.commands);
+  free(estimates.runtimes);
+}
+
+// Works out the order tasks run in for --order. The order is a permutation of
+// task indices taken from a heap, so no task's arguments are moved.
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+//         pArgs - pointer to PArgs struct, whose order is set
+void order_tasks(const struct CLArgs *cmdLineArgs, struct PArgs *pArgs) {
+  if (cmdLineArgs->orderMode == ORDER_NONE) {
+    return;
+  }
+
+  long *keys = (long *)calloc(pArgs->numArgs, sizeof(long));
+  if (cmdLineArgs->orderMode == ORDER_PRIORITY && pArgs->priorities) {
+    memcpy(keys, pArgs->priorities, pArgs->numArgs * sizeof(long));
+  } else if (cmdLineArgs->orderMode == ORDER_LJF) {
+    estimate_task_runtimes(cmdLineArgs, pArgs, keys);
+  } else if (cmdLineArgs->orderMode == ORDER_SHUFFLE) {
+    uint64_t state = cmdLineArgs->orderSeed;
+    for (int i = 0; i < pArgs->numArgs; i++) {
+      keys[i] = (long)(splitmix64(&state) >> 1);
+    }
+  }
+
+  struct TaskHeap heap = {0};
+  heap.tasks = (int *)malloc(pArgs->numArgs * sizeof(int));
+  heap.keys = keys;
+  for (int i = 0; i < pArgs->numArgs; i++) {
+    task_heap_push(&heap, i);
+  }
+  pArgs->order = (int *)malloc(pArgs->numArgs * sizeof(int));
+  for (int i = 0; i < pArgs->numArgs; i++) {
+    pArgs->order[i] = task_heap_pop(&heap);
+  }
+
+  free(heap.tasks);
+  free(keys);
+}
+
+// Finds the slot of a task id in a table of task indices
+// Inputs: pArgs - pointer to PArgs struct with the task ids
+//         table - open addressing table of task indices, NO_TASK if empty
+//         capacity - size of table, a power of two with a free slot
+//         id - task id to look for
+// Returns: slot holding the task with this id, or the empty slot for it
+size_t find_task_id_slot(const struct PArgs *pArgs, const int *table,
+                         size_t capacity, const char *id) {
+  size_t slot = hash_bytes(id, strlen(id)) & (capacity - 1);
+  while (table[slot] != NO_TASK &&
+         strcmp(pArgs->taskIds[table[slot]], id) != 0) {
+    slot = (slot + 1) & (capacity - 1);
+  }
+  return slot;
+}
+
+// Exits because the task dependencies can't be run
+// Inputs: message - description of the problem, with a %s for the task id
+//         id - task id the problem is with
+void dependency_error(const char *message, const char *id) {
+  fprintf(stderr, "uqparallel: ");
+  fprintf(stderr, message, id);
+  fprintf(stderr, "\n");
+  exit(DEPENDENCY_ERROR_EXIT_NUM);
+}
+
+// Finds a task which is part of a dependency cycle, given the tasks Kahn's
+// algorithm couldn't order. Every such task has an unordered parent, so
+// following those parents for numArgs steps must end up inside a cycle.
+// Inputs: pArgs - pointer to PArgs struct
+//         parents - parent of each edge
+//         children - child of each edge
+//         numEdges - number of edges
+//         remaining - parents each task is still waiting for
+// Returns: index of a task in a cycle
+int find_cycle_task(const struct PArgs *pArgs, const int *parents,
+                    const int *children, long numEdges, const int *remaining) {
+  int *unorderedParent = (int *)malloc(pArgs->numArgs * sizeof(int));
+  int task = NO_TASK;
+  for (long e = 0; e < numEdges; e++) {
+    if (remaining[parents[e]] > 0) {
+      unorderedParent[children[e]] = parents[e];
+      task = children[e];
+    }
+  }
+  for (int step = 0; step < pArgs->numArgs; step++) {
+    task = unorderedParent[task];
+  }
+  free(unorderedParent);
+  return task;
+}
+
+// Checks the graph has no cycles with Kahn's algorithm
+// Inputs: pArgs - pointer to PArgs struct with its graph built
+//         parents - parent of each edge
+//         children - child of each edge
+//         numEdges - number of edges
+// Exits with DEPENDENCY_ERROR_EXIT_NUM if there is a cycle
+void check_task_graph_acyclic(const struct PArgs *pArgs, const int *parents,
+                              const int *children, long numEdges) {
+  const struct TaskGraph *graph = pArgs->graph;
+  int *remaining = (int *)malloc(pArgs->numArgs * sizeof(int));
+  int *queue = (int *)malloc(pArgs->numArgs * sizeof(int));
+  int head = 0;
+  int tail = 0;
+
+  memcpy(remaining, graph->numParents, pArgs->numArgs * sizeof(int));
+  for (int i = 0; i < pArgs->numArgs; i++) {
+    if (remaining[i] == 0) {
+      queue[tail++] = i;
+    }
+  }
+  while (head < tail) {
+    int task = queue[head++];
+    for (int e = graph->firstDependent[task];
+         e < graph->firstDependent[task + 1]; e++) {
+      if (--remaining[graph->dependents[e]] == 0) {
+        queue[tail++] = graph->dependents[e];
+      }
+    }
+  }
+
+  if (tail < pArgs->numArgs) {
+    int task = find_cycle_task(pArgs, parents, children, numEdges, remaining);
+    dependency_error("dependency cycle through task \"%s\"",
+                     pArgs->taskIds[task]);
+  }
+  free(remaining);
+  free(queue);
+}
+
+// Builds the dependency graph declared by @id= and @after= directives
+// Inputs: pArgs - pointer to PArgs struct, whose graph is set
+// Exits with DEPENDENCY_ERROR_EXIT_NUM if an id is repeated or unknown, or if
+// the dependencies form a cycle
+void build_task_graph(struct PArgs *pArgs) {
+  if (!pArgs->taskAfter) {
+    return;
+  }
+  int numTasks = pArgs->numArgs;
+
+  // index the task ids in a hash table kept at most half full
+  size_t capacity = TASK_ID_TABLE_MIN;
+  while (capacity < 2 * (size_t)numTasks) {
+    capacity *= 2;
+  }
+  int *idTable = (int *)malloc(capacity * sizeof(int));
+  for (size_t i = 0; i < capacity; i++) {
+    idTable[i] = NO_TASK;
+  }
+  for (int i = 0; pArgs->taskIds && i < numTasks; i++) {
+    if (!pArgs->taskIds[i]) {
+      continue;
+    }
+    size_t slot = find_task_id_slot(pArgs, idTable, capacity,
+                                    pArgs->taskIds[i]);
+    if (idTable[slot] != NO_TASK) {
+      dependency_error("task id \"%s\" is used more than once",
+                       pArgs->taskIds[i]);
+    }
+    idTable[slot] = i;
+  }
+
+  // collect every edge, then counting sort them by parent into CSR form
+  long numEdges = 0;
+  long edgeCapacity = numTasks;
+  int *parents = (int *)malloc(edgeCapacity * sizeof(int));
+  int *children = (int *)malloc(edgeCapacity * sizeof(int));
+  for (int i = 0; i < numTasks; i++) {
+    if (!pArgs->taskAfter[i]) {
+      continue;
+    }
+    char *list = strdup(pArgs->taskAfter[i]);
+    char *savePointer = NULL;
+    for (char *id = strtok_r(list, ",", &savePointer); id;
+         id = strtok_r(NULL, ",", &savePointer)) {
+      int parent = NO_TASK;
+      if (pArgs->taskIds) {
+        parent = idTable[find_task_id_slot(pArgs, idTable, capacity, id)];
+      }
+      if (parent == NO_TASK) {
+        dependency_error("unknown task id \"%s\"", id);
+      }
+      if (numEdges == edgeCapacity) {
+        edgeCapacity *= 2;
+        parents = (int *)realloc(parents, edgeCapacity * sizeof(int));
+        children = (int *)realloc(children, edgeCapacity * sizeof(int));
+      }
+      parents[numEdges] = parent;
+      children[numEdges++] = i;
+    }
+    free(list);
+  }
+  free(idTable);
+
+  struct TaskGraph *graph = calloc(1, sizeof(struct TaskGraph));
+  graph->firstDependent = (int *)calloc(numTasks + 1, sizeof(int));
+  graph->dependents = (int *)malloc((numEdges + 1) * sizeof(int));
+  graph->numParents = (int *)calloc(numTasks, sizeof(int));
+  for (long e = 0; e < numEdges; e++) {
+    graph->firstDependent[parents[e] + 1]++;
+    graph->numParents[children[e]]++;
+  }
+  for (int i = 0; i < numTasks; i++) {
+    graph->firstDependent[i + 1] += graph->firstDependent[i];
+  }
+  int *fill = (int *)malloc(numTasks * sizeof(int));
+  memcpy(fill, graph->firstDependent, numTasks * sizeof(int));
+  for (long e = 0; e < numEdges; e++) {
+    graph->dependents[fill[parents[e]]++] = children[e];
+  }
+  free(fill);
+  pArgs->graph = graph;
+
+  check_task_graph_acyclic(pArgs, parents, children, numEdges);
+  free(parents);
+  free(children);
+}
+
+// Opens the --joblog file and writes its heading
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+// Exits with FILE_WRITE_ERROR_EXIT_NUM if the file can't be opened
+void open_job_log(const struct CLArgs *cmdLineArgs) {
+  if (!cmdLineArgs->jobLogFile) {
+    return;
+  }
+  jobLog.file = fopen(cmdLineArgs->jobLogFile, "w");
+  if (!jobLog.file) {
+    fprintf(stderr, "uqparallel: Cannot open file \"%s\" for writing\n",
+            cmdLineArgs->jobLogFile);
+    exit(FILE_WRITE_ERROR_EXIT_NUM);
+  }
+  // each line is flushed as it is written so the log survives being killed
+  setvbuf(jobLog.file, NULL, _IOLBF, 0);
+  fputs(jobLogHeader, jobLog.file);
+  pthread_mutex_init(&jobLog.lock, NULL);
+}
+
+// Closes the --joblog file
+void close_job_log(void) {
+  if (!jobLog.file) {
+    return;
+  }
+  fclose(jobLog.file);
+  jobLog.file = NULL;
+  for (int i = 0; i < jobLog.capacity; i++) {
+    free(jobLog.running[i].command);
+  }
+  free(jobLog.running);
+  jobLog.running = NULL;
+  jobLog.capacity = 0;
+}
+
+// Records that a task has started for the job log
+// Inputs: pArgs - pointer to PArgs struct with the task loaded
+//         task - index of task
+//         pid - process running the task, or 0 if it runs on a --serve daemon
+void job_log_started(const struct PArgs *pArgs, int task, pid_t pid) {
+  if (!jobLog.file) {
+    return;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  char *command = task_command(pArgs, task);
+
+  pthread_mutex_lock(&jobLog.lock);
+  struct JobLogEntry *entry = NULL;
+  for (int i = 0; i < jobLog.capacity && !entry; i++) {
+    // a task handed back by a daemon which went away starts again
+    if (!jobLog.running[i].inUse ||
+        (pid <= 0 && jobLog.running[i].pid <= 0 &&
+         jobLog.running[i].task == task)) {
+      entry = &jobLog.running[i];
+    }
+  }
+  if (!entry) {
+    int oldCapacity = jobLog.capacity;
+    jobLog.capacity = oldCapacity ? 2 * oldCapacity : JOB_LIMIT_MAX;
+    jobLog.running = (struct JobLogEntry *)realloc(
+        jobLog.running, jobLog.capacity * sizeof(struct JobLogEntry));
+    memset(jobLog.running + oldCapacity, 0,
+           (jobLog.capacity - oldCapacity) * sizeof(struct JobLogEntry));
+    entry = &jobLog.running[oldCapacity];
+  }
+  free(entry->command);
+  entry->inUse = true;
+  entry->pid = pid;
+  entry->task = task;
+  entry->startTime = (double)now.tv_sec + (double)now.tv_nsec /
+                                              NANOSECONDS_PER_SECOND;
+  clock_gettime(CLOCK_MONOTONIC, &entry->started);
+  entry->command = command;
+  pthread_mutex_unlock(&jobLog.lock);
+}
+
+// Writes the job log line of a finished task
+// Inputs: pid - process which ran the task, or 0 if it ran on a daemon
+//         task - index of task, used when pid is 0
+//         exitStatus - exit status of the task
+//         signalNumber - signal which killed the task, or 0
+void job_log_finished(pid_t pid, int task, int exitStatus, int signalNumber) {
+  if (!jobLog.file) {
+    return;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock(&jobLog.lock);
+  for (int i = 0; i < jobLog.capacity; i++) {
+    struct JobLogEntry *entry = &jobLog.running[i];
+    if (!entry->inUse ||
+        (pid > 0 ? entry->pid != pid : entry->task != task)) {
+      continue;
+    }
+    double runtime =
+        (double)(now.tv_sec - entry->started.tv_sec) +
+        (double)(now.tv_nsec - entry->started.tv_nsec) / NANOSECONDS_PER_SECOND;
+    fprintf(jobLog.file, "%d\t:\t%.3f\t%.3f\t0\t0\t%d\t%d\t%s\n",
+            entry->task + 1, entry->startTime, runtime, exitStatus,
+            signalNumber, entry->command);
+    free(entry->command);
+    entry->command = NULL;
+    entry->inUse = false;
+    break;
+  }
+  pthread_mutex_unlock(&jobLog.lock);
+}
+
+// Builds the environment shared by all tasks from environ and the --env
+// templates. Variables set by --env are appended, or replace the inherited
+// value in place, when a task starts.
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+void build_task_environment(const struct CLArgs *cmdLineArgs) {
+  taskEnvironment.numBase = 0;
+  while (environ[taskEnvironment.numBase]) {
+    taskEnvironment.numBase++;
+  }
+  taskEnvironment.capacity = taskEnvironment.numBase +
+                             cmdLineArgs->numEnvTemplates + ENV_SPARE_SLOTS;
+  taskEnvironment.base =
+      (char **)malloc((taskEnvironment.capacity + 1) * sizeof(char *));
+  memcpy((void *)taskEnvironment.base, (void *)environ,
+         (taskEnvironment.numBase + 1) * sizeof(char *));
+  taskEnvironment.templates = cmdLineArgs->envTemplates;
+  taskEnvironment.numTemplates = cmdLineArgs->numEnvTemplates;
+  taskEnvironment.workdir = cmdLineArgs->workdirTemplate;
+  taskEnvironment.numPrefixArgs =
+      cmdLineArgs->commandPresent ? COMMAND + cmdLineArgs->numFixedArgs : 0;
+}
+
+// Frees the shared task environment
+void free_task_environment(void) {
+  free((void *)taskEnvironment.base);
+  memset(&taskEnvironment, 0, sizeof(taskEnvironment));
+}
+
+// Expands a --env or --workdir template for a task. {} becomes the task's
+// arguments after the command and fixed arguments, and {#} its number.
+// Inputs: pArgs - pointer to PArgs struct
+//         i - index of task
+//         template - template to expand
+// Returns: expanded string, caller must free
+char *expand_task_template(const struct PArgs *pArgs, int i,
+                           const char *template) {
+  int numArgs = 0;
+  while (pArgs->args[i] && pArgs->args[i][numArgs]) {
+    numArgs++;
+  }
+  int first = numArgs > taskEnvironment.numPrefixArgs
+                  ? taskEnvironment.numPrefixArgs
+                  : numArgs;
+  char *arguments =
+      create_string_from_array(pArgs->args[i] + first, numArgs - first);
+  char number[STATS_BUFFER_SIZE];
+  snprintf(number, sizeof(number), "%d", i + 1);
+
+  size_t capacity = strlen(template) + 1;
+  size_t length = 0;
+  char *expanded = malloc(capacity);
+  for (const char *position = template; *position;) {
+    const char *insert = NULL;
+    if (strncmp(position, "{}", 2) == 0) {
+      insert = arguments;
+      position += 2;
+    } else if (strncmp(position, "{#}", 3) == 0) {
+      insert = number;
+      position += 3;
+    }
+    size_t insertLength = insert ? strlen(insert) : 1;
+    if (length + insertLength + 1 > capacity) {
+      capacity = (length + insertLength + 1) * 2;
+      expanded = realloc(expanded, capacity);
+    }
+    if (insert) {
+      memcpy(expanded + length, insert, insertLength);
+    } else {
+      expanded[length] = *position++;
+    }
+    length += insertLength;
+  }
+  expanded[length] = '\0';
+  free(arguments);
+  return expanded;
+}
+
+// Sets a variable in an environment vector which has room for it
+// Inputs: env - NULL terminated environment, updated
+//         count - number of variables in env, updated
+//         variable - NAME=VALUE string to set
+void set_environment_variable(char **env, int *count, char *variable) {
+  size_t nameLength = (size_t)(strchr(variable, '=') - variable) + 1;
+  for (int i = 0; i < *count; i++) {
+    if (strncmp(env[i], variable, nameLength) == 0) {
+      env[i] = variable;
+      return;
+    }
+  }
+  env[(*count)++] = variable;
+  env[*count] = NULL;
+}
+
+// Applies a task's working directory in its child and builds the environment
+// to exec it with, with PWD naming the working directory if one was given.
+// Only the child's copy of the shared vector is changed.
+// Inputs: pArgs - pointer to PArgs struct
+//         i - index of task
+// Returns: environment for execvpe
+char **prepare_task_environment(const struct PArgs *pArgs, int i) {
+  char *workdir = pArgs->taskCwd ? pArgs->taskCwd[i] : NULL;
+  if (!workdir && taskEnvironment.workdir) {
+    workdir = expand_task_template(pArgs, i, taskEnvironment.workdir);
+  }
+  if (workdir && chdir(workdir) == -1) {
+    fprintf(stderr, "uqparallel: cannot change directory to \"%s\"\n",
+            workdir);
+    raise(SIGUSR1);
+    exit(SIGNAL_EXIT_NUM);
+  }
+  // shells and getcwd() users trust PWD, so it must not name our directory
+  char *pwd = NULL;
+  char *resolved = workdir ? getcwd(NULL, 0) : NULL;
+  if (resolved) {
+    pwd = (char *)malloc(strlen("PWD=") + strlen(resolved) + NULL_TERMINATOR);
+    sprintf(pwd, "PWD=%s", resolved);
+    free(resolved);
+  }
+
+  char **variables = pArgs->taskEnv ? pArgs->taskEnv[i] : NULL;
+  int numVariables = 0;
+  while (variables && variables[numVariables]) {
+    numVariables++;
+  }
+  int numExtra = numVariables + (pwd ? 1 : 0);
+  if (numExtra == 0 && taskEnvironment.numTemplates == 0) {
+    return environ;
+  }
+
+  // the shared vector only runs out of room for tasks with many @env=
+  char **env = taskEnvironment.base;
+  int count = taskEnvironment.numBase;
+  if (!env || count + taskEnvironment.numTemplates + numExtra >
+                  taskEnvironment.capacity) {
+    for (count = 0; environ[count]; count++) {
+    }
+    env = (char **)malloc((count + taskEnvironment.numTemplates + numExtra +
+                           NULL_TERMINATOR) *
+                          sizeof(char *));
+    memcpy((void *)env, (void *)environ, (count + 1) * sizeof(char *));
+  }
+  // --env and @env= can still set PWD themselves
+  if (pwd) {
+    set_environment_variable(env, &count, pwd);
+  }
+  for (int j = 0; j < taskEnvironment.numTemplates; j++) {
+    set_environment_variable(
+        env, &count,
+        expand_task_template(pArgs, i, taskEnvironment.templates[j]));
+  }
+  // a task's own variables win over --env
+  for (int j = 0; j < numVariables; j++) {
+    set_environment_variable(env, &count, variables[j]);
+  }
+  return env;
+}
+
+// Copies a file in the kernel, with copy_file_range() where the filesystems
+// allow it and sendfile() otherwise. A new copy gets the source's permissions,
+// less the umask, so staged scripts stay executable.
+// Inputs: from - path of the file to copy
+//         to - path of the copy, replaced if it exists
+// Returns: true if the whole file was copied
+bool copy_file(const char *from, const char *to) {
+  int in = open(from, O_RDONLY | O_CLOEXEC);
+  struct stat fromStat;
+  if (in < 0 || fstat(in, &fromStat) == -1) {
+    if (in >= 0) {
+      close(in);
+    }
+    return false;
+  }
+  int out = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                 fromStat.st_mode & FILE_PERMISSION_BITS);
+  bool ok = out >= 0;
+  bool useSendfile = false;
+  off_t left = fromStat.st_size;
+
+  while (ok && left > 0) {
+    ssize_t copied = -1;
+    if (!useSendfile) {
+      copied = copy_file_range(in, NULL, out, NULL, (size_t)left, 0);
+      // older kernels can't copy between filesystems or at all
+      if (copied < 0 && (errno == EXDEV || errno == ENOSYS ||
+                         errno == EINVAL || errno == EOPNOTSUPP)) {
+        useSendfile = true;
+      }
+    }
+    if (useSendfile) {
+      copied = sendfile(out, in, NULL, (size_t)left);
+    }
+    ok = copied > 0;
+    left -= ok ? copied : 0;
+  }
+
+  close(in);
+  if (out >= 0) {
+    close(out);
+  }
+  return ok;
+}
+
+// Moves a file, copying it if it is on another filesystem
+// Inputs: from - path of the file to move
+//         to - path to move it to
+// Returns: true if the file was moved
+bool move_file(const char *from, const char *to) {
+  if (rename(from, to) == 0) {
+    return true;
+  }
+  if (errno != EXDEV || !copy_file(from, to)) {
+    return false;
+  }
+  unlink(from);
+  return true;
+}
+
+// Returns the number of entries in a NULL terminated list
+// Inputs: list - list to count, may be NULL
+// Returns: number of entries
+int list_length(char **list) {
+  int length = 0;
+  while (list && list[length]) {
+    length++;
+  }
+  return length;
+}
+
+// Copies a task's inputs into its scratch directory and works out where its
+// staged inputs and outputs go. Called without the staging lock held.
+// Inputs: task - index of task
+// Returns: true if every input was copied
+bool stage_task(int task) {
+  struct PArgs *pArgs = staging.pArgs;
+  char **inputs = pArgs->stageIn ? pArgs->stageIn[task] : NULL;
+  char **outputs = pArgs->stageOut ? pArgs->stageOut[task] : NULL;
+  int numInputs = list_length(inputs);
+  int numFiles = numInputs + list_length(outputs);
+  if (numFiles == 0) {
+    return true;
+  }
+
+  char directory[PATH_MAX];
+  snprintf(directory, sizeof(directory), "%s/%d", staging.root, task + 1);
+  if (mkdir(directory, S_IRWXU) == -1 && errno != EEXIST) {
+    fprintf(stderr, "uqparallel: cannot stage into \"%s\"\n", directory);
+    return false;
+  }
+
+  // staged names keep the file's own name so tools which look at it still work
+  char **paths = (char **)calloc(numFiles + NULL_TERMINATOR, sizeof(char *));
+  bool ok = true;
+  for (int k = 0; k < numFiles; k++) {
+    const char *original = k < numInputs ? inputs[k] : outputs[k - numInputs];
+    const char *name = strrchr(original, '/');
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%d/%d-%s", staging.root, task + 1, k,
+             name ? name + 1 : original);
+    paths[k] = strdup(path);
+    if (k < numInputs && ok && !copy_file(original, paths[k])) {
+      fprintf(stderr, "uqparallel: cannot stage \"%s\"\n", original);
+      ok = false;
+    }
+  }
+
+  pthread_mutex_lock(&staging.lock);
+  staging.stagedPaths[task] = paths;
+  pthread_mutex_unlock(&staging.lock);
+  return ok;
+}
+
+// Moves a finished task's outputs to where they were asked for and removes
+// its scratch directory
+// Inputs: task - index of task
+void collect_task(int task) {
+  struct PArgs *pArgs = staging.pArgs;
+  char **outputs = pArgs->stageOut ? pArgs->stageOut[task] : NULL;
+  int numInputs = list_length(pArgs->stageIn ? pArgs->stageIn[task] : NULL);
+
+  pthread_mutex_lock(&staging.lock);
+  char **paths = staging.stagedPaths[task];
+  staging.stagedPaths[task] = NULL;
+  pthread_mutex_unlock(&staging.lock);
+  if (!paths) {
+    return;
+  }
+
+  for (int k = 0; paths[k]; k++) {
+    // outputs the task didn't write are left alone
+    if (k >= numInputs && access(paths[k], F_OK) == 0 &&
+        !move_file(paths[k], outputs[k - numInputs])) {
+      fprintf(stderr, "uqparallel: cannot collect \"%s\"\n",
+              outputs[k - numInputs]);
+    }
+    unlink(paths[k]);
+    free(paths[k]);
+  }
+  free((void *)paths);
+
+  char directory[PATH_MAX];
+  snprintf(directory, sizeof(directory), "%s/%d", staging.root, task + 1);
+  rmdir(directory);
+}
+
+// Main loop of the stager thread. Collecting finished tasks comes first as it
+// frees scratch space, then inputs are staged for tasks up to --stage-ahead
+// places past the last one started.
+// Inputs: arg - unused
+// Returns: NULL
+void *stager_thread(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&staging.lock);
+  while (true) {
+    if (staging.numFinished > 0) {
+      int task = staging.finished[--staging.numFinished];
+      pthread_mutex_unlock(&staging.lock);
+      collect_task(task);
+      pthread_mutex_lock(&staging.lock);
+      continue;
+    }
+    if (staging.stopping) {
+      break;
+    }
+    if (staging.nextPosition < staging.pArgs->numArgs &&
+        staging.nextPosition < staging.numStarted + staging.ahead) {
+      int task = task_at(staging.pArgs, staging.nextPosition++);
+      if (staging.states[task] != STAGE_PENDING) {
+        continue;
+      }
+      staging.states[task] = STAGE_BUSY;
+      pthread_mutex_unlock(&staging.lock);
+      bool ok = stage_task(task);
+      pthread_mutex_lock(&staging.lock);
+      staging.states[task] = ok ? STAGE_READY : STAGE_FAILED;
+      pthread_cond_broadcast(&staging.changed);
+      continue;
+    }
+    pthread_cond_wait(&staging.changed, &staging.lock);
+  }
+  pthread_mutex_unlock(&staging.lock);
+  return NULL;
+}
+
+// Starts staging if any task has @stage-in= or @stage-out= directives
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+//         pArgs - pointer to PArgs struct
+void start_staging(const struct CLArgs *cmdLineArgs, struct PArgs *pArgs) {
+  if (!pArgs->stageIn && !pArgs->stageOut) {
+    return;
+  }
+  const char *parent = cmdLineArgs->stageDir;
+  if (!parent) {
+    parent = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  }
+  char root[PATH_MAX];
+  snprintf(root, sizeof(root), "%s/uqparallel-XXXXXX", parent);
+  if (!mkdtemp(root)) {
+    fprintf(stderr, "uqparallel: cannot write to \"%s\"\n", parent);
+    exit(FILE_WRITE_ERROR_EXIT_NUM);
+  }
+
+  staging.enabled = true;
+  staging.pArgs = pArgs;
+  staging.root = strdup(root);
+  staging.ahead = cmdLineArgs->stageAhead;
+  staging.states = (int *)calloc(pArgs->numArgs, sizeof(int));
+  staging.stagedPaths = (char ***)calloc(pArgs->numArgs, sizeof(char **));
+  staging.finished = (int *)malloc(pArgs->numArgs * sizeof(int));
+  pthread_mutex_init(&staging.lock, NULL);
+  pthread_cond_init(&staging.changed, NULL);
+  pthread_create(&staging.thread, NULL, stager_thread, NULL);
+}
+
+// Waits until a task's inputs are staged, staging them now if the stager
+// hasn't got to them, which happens when tasks start out of order
+// Inputs: task - index of task about to start
+// Returns: true if the task can run
+bool stage_wait(int task) {
+  if (!staging.enabled) {
+    return true;
+  }
+  pthread_mutex_lock(&staging.lock);
+  staging.numStarted++;
+  pthread_cond_broadcast(&staging.changed);
+  if (staging.states[task] == STAGE_PENDING) {
+    staging.states[task] = STAGE_BUSY;
+    pthread_mutex_unlock(&staging.lock);
+    bool ok = stage_task(task);
+    pthread_mutex_lock(&staging.lock);
+    staging.states[task] = ok ? STAGE_READY : STAGE_FAILED;
+    pthread_cond_broadcast(&staging.changed);
+  }
+  while (staging.states[task] == STAGE_BUSY) {
+    pthread_cond_wait(&staging.changed, &staging.lock);
+  }
+  bool ready = staging.states[task] == STAGE_READY;
+  pthread_mutex_unlock(&staging.lock);
+  return ready;
+}
+
+// Points a task's arguments which name staged files at the staged copies.
+// Only called in the task's child.
+// Inputs: pArgs - pointer to PArgs struct
+//         task - index of task
+//         staged - false if staging failed, in which case the child exits
+void stage_enter(struct PArgs *pArgs, int task, bool staged) {
+  if (!staging.enabled) {
+    return;
+  }
+  if (!staged) {
+    raise(SIGUSR1);
+    exit(SIGNAL_EXIT_NUM);
+  }
+  char **paths = staging.stagedPaths[task];
+  char **inputs = pArgs->stageIn ? pArgs->stageIn[task] : NULL;
+  char **outputs = pArgs->stageOut ? pArgs->stageOut[task] : NULL;
+  int numInputs = list_length(inputs);
+  for (int j = 0; paths && pArgs->args[task][j]; j++) {
+    for (int k = 0; paths[k]; k++) {
+      const char *original =
+          k < numInputs ? inputs[k] : outputs[k - numInputs];
+      if (strcmp(pArgs->args[task][j], original) == 0) {
+        pArgs->args[task][j] = paths[k];
+        break;
+      }
+    }
+  }
+}
+
+// Records which task a child with staged files is running
+// Inputs: task - index of task
+//         pid - pid of the child
+void stage_task_started(int task, pid_t pid) {
+  if (!staging.enabled || pid <= 0) {
+    return;
+  }
+  pthread_mutex_lock(&staging.lock);
+  for (int i = 0; i < JOB_LIMIT_MAX; i++) {
+    if (staging.running[i].pid == 0) {
+      staging.running[i].pid = pid;
+      staging.running[i].task = task;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&staging.lock);
+}
+
+// Collects the outputs of a reaped child. The stager thread does this in the
+// background, except when other tasks may depend on the outputs.
+// Inputs: pid - pid of the child
+void stage_task_finished(pid_t pid) {
+  if (!staging.enabled) {
+    return;
+  }
+  int task = NO_TASK;
+  pthread_mutex_lock(&staging.lock);
+  for (int i = 0; i < JOB_LIMIT_MAX; i++) {
+    if (staging.running[i].pid == pid) {
+      staging.running[i].pid = 0;
+      task = staging.running[i].task;
+      break;
+    }
+  }
+  if (task != NO_TASK && !staging.pArgs->graph) {
+    staging.finished[staging.numFinished++] = task;
+    pthread_cond_broadcast(&staging.changed);
+  }
+  pthread_mutex_unlock(&staging.lock);
+  if (task != NO_TASK && staging.pArgs->graph) {
+    collect_task(task);
+  }
+}
+
+// Waits for the stager to collect every finished task, then removes the
+// scratch directory along with anything staged for tasks which never ran
+void stop_staging(void) {
+  if (!staging.enabled) {
+    return;
+  }
+  pthread_mutex_lock(&staging.lock);
+  staging.stopping = true;
+  pthread_cond_broadcast(&staging.changed);
+  pthread_mutex_unlock(&staging.lock);
+  pthread_join(staging.thread, NULL);
+
+  for (int i = 0; i < staging.pArgs->numArgs; i++) {
+    collect_task(i);
+  }
+  rmdir(staging.root);
+  pthread_mutex_destroy(&staging.lock);
+  pthread_cond_destroy(&staging.changed);
+  free(staging.root);
+  free(staging.states);
+  free((void *)staging.stagedPaths);
+  free(staging.finished);
+  memset(&staging, 0, sizeof(staging));
+}
+
+// Searches $PATH for a command the same way execvp() does
+// Inputs: name - command name without a slash
+// Returns: absolute path of the command, which the caller must free, or NULL
+//          if it wasn't found before the end of $PATH or a relative entry
+char *search_command_path(const char *name) {
+  const char *searchPath = getenv("PATH");
+  if (!searchPath) {
+    return NULL;
+  }
+  size_t nameLength = strlen(name);
+  const char *entry = searchPath;
+  while (true) {
+    const char *end = strchrnul(entry, ':');
+    // an empty or relative entry depends on each task's working directory
+    if (end == entry || *entry != '/') {
+      return NULL;
+    }
+    size_t entryLength = (size_t)(end - entry);
+    char *candidate = malloc(entryLength + 1 + nameLength + NULL_TERMINATOR);
+    memcpy(candidate, entry, entryLength);
+    candidate[entryLength] = '/';
+    memcpy(candidate + entryLength + 1, name, nameLength + NULL_TERMINATOR);
+    struct stat info;
+    if (stat(candidate, &info) == 0 && S_ISREG(info.st_mode) &&
+        access(candidate, X_OK) == 0) {
+      return candidate;
+    }
+    free(candidate);
+    if (*end == '\0') {
+      return NULL;
+    }
+    entry = end + 1;
+  }
+}
+
+// Finds the slot of a command name in the table of command paths
+// Inputs: name - command name to look for
+// Returns: slot holding the name, or the empty slot where it belongs
+size_t find_command_slot(const char *name) {
+  size_t mask = commandPaths.capacity - 1;
+  size_t slot = hash_bytes(name, strlen(name)) & mask;
+  while (commandPaths.names[slot] &&
+         strcmp(commandPaths.names[slot], name) != 0) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+// Looks up where a command is, searching $PATH only the first time each name
+// is seen. Called in the parent before forking, so a child execs the path
+// without its own search.
+// Inputs: name - command name, or NULL
+// Returns: absolute path of the command, or NULL to leave the search to
+//          execvpe()
+const char *resolve_command(const char *name) {
+  if (!name || name[0] == '\0' || strchr(name, '/')) {
+    return NULL;
+  }
+  pthread_mutex_lock(&commandPaths.lock);
+  // keep the table at most half full so probe sequences stay short
+  if (2 * (commandPaths.count + 1) > commandPaths.capacity) {
+    struct CommandPaths old = commandPaths;
+    commandPaths.capacity =
+        old.capacity ? 2 * old.capacity : COMMAND_PATHS_MIN;
+    commandPaths.names = (char **)calloc(commandPaths.capacity, sizeof(char *));
+    commandPaths.paths = (char **)calloc(commandPaths.capacity, sizeof(char *));
+    for (size_t i = 0; i < old.capacity; i++) {
+      if (old.names[i]) {
+        size_t slot = find_command_slot(old.names[i]);
+        commandPaths.names[slot] = old.names[i];
+        commandPaths.paths[slot] = old.paths[i];
+      }
+    }
+    free((void *)old.names);
+    free((void *)old.paths);
+  }
+
+  size_t slot = find_command_slot(name);
+  if (!commandPaths.names[slot]) {
+    commandPaths.names[slot] = strdup(name);
+    commandPaths.paths[slot] = search_command_path(name);
+    commandPaths.count++;
+  }
+  const char *path = commandPaths.paths[slot];
+  pthread_mutex_unlock(&commandPaths.lock);
+  return path;
+}
+
+// Returns true if --env or a task's @env= gives it its own $PATH
+// Inputs: pArgs - pointer to PArgs struct with the task loaded
+//         i - index of task
+// Returns: true if the task's command must be searched for in its own $PATH
+bool task_sets_path(const struct PArgs *pArgs, int i) {
+  for (int j = 0; j < taskEnvironment.numTemplates; j++) {
+    if (strncmp(taskEnvironment.templates[j], "PATH=", strlen("PATH=")) ==
+        0) {
+      return true;
+    }
+  }
+  char **variables = pArgs->taskEnv ? pArgs->taskEnv[i] : NULL;
+  for (int j = 0; variables && variables[j]; j++) {
+    if (strncmp(variables[j], "PATH=", strlen("PATH=")) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns the path to exec a task's command with. Tasks with their own $PATH
+// aren't looked up in ours.
+// Inputs: pArgs - pointer to PArgs struct with the task loaded
+//         i - index of task
+// Returns: path from resolve_command(), or NULL
+const char *task_command_path(const struct PArgs *pArgs, int i) {
+  if (!pArgs->args[i] || task_sets_path(pArgs, i)) {
+    return NULL;
+  }
+  return resolve_command(pArgs->args[i][0]);
+}
+
+// Replaces the process with a task's command, using its resolved path if it
+// has one. execvpe() runs anything execve() can't, such as a script without a
+// #! line or a command removed since it was found.
+// Inputs: path - path from resolve_command(), or NULL
+//         args - NULL terminated arguments, starting with the command
+//         env - environment to run the command with
+// Returns only if the command couldn't be run
+void exec_command(const char *path, char **args, char **env) {
+  if (path) {
+    execve(path, args, env);
+  }
+  // execvpe() searches the caller's $PATH, so make the task's environment ours
+  environ = env;
+  execvpe(args[0], args, env);
+}
+
+// Executes a single child process for a pipe
+// Inputs: pArgs - pointer to PArgs struct
 //         i - child index
 //         numChildren - total number of children
 //         pipes - pipe file descriptor array
+//         inputFd - descriptor to use as stdin, or -1 to keep ours
+//         outputFd - descriptor to use as stdout, or -1 to keep ours
+//         path - path of the command from resolve_command(), or NULL
 void exec_pipe_child(struct PArgs *pArgs, int i, int numChildren,
-                     int pipes[][2]) {
-  // if child isn't first, read last childs STDIN
-  if (i > 0) {
-    dup2(pipes[i - 1][0], STDIN_FILENO);
+                     int pipes[][2], int inputFd, int outputFd,
+                     const char *path) {
+  // read the previous stage's output, or our share of it
+  if (inputFd >= 0) {
+    dup2(inputFd, STDIN_FILENO);
+  }
+  // write where the next child reads, or to a collector
+  if (outputFd >= 0) {
+    dup2(outputFd, STDOUT_FILENO);
+  }
+
+  for (int j = 0; j < numChildren - 1; j++) {
+    close(pipes[j][0]);
+    close(pipes[j][1]);
+  }
+  // distributors ignore SIGPIPE in the parent, stages shouldn't
+  signal(SIGPIPE, SIG_DFL);
+
+  if (!pArgs->args[i] || !pArgs->args[i][0]) {
+    fprintf(stderr, "uqparallel: unable to execute empty command\n");
+    exit(EMPTY_COMMAND_EXIT_NUM);
+  }
+
+  char **env = prepare_task_environment(pArgs, i);
+  exec_command(path, pArgs->args[i], env);
+  fprintf(stderr, "uqparallel: cannot execute \"%s\"\n", pArgs->args[i][0]);
+  raise(SIGUSR1);
+  exit(SIGNAL_EXIT_NUM);
+}
+
+// Writes all of a buffer to a file descriptor
+// Inputs: fd - file descriptor to write to
+//         data - data to write
+//         length - number of bytes to write
+// Returns: true if everything was written
+bool write_all(int fd, const void *data, size_t length) {
+  const char *position = data;
+  while (length > 0) {
+    ssize_t written = write(fd, position, length);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    position += written;
+    length -= written;
+  }
+  return true;
+}
+
+// Sends all of a buffer on a socket. A peer which has gone away is reported
+// as an error instead of raising SIGPIPE, which tasks would otherwise need
+// ignored for them.
+// Inputs: fd - socket to send on
+//         data - data to send
+//         length - number of bytes to send
+// Returns: true if everything was sent
+bool send_all(int fd, const void *data, size_t length) {
+  const char *position = data;
+  while (length > 0) {
+    ssize_t sent = send(fd, position, length, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent <= 0) {
+      return false;
+    }
+    position += sent;
+    length -= sent;
+  }
+  return true;
+}
+
+// Writes all of a buffer to a file descriptor which may be a pipe, with
+// SIGPIPE blocked in the calling thread so a closed reader only fails the
+// write. The SIGPIPE the write raised is discarded before unblocking it.
+// Inputs: fd - file descriptor to write to
+//         data - data to write
+//         length - number of bytes to write
+// Returns: true if everything was written
+bool write_all_nosigpipe(int fd, const void *data, size_t length) {
+  sigset_t pipeSignal;
+  sigset_t oldMask;
+  sigemptyset(&pipeSignal);
+  sigaddset(&pipeSignal, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &pipeSignal, &oldMask);
+  bool written = write_all(fd, data, length);
+  if (!written && errno == EPIPE) {
+    struct timespec noWait = {0};
+    sigtimedwait(&pipeSignal, NULL, &noWait);
+  }
+  pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+  return written;
+}
+
+// Moves bytes from one pipe to another without copying them
+// Inputs: from - pipe to read from
+//         to - pipe to write to
+//         length - number of bytes to move, which must be in from
+// Returns: false if the bytes couldn't be written
+bool splice_all(int from, int to, size_t length) {
+  while (length > 0) {
+    ssize_t moved = splice(from, NULL, to, NULL, length, SPLICE_F_MOVE);
+    if (moved < 0 && errno == EINTR) {
+      continue;
+    }
+    if (moved <= 0) {
+      return false;
+    }
+    length -= (size_t)moved;
+  }
+  return true;
+}
+
+// Reads exactly length bytes, which must already be in the pipe
+// Inputs: fd - pipe to read from
+//         buffer - buffer to read into
+//         length - number of bytes to read
+// Returns: false if the bytes couldn't be read
+bool read_all(int fd, char *buffer, size_t length) {
+  while (length > 0) {
+    ssize_t numRead = read(fd, buffer, length);
+    if (numRead < 0 && errno == EINTR) {
+      continue;
+    }
+    if (numRead <= 0) {
+      return false;
+    }
+    buffer += numRead;
+    length -= (size_t)numRead;
+  }
+  return true;
+}
+
+// Copies every chunk of the source to all targets. tee only copies the first
+// target's data, so the rest go through a chain of hop pipes, each teed to a
+// target and spliced on to the next hop, ending with a splice to the last.
+// Inputs: distributor - distributor to run
+void distribute_tee(struct Distributor *distributor) {
+  int numTargets = distributor->numTargets;
+  int numHops = numTargets > 2 ? numTargets - 2 : 0;
+  int hops[numHops > 0 ? numHops : 1][2];
+  for (int k = 0; k < numHops; k++) {
+    if (pipe2(hops[k], O_CLOEXEC) == -1) {
+      numHops = k;
+      numTargets = k + 2;
+    }
+  }
+
+  bool ok = true;
+  while (ok) {
+    ssize_t length =
+        tee(distributor->source, distributor->targets[0], SPLICE_CHUNK, 0);
+    if (length <= 0) {
+      break;
+    }
+    int next = numHops > 0 ? hops[0][1] : distributor->targets[1];
+    ok = splice_all(distributor->source, next, (size_t)length);
+
+    // hop k holds exactly this chunk, which goes to target k + 1
+    for (int k = 0; ok && k < numHops; k++) {
+      next = k + 1 < numHops ? hops[k + 1][1]
+                             : distributor->targets[numTargets - 1];
+      size_t left = (size_t)length;
+      while (ok && left > 0) {
+        ssize_t copied =
+            tee(hops[k][0], distributor->targets[k + 1], left, 0);
+        ok = copied > 0 && splice_all(hops[k][0], next, (size_t)copied);
+        left -= ok ? (size_t)copied : 0;
+      }
+    }
+  }
+
+  for (int k = 0; k < numHops; k++) {
+    close(hops[k][0]);
+    close(hops[k][1]);
+  }
+}
+
+// Sends lines to targets either in turn, one line each, or by the hash of each
+// line. Each chunk is teed into a peek pipe and read to find the line
+// boundaries, then spliced from the source to the targets. A line split
+// across chunks goes to one target: in turn mode the next target only gets a
+// line once the current one has ended, and in hash mode the line is held back
+// until it is complete.
+// Inputs: distributor - distributor to run
+void distribute_lines(struct Distributor *distributor) {
+  int peek[2];
+  if (pipe2(peek, O_CLOEXEC) == -1) {
+    return;
+  }
+  char *chunk = malloc(SPLICE_CHUNK);
+  char *carry = NULL;
+  size_t carryLength = 0;
+  int current = 0;
+  bool ok = true;
+
+  while (ok) {
+    ssize_t length = tee(distributor->source, peek[1], SPLICE_CHUNK, 0);
+    if (length <= 0 || !read_all(peek[0], chunk, (size_t)length)) {
+      break;
+    }
+    size_t position = 0;
+    size_t size = (size_t)length;
+
+    if (distributor->mode == SPLIT_RR) {
+      while (ok && position < size) {
+        char *newline = memchr(chunk + position, '\n', size - position);
+        size_t lineEnd = newline ? (size_t)(newline - chunk) + 1 : size;
+        ok = splice_all(distributor->source, distributor->targets[current],
+                        lineEnd - position);
+        position = lineEnd;
+        if (newline) {
+          current = (current + 1) % distributor->numTargets;
+        }
+      }
+      continue;
+    }
+
+    while (ok && position < size) {
+      char *newline = memchr(chunk + position, '\n', size - position);
+      size_t lineEnd = newline ? (size_t)(newline - chunk) + 1 : size;
+      if (carryLength > 0 || !newline) {
+        // lines crossing chunks are gathered in the carry buffer
+        carry = realloc(carry, carryLength + lineEnd - position);
+        ok = read_all(distributor->source, carry + carryLength,
+                      lineEnd - position);
+        carryLength += lineEnd - position;
+        position = lineEnd;
+        if (ok && newline) {
+          int target = (int)(hash_bytes(carry, carryLength - 1) %
+                             (uint64_t)distributor->numTargets);
+          ok = write_all(distributor->targets[target], carry, carryLength);
+          carryLength = 0;
+        }
+        continue;
+      }
+
+      // splice runs of complete lines which go to the same target at once
+      int target = (int)(hash_bytes(chunk + position, lineEnd - position - 1) %
+                         (uint64_t)distributor->numTargets);
+      size_t runStart = position;
+      position = lineEnd;
+      while (position < size) {
+        newline = memchr(chunk + position, '\n', size - position);
+        if (!newline) {
+          break;
+        }
+        lineEnd = (size_t)(newline - chunk) + 1;
+        if ((int)(hash_bytes(chunk + position, lineEnd - position - 1) %
+                  (uint64_t)distributor->numTargets) != target) {
+          break;
+        }
+        position = lineEnd;
+      }
+      ok = splice_all(distributor->source, distributor->targets[target],
+                      position - runStart);
+    }
+  }
+
+  // a last line without a newline still goes to its target
+  if (ok && carryLength > 0) {
+    write_all(distributor->targets[hash_bytes(carry, carryLength) %
+                                   (uint64_t)distributor->numTargets],
+              carry, carryLength);
+  }
+  close(peek[0]);
+  close(peek[1]);
+  free(chunk);
+  free(carry);
+}
+
+// Keeps a distributor's feed pipe filled from a source which isn't a pipe.
+// Runs detached, since a source such as a socket may block after the
+// distributor has stopped reading, and it only ever reads stdin, which stays
+// open.
+// Inputs: arg - pointer to the feed pipe, freed here
+// Returns: NULL
+void *feeder_thread(void *arg) {
+  int *feed = (int *)arg;
+  while (true) {
+    ssize_t moved = splice(feed[0], NULL, feed[1], NULL, SPLICE_CHUNK, 0);
+    if (moved < 0 && errno == EINTR) {
+      continue;
+    }
+    if (moved <= 0) {
+      break;
+    }
+  }
+  close(feed[1]);
+  free(feed);
+  return NULL;
+}
+
+// Main loop of a distributor thread. Closing the targets when the source
+// ends gives each replica EOF.
+// Inputs: arg - pointer to the Distributor struct
+// Returns: NULL
+void *distributor_thread(void *arg) {
+  struct Distributor *distributor = (struct Distributor *)arg;
+
+  // tee and splice need a pipe, so anything else is moved into one first by
+  // a thread. The feeder gets the raw source and the pipe's write end.
+  struct stat sourceStat;
+  int feed[2] = {-1, -1};
+  int rawSource = distributor->source;
+  pthread_t feeder;
+  if (fstat(rawSource, &sourceStat) == 0 && !S_ISFIFO(sourceStat.st_mode) &&
+      pipe2(feed, O_CLOEXEC) == 0) {
+    int *feederFds = (int *)malloc(2 * sizeof(int));
+    feederFds[0] = rawSource;
+    feederFds[1] = feed[1];
+    if (pthread_create(&feeder, NULL, feeder_thread, feederFds) == 0) {
+      pthread_detach(feeder);
+      distributor->source = feed[0];
+    } else {
+      close(feed[0]);
+      close(feed[1]);
+      free(feederFds);
+      feed[0] = -1;
+    }
+  }
+
+  if (distributor->mode == SPLIT_TEE && distributor->numTargets > 1) {
+    distribute_tee(distributor);
+  } else {
+    distribute_lines(distributor);
+  }
+
+  if (feed[0] >= 0) {
+    close(feed[0]);
+  }
+  // the previous stage gets SIGPIPE if the replicas stop reading early
+  if (rawSource != STDIN_FILENO) {
+    close(rawSource);
+  }
+  for (int k = 0; k < distributor->numTargets; k++) {
+    close(distributor->targets[k]);
+  }
+  return NULL;
+}
+
+// Main loop of a collector thread. Whole lines are written as soon as they
+// are read, and what is left of a line waits in that source's buffer.
+// Inputs: arg - pointer to the Collector struct
+// Returns: NULL
+void *collector_thread(void *arg) {
+  struct Collector *collector = (struct Collector *)arg;
+  int numSources = collector->numSources;
+  struct pollfd *fds = calloc(numSources, sizeof(struct pollfd));
+  char **buffers = (char **)calloc(numSources, sizeof(char *));
+  size_t *lengths = calloc(numSources, sizeof(size_t));
+  size_t *capacities = calloc(numSources, sizeof(size_t));
+  for (int k = 0; k < numSources; k++) {
+    fds[k].fd = collector->sources[k];
+    fds[k].events = POLLIN;
+  }
+
+  int open = numSources;
+  bool ok = true;
+  while (open > 0) {
+    if (poll(fds, numSources, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    for (int k = 0; k < numSources; k++) {
+      if (fds[k].fd < 0 || !fds[k].revents) {
+        continue;
+      }
+      if (capacities[k] - lengths[k] < SPLICE_CHUNK) {
+        capacities[k] = lengths[k] + SPLICE_CHUNK;
+        buffers[k] = realloc(buffers[k], capacities[k]);
+      }
+      ssize_t numRead =
+          read(fds[k].fd, buffers[k] + lengths[k], capacities[k] - lengths[k]);
+      if (numRead < 0 && errno == EINTR) {
+        continue;
+      }
+      if (numRead <= 0) {
+        // a last line without a newline is still passed on
+        ok = ok && write_all(collector->target, buffers[k], lengths[k]);
+        close(fds[k].fd);
+        fds[k].fd = -1;
+        open--;
+        continue;
+      }
+      lengths[k] += (size_t)numRead;
+
+      size_t complete = lengths[k];
+      while (complete > 0 && buffers[k][complete - 1] != '\n') {
+        complete--;
+      }
+      if (complete > 0) {
+        ok = ok && write_all(collector->target, buffers[k], complete);
+        memmove(buffers[k], buffers[k] + complete, lengths[k] - complete);
+        lengths[k] -= complete;
+      }
+    }
+  }
+
+  // the next stage sees EOF once every replica has finished
+  if (collector->target != STDOUT_FILENO) {
+    close(collector->target);
+  }
+  for (int k = 0; k < numSources; k++) {
+    free(buffers[k]);
+  }
+  free(fds);
+  free((void *)buffers);
+  free(lengths);
+  free(capacities);
+  return NULL;
+}
+
+// Exits because --isolate couldn't set up or join a namespace
+// Inputs: what - the step which failed, errno is reported with it
+void isolation_error(const char *what) {
+  fprintf(stderr, "uqparallel: cannot isolate tasks: %s: %s\n", what,
+          strerror(errno));
+  exit(ISOLATION_ERROR_EXIT_NUM);
+}
+
+// Writes a short string to a /proc file
+// Inputs: path - file to write
+//         contents - string to write
+// Returns: true if it was written
+bool write_proc_file(const char *path, const char *contents) {
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = write_all(fd, contents, strlen(contents));
+  close(fd);
+  return ok;
+}
+
+// Moves this process into a new user namespace where it keeps its own uid
+// and gid, so it can make the other namespaces without being root. Has to be
+// done before any threads are started.
+void enter_user_namespace(void) {
+  char map[STATS_BUFFER_SIZE];
+  uid_t uid = geteuid();
+  gid_t gid = getegid();
+
+  if (unshare(CLONE_NEWUSER) == -1) {
+    isolation_error("user namespace");
+  }
+  snprintf(map, sizeof(map), "%d %d 1\n", (int)uid, (int)uid);
+  if (!write_proc_file("/proc/self/uid_map", map)) {
+    isolation_error("uid_map");
+  }
+  // gid_map can only be written by an unprivileged user after this
+  write_proc_file("/proc/self/setgroups", "deny");
+  snprintf(map, sizeof(map), "%d %d 1\n", (int)gid, (int)gid);
+  if (!write_proc_file("/proc/self/gid_map", map)) {
+    isolation_error("gid_map");
+  }
+}
+
+// Brings up the loopback interface of the current network namespace
+// Returns: true on success
+bool loopback_up(void) {
+  int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  struct ifreq request;
+  memset(&request, 0, sizeof(request));
+  strcpy(request.ifr_name, "lo");
+  bool ok = sock >= 0 && ioctl(sock, SIOCGIFFLAGS, &request) == 0;
+  request.ifr_flags |= IFF_UP;
+  ok = ok && ioctl(sock, SIOCSIFFLAGS, &request) == 0;
+  if (sock >= 0) {
+    close(sock);
+  }
+  return ok;
+}
+
+// Handler which lets the init of a slot wake up for orphans to reap
+// Inputs: signal - signal number, unused
+void isolation_wake(int signal) {
+  (void)signal;
+}
+
+// Main loop of the init of a slot's PID namespace. Jobs are our children,
+// so it only reaps processes they leave behind.
+void isolation_init_loop(void) {
+  sigset_t childMask;
+  sigset_t emptyMask;
+  sigemptyset(&childMask);
+  sigaddset(&childMask, SIGCHLD);
+  sigemptyset(&emptyMask);
+  sigprocmask(SIG_BLOCK, &childMask, NULL);
+  signal(SIGCHLD, isolation_wake);
+
+  while (true) {
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
+    }
+    sigsuspend(&emptyMask);
+  }
+}
+
+// Sets up the namespaces of a slot from inside its holder process: a private
+// copy of the mounts with the working directory optionally read-only, a
+// network namespace with only loopback, and an init with its own /proc
+// Returns: true once the slot is ready
+bool isolation_holder_setup(void) {
+  if (unshare(CLONE_NEWNS | CLONE_NEWNET | CLONE_NEWPID) == -1 ||
+      mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) == -1 ||
+      !loopback_up()) {
+    return false;
+  }
+  if (isolation.readOnly) {
+    // a remount has to keep the flags which are locked on the original mount
+    struct statvfs workdirStat;
+    if (statvfs(isolation.workdir, &workdirStat) == -1 ||
+        mount(isolation.workdir, isolation.workdir, NULL, MS_BIND | MS_REC,
+              NULL) == -1) {
+      return false;
+    }
+    unsigned long locked =
+        workdirStat.f_flag & (MS_NOSUID | MS_NODEV | MS_NOEXEC);
+    if (mount(NULL, isolation.workdir, NULL,
+              MS_BIND | MS_REMOUNT | MS_RDONLY | locked, NULL) == -1) {
+      return false;
+    }
+  }
+
+  int initReady[2];
+  if (pipe(initReady) == -1) {
+    return false;
+  }
+  pid_t init = fork();
+  if (init == 0) {
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    close(initReady[0]);
+    if (mount("proc", "/proc", "proc", MS_NOSUID | MS_NODEV | MS_NOEXEC,
+              NULL) == 0) {
+      write_all(initReady[1], "", 1);
+    }
+    close(initReady[1]);
+    isolation_init_loop();
+  }
+  close(initReady[1]);
+  char ready;
+  bool ok = init > 0 && read(initReady[0], &ready, 1) == 1;
+  close(initReady[0]);
+  return ok;
+}
+
+// Makes the namespaces for a slot and opens them so jobs can join them
+// Inputs: slot - slot to create, called with the isolation lock held
+void create_isolation_slot(struct IsolationSlot *slot) {
+  int ready[2];
+  if (pipe2(ready, O_CLOEXEC) == -1) {
+    isolation_error("pipe");
+  }
+  slot->holder = fork();
+  if (slot->holder == 0) {
+    // the holder waits for us to close the keeper pipe, or to exit
+    close(ready[0]);
+    close(isolation.keeperPipe[1]);
+    int devNull = open("/dev/null", O_RDWR);
+    dup2(devNull, STDIN_FILENO);
+    dup2(devNull, STDOUT_FILENO);
+    close(devNull);
+    if (isolation_holder_setup()) {
+      write_all(ready[1], "", 1);
+      char byte;
+      while (read(isolation.keeperPipe[0], &byte, 1) > 0) {
+      }
+    }
+    _exit(0);
+  }
+  close(ready[1]);
+  char byte;
+  bool ok = slot->holder > 0 && read(ready[0], &byte, 1) == 1;
+  close(ready[0]);
+  if (!ok) {
+    if (slot->holder > 0) {
+      waitpid(slot->holder, NULL, 0);
+    }
+    errno = EPERM;
+    isolation_error("namespace setup");
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/proc/%d/ns/pid_for_children",
+           (int)slot->holder);
+  slot->pidNs = open(path, O_RDONLY | O_CLOEXEC);
+  snprintf(path, sizeof(path), "/proc/%d/ns/net", (int)slot->holder);
+  slot->netNs = open(path, O_RDONLY | O_CLOEXEC);
+  snprintf(path, sizeof(path), "/proc/%d/ns/mnt", (int)slot->holder);
+  slot->mntNs = open(path, O_RDONLY | O_CLOEXEC);
+  if (slot->pidNs < 0 || slot->netNs < 0 || slot->mntNs < 0) {
+    isolation_error(path);
+  }
+  slot->created = true;
+}
+
+// Prepares --isolate if it was given. Must be called before any threads are
+// started, since an unprivileged user first needs a user namespace.
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+void start_isolation(const struct CLArgs *cmdLineArgs) {
+  if (!cmdLineArgs->isolatePresent) {
+    return;
+  }
+  isolation.enabled = true;
+  isolation.readOnly = cmdLineArgs->isolateReadOnly;
+  isolation.workdir = getcwd(NULL, 0);
+  if (!isolation.workdir) {
+    isolation_error("getcwd");
+  }
+  if (geteuid() != 0) {
+    enter_user_namespace();
+  }
+  isolation.ownPidNs = open("/proc/self/ns/pid", O_RDONLY | O_CLOEXEC);
+  if (isolation.ownPidNs < 0 || pipe2(isolation.keeperPipe, O_CLOEXEC) == -1) {
+    isolation_error("/proc/self/ns/pid");
+  }
+  pthread_mutex_init(&isolation.lock, NULL);
+}
+
+// Takes a free slot for a job, creating its namespaces on first use, and
+// makes the calling thread's next child start in the slot's PID namespace
+// Returns: slot index, or -1 if --isolate is off
+int isolation_prepare_fork(void) {
+  if (!isolation.enabled) {
+    return -1;
+  }
+  pthread_mutex_lock(&isolation.lock);
+  int index = 0;
+  while (index < JOB_LIMIT_MAX - 1 && isolation.slots[index].job != 0) {
+    index++;
+  }
+  struct IsolationSlot *slot = &isolation.slots[index];
+  if (!slot->created) {
+    create_isolation_slot(slot);
+  }
+  // reserved until the fork tells us the job's pid
+  slot->job = -1;
+  pthread_mutex_unlock(&isolation.lock);
+
+  // only affects children of this thread
+  if (setns(slot->pidNs, CLONE_NEWPID) == -1) {
+    isolation_error("setns pid");
+  }
+  return index;
+}
+
+// Records the job forked into a slot and puts the calling thread's children
+// back in our own PID namespace
+// Inputs: index - slot from isolation_prepare_fork(), or -1
+//         pid - pid of the job, or -1 if the fork failed
+void isolation_forked(int index, pid_t pid) {
+  if (index < 0) {
+    return;
+  }
+  setns(isolation.ownPidNs, CLONE_NEWPID);
+  pthread_mutex_lock(&isolation.lock);
+  isolation.slots[index].job = pid > 0 ? pid : 0;
+  pthread_mutex_unlock(&isolation.lock);
+}
+
+// Moves a newly forked job into the rest of its slot's namespaces. Joining a
+// mount namespace resets the working directory, so it is changed back.
+// Inputs: index - slot from isolation_prepare_fork(), or -1
+void isolation_enter(int index) {
+  if (index < 0) {
+    return;
+  }
+  struct IsolationSlot *slot = &isolation.slots[index];
+  if (setns(slot->netNs, CLONE_NEWNET) == -1 ||
+      setns(slot->mntNs, CLONE_NEWNS) == -1 || chdir(isolation.workdir) == -1) {
+    fprintf(stderr, "uqparallel: cannot isolate task: %s\n", strerror(errno));
+    raise(SIGUSR1);
+    exit(SIGNAL_EXIT_NUM);
+  }
+}
+
+// Frees the slot used by a job which has been reaped
+// Inputs: pid - pid of the job
+void isolation_release(pid_t pid) {
+  if (!isolation.enabled) {
+    return;
+  }
+  pthread_mutex_lock(&isolation.lock);
+  for (int i = 0; i < JOB_LIMIT_MAX; i++) {
+    if (isolation.slots[i].job == pid) {
+      isolation.slots[i].job = 0;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&isolation.lock);
+}
+
+// Tears down every slot. Once the holders exit their inits are killed, which
+// kills anything the jobs left running.
+void stop_isolation(void) {
+  if (!isolation.enabled) {
+    return;
+  }
+  close(isolation.keeperPipe[1]);
+  for (int i = 0; i < JOB_LIMIT_MAX; i++) {
+    struct IsolationSlot *slot = &isolation.slots[i];
+    if (slot->created) {
+      waitpid(slot->holder, NULL, 0);
+      close(slot->pidNs);
+      close(slot->netNs);
+      close(slot->mntNs);
+    }
+  }
+  close(isolation.keeperPipe[0]);
+  close(isolation.ownPidNs);
+  pthread_mutex_destroy(&isolation.lock);
+  free(isolation.workdir);
+  memset(&isolation, 0, sizeof(isolation));
+}
+
+// Opens the shared memory of a --slots-group, setting it up if this is the
+// first instance to use the group. The group's size is set by that instance.
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+// Exits with FILE_WRITE_ERROR_EXIT_NUM if the group can't be used
+void start_slot_group(const struct CLArgs *cmdLineArgs) {
+  if (!cmdLineArgs->slotsGroup) {
+    return;
+  }
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s%s", slotGroupPathPrefix,
+           cmdLineArgs->slotsGroup);
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, READ_WRITE_PERMISSIONS);
+  if (fd < 0) {
+    fprintf(stderr, "uqparallel: cannot write to \"%s\"\n", path);
+    exit(FILE_WRITE_ERROR_EXIT_NUM);
+  }
+
+  // the lock makes sure only one instance sets the group up
+  flock(fd, LOCK_EX);
+  struct stat info;
+  bool created = fstat(fd, &info) == 0 && info.st_size == 0;
+  if ((created && ftruncate(fd, sizeof(struct SlotGroupTable)) == -1) ||
+      (!created && info.st_size != (off_t)sizeof(struct SlotGroupTable))) {
+    fprintf(stderr, "uqparallel: cannot write to \"%s\"\n", path);
+    exit(FILE_WRITE_ERROR_EXIT_NUM);
+  }
+  slotGroup = mmap(NULL, sizeof(struct SlotGroupTable),
+                   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (slotGroup == MAP_FAILED) {
+    fprintf(stderr, "uqparallel: cannot write to \"%s\"\n", path);
+    exit(FILE_WRITE_ERROR_EXIT_NUM);
+  }
+  if (created) {
+    slotGroup->capacity = (uint32_t)cmdLineArgs->slotsGroupSize;
+  }
+  flock(fd, LOCK_UN);
+  close(fd);
+}
+
+// Takes back the leases of tasks and instances which no longer exist. A lease
+// is released when its task is reaped, so only a crashed instance leaves one
+// behind. A pid which is reused before this runs only delays reclaiming it.
+// Returns: true if any lease was taken back
+bool slot_group_reclaim(void) {
+  bool reclaimed = false;
+  for (uint32_t i = 0; i < slotGroup->capacity; i++) {
+    pid_t owner = __atomic_load_n(&slotGroup->owners[i], __ATOMIC_RELAXED);
+    if (owner > 0 && kill(owner, 0) == -1 && errno == ESRCH &&
+        __atomic_compare_exchange_n(&slotGroup->owners[i], &owner, 0, false,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      reclaimed = true;
+    }
+  }
+  return reclaimed;
+}
+
+// Takes a lease on one of the group's slots before a task is forked, waiting
+// for another task in the group to finish if they are all in use. Our own
+// children may have exited without being reaped yet, since the caller is the
+// one who reaps them, so their leases are taken over instead of waited for.
+// Returns: index of the lease, or -1 if there is no --slots-group
+int slot_group_acquire(void) {
+  if (!slotGroup) {
+    return -1;
+  }
+  pid_t self = getpid();
+  while (true) {
+    uint32_t generation =
+        __atomic_load_n(&slotGroup->generation, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < slotGroup->capacity; i++) {
+      pid_t expected = 0;
+      if (__atomic_compare_exchange_n(&slotGroup->owners[i], &expected, self,
+                                      false, __ATOMIC_ACQUIRE,
+                                      __ATOMIC_RELAXED)) {
+        return (int)i;
+      }
+    }
+
+    bool ownsLeases = false;
+    for (uint32_t i = 0; i < slotGroup->capacity; i++) {
+      pid_t owner = __atomic_load_n(&slotGroup->owners[i], __ATOMIC_RELAXED);
+      siginfo_t info = {0};
+      if (owner <= 0 || owner == self ||
+          waitid(P_PID, (id_t)owner, &info, WEXITED | WNOHANG | WNOWAIT) ==
+              -1) {
+        continue;
+      }
+      ownsLeases = true;
+      // reaping it later finds the lease gone and leaves it alone
+      if (info.si_pid == owner &&
+          __atomic_compare_exchange_n(&slotGroup->owners[i], &owner, self,
+                                      false, __ATOMIC_ACQUIRE,
+                                      __ATOMIC_RELAXED)) {
+        return (int)i;
+      }
+    }
+
+    // our own children can exit without a wake, so check them more often
+    __atomic_add_fetch(&slotGroup->waiters, 1, __ATOMIC_SEQ_CST);
+    long waitMs = ownsLeases ? SLOT_GROUP_POLL_MS : SLOT_GROUP_RECLAIM_MS;
+    struct timespec timeout = {0, waitMs * NANOSECONDS_PER_MILLISECOND};
+    long woken = syscall(SYS_futex, &slotGroup->generation, FUTEX_WAIT,
+                         generation, &timeout, NULL, 0);
+    __atomic_sub_fetch(&slotGroup->waiters, 1, __ATOMIC_SEQ_CST);
+    // nothing was released for a while, so check for crashed owners
+    if (!ownsLeases && woken == -1 && errno == ETIMEDOUT) {
+      slot_group_reclaim();
+    }
+  }
+}
+
+// Hands a lease to the task's process once it is forked
+// Inputs: lease - index from slot_group_acquire(), or -1
+//         pid - process running the task, or -1 if fork failed
+void slot_group_forked(int lease, pid_t pid) {
+  if (lease < 0) {
+    return;
+  }
+  if (pid > 0) {
+    __atomic_store_n(&slotGroup->owners[lease], pid, __ATOMIC_RELEASE);
+    return;
+  }
+  __atomic_store_n(&slotGroup->owners[lease], 0, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&slotGroup->generation, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&slotGroup->waiters, __ATOMIC_SEQ_CST) > 0) {
+    syscall(SYS_futex, &slotGroup->generation, FUTEX_WAKE, INT_MAX, NULL,
+            NULL, 0);
+  }
+}
+
+// Releases the lease of a reaped task and wakes instances waiting for a slot
+// Inputs: pid - process which ran the task
+void slot_group_release(pid_t pid) {
+  if (!slotGroup) {
+    return;
+  }
+  for (uint32_t i = 0; i < slotGroup->capacity; i++) {
+    pid_t owner = pid;
+    if (__atomic_compare_exchange_n(&slotGroup->owners[i], &owner, 0, false,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      __atomic_add_fetch(&slotGroup->generation, 1, __ATOMIC_SEQ_CST);
+      // waking is a syscall, so only make it when someone is waiting
+      if (__atomic_load_n(&slotGroup->waiters, __ATOMIC_SEQ_CST) > 0) {
+        syscall(SYS_futex, &slotGroup->generation, FUTEX_WAKE, INT_MAX, NULL,
+                NULL, 0);
+      }
+      return;
+    }
+  }
+}
+
+// Unmaps the --slots-group. Every lease has been released by then.
+void stop_slot_group(void) {
+  if (!slotGroup) {
+    return;
+  }
+  munmap(slotGroup, sizeof(struct SlotGroupTable));
+  slotGroup = NULL;
+}
+
+// Finds the name of the command a task runs, without its directory
+// Inputs: pArgs - pointer to PArgs struct
+//         i - index of task
+// Returns: command name, or NULL if the task has no command
+const char *task_command_name(const struct PArgs *pArgs, int i) {
+  const char *command = NULL;
+  if (pArgs->numPrefixArgs > 0) {
+    command = pArgs->prefixArgs[0];
+  } else if (pArgs->args[i]) {
+    command = pArgs->args[i][0];
+  } else if (pArgs->compiledFile) {
+    // compiled tasks aren't loaded until they are spawned
+    uint32_t argc = 0;
+    char *targets[NUM_OUTPUT_STREAMS];
+    command = find_compiled_task(
+        pArgs->compiledFile, compiled_task_index(pArgs->compiledFile, i),
+        &argc, targets);
+    command = argc > 0 ? command : NULL;
+  }
+  if (!command) {
+    return NULL;
+  }
+  const char *slash = strrchr(command, '/');
+  return slash ? slash + 1 : command;
+}
+
+// Sets up the classes given with --class and finds the class of every task
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+//         pArgs - pointer to PArgs struct
+void start_task_classes(const struct CLArgs *cmdLineArgs,
+                        const struct PArgs *pArgs) {
+  if (cmdLineArgs->numClassLimits == 0) {
+    return;
+  }
+  int count = cmdLineArgs->numClassLimits;
+  taskClasses.count = count;
+  taskClasses.names = (char **)malloc(count * sizeof(char *));
+  taskClasses.limits = (int *)malloc(count * sizeof(int));
+  taskClasses.running = (int *)calloc(count, sizeof(int));
+  taskClasses.heldHead = (int *)malloc(count * sizeof(int));
+  taskClasses.heldTail = (int *)malloc(count * sizeof(int));
+  for (int c = 0; c < count; c++) {
+    size_t nameLength;
+    parse_class_limit(cmdLineArgs->classLimits[c], &nameLength,
+                      &taskClasses.limits[c]);
+    taskClasses.names[c] = strndup(cmdLineArgs->classLimits[c], nameLength);
+    taskClasses.heldHead[c] = NO_TASK;
+    taskClasses.heldTail[c] = NO_TASK;
+  }
+
+  taskClasses.taskClass = (int *)malloc(pArgs->numArgs * sizeof(int));
+  taskClasses.nextHeld = (int *)malloc(pArgs->numArgs * sizeof(int));
+  for (int i = 0; i < pArgs->numArgs; i++) {
+    const char *name = pArgs->classNames && pArgs->classNames[i]
+                           ? pArgs->classNames[i]
+                           : task_command_name(pArgs, i);
+    taskClasses.taskClass[i] = NO_CLASS;
+    for (int c = 0; name && c < count; c++) {
+      if (strcmp(name, taskClasses.names[c]) == 0) {
+        taskClasses.taskClass[i] = c;
+        break;
+      }
+    }
+  }
+  taskClasses.enabled = true;
+}
+
+// Returns true if a task's class has room for it to start
+// Inputs: task - index of task
+// Returns: true if the task may start as far as --class is concerned
+bool class_has_room(int task) {
+  if (!taskClasses.enabled || taskClasses.taskClass[task] == NO_CLASS) {
+    return true;
+  }
+  int c = taskClasses.taskClass[task];
+  return taskClasses.running[c] < taskClasses.limits[c];
+}
+
+// Takes the next task to start from the run order. Tasks whose class is full
+// are held back, and held tasks go first once their class has room.
+// Inputs: pArgs - pointer to PArgs struct
+//         position - next position in the run order, advanced
+// Returns: task index, or NO_TASK if no remaining task can start yet
+int class_next_task(const struct PArgs *pArgs, int *position) {
+  if (!taskClasses.enabled) {
+    return *position < pArgs->numArgs ? task_at(pArgs, (*position)++)
+                                      : NO_TASK;
+  }
+
+  // held tasks are all earlier in the run order than unread ones
+  int best = NO_CLASS;
+  for (int c = 0; c < taskClasses.count; c++) {
+    if (taskClasses.heldHead[c] != NO_TASK &&
+        taskClasses.running[c] < taskClasses.limits[c] &&
+        (best == NO_CLASS ||
+         taskClasses.heldHead[c] < taskClasses.heldHead[best])) {
+      best = c;
+    }
+  }
+  if (best != NO_CLASS) {
+    int held = taskClasses.heldHead[best];
+    taskClasses.heldHead[best] = taskClasses.nextHeld[held];
+    if (taskClasses.heldHead[best] == NO_TASK) {
+      taskClasses.heldTail[best] = NO_TASK;
+    }
+    return task_at(pArgs, held);
+  }
+
+  while (*position < pArgs->numArgs) {
+    int task = task_at(pArgs, *position);
+    if (class_has_room(task)) {
+      (*position)++;
+      return task;
+    }
+    int c = taskClasses.taskClass[task];
+    taskClasses.nextHeld[*position] = NO_TASK;
+    if (taskClasses.heldTail[c] == NO_TASK) {
+      taskClasses.heldHead[c] = *position;
+    } else {
+      taskClasses.nextHeld[taskClasses.heldTail[c]] = *position;
+    }
+    taskClasses.heldTail[c] = (*position)++;
+  }
+  return NO_TASK;
+}
+
+// Returns true if any task is held back because its class is full
+// Returns: true if class_next_task() still has tasks to hand out
+bool class_tasks_held(void) {
+  for (int c = 0; c < taskClasses.count; c++) {
+    if (taskClasses.heldHead[c] != NO_TASK) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Counts a task which has started against its class
+// Inputs: task - index of task
+//         pid - process id of the task
+void class_task_started(int task, pid_t pid) {
+  if (!taskClasses.enabled || taskClasses.taskClass[task] == NO_CLASS ||
+      pid <= 0) {
+    return;
+  }
+  for (int j = 0; j < JOB_LIMIT_MAX; j++) {
+    if (taskClasses.pids[j] == 0) {
+      taskClasses.pids[j] = pid;
+      taskClasses.pidClasses[j] = taskClasses.taskClass[task];
+      taskClasses.running[taskClasses.pidClasses[j]]++;
+      return;
+    }
+  }
+}
+
+// Gives back the class slot of a task which has finished
+// Inputs: pid - process id of the task
+void class_task_finished(pid_t pid) {
+  if (!taskClasses.enabled) {
+    return;
+  }
+  for (int j = 0; j < JOB_LIMIT_MAX; j++) {
+    if (taskClasses.pids[j] == pid) {
+      taskClasses.pids[j] = 0;
+      taskClasses.running[taskClasses.pidClasses[j]]--;
+      return;
+    }
+  }
+}
+
+// Frees the state of --class
+void stop_task_classes(void) {
+  if (!taskClasses.enabled) {
+    return;
+  }
+  for (int c = 0; c < taskClasses.count; c++) {
+    free(taskClasses.names[c]);
+  }
+  free((void *)taskClasses.names);
+  free(taskClasses.limits);
+  free(taskClasses.running);
+  free(taskClasses.taskClass);
+  free(taskClasses.heldHead);
+  free(taskClasses.heldTail);
+  free(taskClasses.nextHeld);
+  memset(&taskClasses, 0, sizeof(taskClasses));
+}
+
+// Gives a task forked under --speculate pipes for whichever of its stdout and
+// stderr isn't redirected, so that its output can be held back until it wins.
+// The read ends are left in speculation.pending.
+// Inputs: pArgs - pointer to PArgs struct with the task loaded
+//         task - index of task
+//         taskRedirects - descriptors for the child, updated with the pipes
+void speculation_prepare(const struct PArgs *pArgs, int task,
+                         struct TaskRedirects *taskRedirects) {
+  if (!speculation.enabled) {
+    return;
+  }
+  struct SpeculativeOutput *output = &speculation.pending;
+  memset(output, 0, sizeof(*output));
+  for (int stream = 0; stream < NUM_OUTPUT_STREAMS; stream++) {
+    output->fds[stream] = -1;
+    char **targets = stream == 0 ? pArgs->stdoutFiles : pArgs->stderrFiles;
+    int outputPipe[2];
+    if ((targets && targets[task]) || pipe2(outputPipe, O_CLOEXEC) == -1) {
+      continue;
+    }
+    // only the read end, the task writes as usual
+    fcntl(outputPipe[0], F_SETFL, O_NONBLOCK);
+    output->fds[stream] = outputPipe[0];
+    taskRedirects->fds[stream] = outputPipe[1];
+    taskRedirects->relayed[stream] = true;
+  }
+}
+
+// Puts a process forked under --speculate in a process group of its own, so
+// that whatever it starts is killed with it if its twin wins. Background
+// groups can't read the terminal, and two copies can't share an input anyway,
+// so it reads /dev/null.
+void speculation_enter(void) {
+  if (!speculation.enabled) {
+    return;
+  }
+  setpgid(0, 0);
+  for (int i = 0; i < NUM_FORWARDED_SIGNALS; i++) {
+    sigaction(forwardedSignals[i], &speculation.oldActions[i], NULL);
+  }
+  int devNull = open("/dev/null", O_RDONLY);
+  if (devNull >= 0) {
+    dup2(devNull, STDIN_FILENO);
+    close(devNull);
+  }
+}
+
+// Puts a process forked under --speculate in its own group from our side as
+// well, so the group exists before anything signals it
+// Inputs: pid - process id of the child, or -1 if fork failed
+void speculation_forked(pid_t pid) {
+  if (speculation.enabled && pid > 0) {
+    setpgid(pid, pid);
+  }
+}
+
+// Reads whatever a process under --speculate has written so far
+// Inputs: output - the process's output, closed where it has reached EOF
+void speculation_output_read(struct SpeculativeOutput *output) {
+  for (int stream = 0; stream < NUM_OUTPUT_STREAMS; stream++) {
+    while (output->fds[stream] >= 0) {
+      if (output->capacities[stream] - output->lengths[stream] < SPLICE_CHUNK) {
+        output->capacities[stream] =
+            2 * output->capacities[stream] + SPLICE_CHUNK;
+        output->data[stream] =
+            realloc(output->data[stream], output->capacities[stream]);
+      }
+      ssize_t length = read(output->fds[stream],
+                            output->data[stream] + output->lengths[stream],
+                            SPLICE_CHUNK);
+      if (length > 0) {
+        output->lengths[stream] += (size_t)length;
+      } else if (length < 0 && errno == EINTR) {
+        continue;
+      } else {
+        // EAGAIN until the process writes more
+        if (length == 0) {
+          close(output->fds[stream]);
+          output->fds[stream] = -1;
+        }
+        break;
+      }
+    }
+  }
+}
+
+// Throws away the output of a process under --speculate
+// Inputs: output - the process's output
+void speculation_output_discard(struct SpeculativeOutput *output) {
+  for (int stream = 0; stream < NUM_OUTPUT_STREAMS; stream++) {
+    if (output->fds[stream] >= 0) {
+      close(output->fds[stream]);
+    }
+    free(output->data[stream]);
+  }
+  memset(output, 0, sizeof(*output));
+  output->fds[0] = output->fds[1] = -1;
+}
+
+// Passes on the output of the process which won its task under --speculate.
+// Anything it left running which writes later is dropped rather than waited
+// for.
+// Inputs: output - the reaped process's output
+void speculation_output_forward(struct SpeculativeOutput *output) {
+  speculation_output_read(output);
+  write_all(STDOUT_FILENO, output->data[0], output->lengths[0]);
+  write_all(STDERR_FILENO, output->data[1], output->lengths[1]);
+  speculation_output_discard(output);
+}
+
+// Sets up the spawn rate limit of --rate
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+void start_spawn_rate(const struct CLArgs *cmdLineArgs) {
+  spawnRate.enabled = cmdLineArgs->rateInterval != 0;
+  spawnRate.interval = cmdLineArgs->rateInterval;
+  spawnRate.nextAt = 0;
+}
+
+// Takes a token from the --rate bucket, sleeping until it is due. Tokens
+// don't build up while nothing is spawned, so there are never bursts.
+void spawn_rate_wait(void) {
+  if (!spawnRate.enabled) {
+    return;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t nowNs =
+      (uint64_t)now.tv_sec * NANOSECONDS_PER_SECOND_U64 + (uint64_t)now.tv_nsec;
+  pthread_mutex_lock(&spawnRate.lock);
+  uint64_t due = spawnRate.nextAt > nowNs ? spawnRate.nextAt : nowNs;
+  spawnRate.nextAt = due + spawnRate.interval;
+  pthread_mutex_unlock(&spawnRate.lock);
+  if (due == nowNs) {
+    return;
+  }
+  struct timespec until;
+  until.tv_sec = (time_t)(due / NANOSECONDS_PER_SECOND_U64);
+  until.tv_nsec = (long)(due % NANOSECONDS_PER_SECOND_U64);
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) ==
+         EINTR) {
+  }
+}
+
+// Writes the status file of a finished task into its --results directory
+// Inputs: record - status of the task
+void write_result_status(const struct ResultRecord *record) {
+  char name[STATS_BUFFER_SIZE];
+  snprintf(name, sizeof(name), "%d/status", record->number);
+  int fd = openat(results.dirFd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  READ_WRITE_PERMISSIONS);
+  if (fd < 0) {
+    fprintf(stderr, "uqparallel: cannot write to \"%s/%s\"\n", results.dir,
+            name);
+    return;
+  }
+  char status[STATS_RESPONSE_SIZE];
+  int length = snprintf(status, sizeof(status),
+                        "exit %d\nsignal %d\nstart %.3f\nruntime %.3f\n",
+                        record->exitStatus, record->signalNumber,
+                        record->startTime, record->runtime);
+  write_all(fd, status, (size_t)length);
+  close(fd);
+}
+
+// Thread which writes the status files of finished tasks. Everything queued
+// while it was writing is taken in one go.
+// Inputs: arg - unused
+// Returns: NULL
+void *results_writer_thread(void *arg) {
+  (void)arg;
+  struct ResultRecord *batch = NULL;
+  int batchCapacity = 0;
+  pthread_mutex_lock(&results.lock);
+  while (results.queueLength > 0 || !results.stopping) {
+    if (results.queueLength == 0) {
+      pthread_cond_wait(&results.changed, &results.lock);
+      continue;
+    }
+    // swap buffers so tasks can keep finishing while the batch is written
+    struct ResultRecord *queue = results.queue;
+    int length = results.queueLength;
+    int capacity = results.queueCapacity;
+    results.queue = batch;
+    results.queueCapacity = batchCapacity;
+    results.queueLength = 0;
+    batch = queue;
+    batchCapacity = capacity;
+    pthread_mutex_unlock(&results.lock);
+    for (int i = 0; i < length; i++) {
+      write_result_status(&batch[i]);
+    }
+    pthread_mutex_lock(&results.lock);
+  }
+  pthread_mutex_unlock(&results.lock);
+  free(batch);
+  return NULL;
+}
+
+// Opens the --results directory, making it if needed, and starts its writer
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+//         countTasks - true if tasks come from stdin and have no index
+// Exits with FILE_WRITE_ERROR_EXIT_NUM if the directory can't be used
+void start_results(const struct CLArgs *cmdLineArgs, bool countTasks) {
+  if (!cmdLineArgs->resultsDir) {
+    return;
+  }
+  const char *dir = cmdLineArgs->resultsDir;
+  if (mkdir(dir, S_IRWXU) == -1 && errno != EEXIST) {
+    fprintf(stderr, "uqparallel: cannot write to \"%s\"\n", dir);
+    exit(FILE_WRITE_ERROR_EXIT_NUM);
+  }
+  results.dirFd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (results.dirFd < 0) {
+    fprintf(stderr, "uqparallel: cannot write to \"%s\"\n", dir);
+    exit(FILE_WRITE_ERROR_EXIT_NUM);
+  }
+  results.enabled = true;
+  results.dir = strdup(dir);
+  results.countTasks = countTasks;
+  pthread_mutex_init(&results.lock, NULL);
+  pthread_cond_init(&results.changed, NULL);
+  pthread_create(&results.thread, NULL, results_writer_thread, NULL);
+}
+
+// Returns the number of the directory a task's results go in
+// Inputs: task - index of task about to start
+// Returns: 1-based task number, or 0 if --results isn't used
+int results_prepare(int task) {
+  if (!results.enabled) {
+    return 0;
+  }
+  return results.countTasks ? ++results.numTasks : task + 1;
+}
+
+// Sends a child's stdout and stderr to files in its task's --results
+// directory, unless the task redirects them itself
+// Inputs: pArgs - pointer to PArgs struct
+//         task - index of task
+//         number - number from results_prepare()
+void results_enter(const struct PArgs *pArgs, int task, int number) {
+  if (number == 0) {
+    return;
+  }
+  char name[STATS_BUFFER_SIZE];
+  snprintf(name, sizeof(name), "%d", number);
+  mkdirat(results.dirFd, name, S_IRWXU);
+  const char *const streams[] = {"stdout", "stderr"};
+  char *const *redirects[] = {pArgs->stdoutFiles, pArgs->stderrFiles};
+  for (int stream = 0; stream < NUM_OUTPUT_STREAMS; stream++) {
+    if (redirects[stream] && redirects[stream][task]) {
+      continue;
+    }
+    snprintf(name, sizeof(name), "%d/%s", number, streams[stream]);
+    int fd = openat(results.dirFd, name, O_WRONLY | O_CREAT | O_TRUNC,
+                    READ_WRITE_PERMISSIONS);
+    if (fd < 0) {
+      fprintf(stderr, "uqparallel: cannot write to \"%s/%s\"\n", results.dir,
+              name);
+      raise(SIGUSR1);
+      exit(SIGNAL_EXIT_NUM);
+    }
+    dup2(fd, stream == 0 ? STDOUT_FILENO : STDERR_FILENO);
+    close(fd);
+  }
+}
+
+// Records when a task whose results are stored started
+// Inputs: number - number from results_prepare()
+//         pid - process running the task
+void results_started(int number, pid_t pid) {
+  if (number == 0 || pid <= 0) {
+    return;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  pthread_mutex_lock(&results.lock);
+  for (int i = 0; i < JOB_LIMIT_MAX; i++) {
+    struct ResultJob *job = &results.running[i];
+    if (job->pid == 0) {
+      job->pid = pid;
+      job->number = number;
+      job->startTime = (double)now.tv_sec +
+                       (double)now.tv_nsec / NANOSECONDS_PER_SECOND;
+      clock_gettime(CLOCK_MONOTONIC, &job->started);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&results.lock);
+}
+
+// Queues the status of a reaped task for the --results writer
+// Inputs: pid - process which ran the task
+//         exitStatus - exit status of the task
+//         signalNumber - signal which killed the task, or 0
+void results_finished(pid_t pid, int exitStatus, int signalNumber) {
+  if (!results.enabled) {
+    return;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  pthread_mutex_lock(&results.lock);
+  for (int i = 0; i < JOB_LIMIT_MAX; i++) {
+    struct ResultJob *job = &results.running[i];
+    if (job->pid != pid) {
+      continue;
+    }
+    if (results.queueLength == results.queueCapacity) {
+      results.queueCapacity =
+          results.queueCapacity ? 2 * results.queueCapacity : JOB_LIMIT_MAX;
+      results.queue = (struct ResultRecord *)realloc(
+          results.queue, results.queueCapacity * sizeof(struct ResultRecord));
+    }
+    struct ResultRecord *record = &results.queue[results.queueLength++];
+    record->number = job->number;
+    record->exitStatus = exitStatus;
+    record->signalNumber = signalNumber;
+    record->startTime = job->startTime;
+    record->runtime =
+        (double)(now.tv_sec - job->started.tv_sec) +
+        (double)(now.tv_nsec - job->started.tv_nsec) / NANOSECONDS_PER_SECOND;
+    job->pid = 0;
+    pthread_cond_signal(&results.changed);
+    break;
+  }
+  pthread_mutex_unlock(&results.lock);
+}
+
+// Waits for the writer to store every queued status, then closes --results
+void stop_results(void) {
+  if (!results.enabled) {
+    return;
+  }
+  pthread_mutex_lock(&results.lock);
+  results.stopping = true;
+  pthread_cond_signal(&results.changed);
+  pthread_mutex_unlock(&results.lock);
+  pthread_join(results.thread, NULL);
+  close(results.dirFd);
+  pthread_mutex_destroy(&results.lock);
+  pthread_cond_destroy(&results.changed);
+  free(results.dir);
+  free(results.queue);
+  memset(&results, 0, sizeof(results));
+}
+
+// Writes what a relayed task has written since it was last read, up to the
+// end of its last complete line
+// Inputs: source - task output to read
+//         chunk - buffer of SPLICE_CHUNK bytes
+//         size - most bytes to read, at most SPLICE_CHUNK
+// Returns: false once the task has closed its output
+bool relay_read(struct RelaySource *source, char *chunk, size_t size) {
+  ssize_t length = read(source->fd, chunk, size);
+  if (length < 0 && (errno == EINTR || errno == EAGAIN)) {
+    return true;
+  }
+  if (length <= 0) {
+    // a last line without a newline is still written in one piece
+    write_all(source->target, source->carry, source->carryLength);
+    return false;
+  }
+
+  // whole lines from a chunk with nothing held back go straight out
+  const char *data = chunk;
+  size_t dataLength = (size_t)length;
+  if (source->carryLength > 0) {
+    if (source->carryLength + dataLength > source->carryCapacity) {
+      source->carryCapacity = 2 * (source->carryLength + dataLength);
+      source->carry = realloc(source->carry, source->carryCapacity);
+    }
+    memcpy(source->carry + source->carryLength, chunk, dataLength);
+    source->carryLength += dataLength;
+    data = source->carry;
+    dataLength = source->carryLength;
+  }
+  const char *lastNewline = memrchr(data, '\n', dataLength);
+  size_t complete = lastNewline ? (size_t)(lastNewline - data) + 1 : 0;
+  write_all(source->target, data, complete);
+
+  size_t rest = dataLength - complete;
+  if (rest > source->carryCapacity) {
+    source->carryCapacity = 2 * rest;
+    char *carry = malloc(source->carryCapacity);
+    memcpy(carry, data + complete, rest);
+    free(source->carry);
+    source->carry = carry;
+  } else {
+    memmove(source->carry, data + complete, rest);
+  }
+  source->carryLength = rest;
+  return true;
+}
+
+// Stops reading a task's output and frees it. The caller holds
+// redirects.lock.
+// Inputs: source - task output to drop
+void relay_drop_source(struct RelaySource *source) {
+  if (source->prev) {
+    source->prev->next = source->next;
+  } else {
+    redirects.sources = source->next;
+  }
+  if (source->next) {
+    source->next->prev = source->prev;
+  }
+  epoll_ctl(redirects.epollFd, EPOLL_CTL_DEL, source->fd, NULL);
+  close(source->fd);
+  free(source->carry);
+  free(source);
+}
+
+// Writes out what is already waiting in the pipes of the relay's sources, and
+// drops them without waiting for them to close. Only background processes a
+// task left behind can still hold them once every task has been reaped, and
+// uqparallel doesn't wait for those.
+// Inputs: chunk - buffer of SPLICE_CHUNK bytes
+void relay_drain_sources(char *chunk) {
+  pthread_mutex_lock(&redirects.lock);
+  while (redirects.sources) {
+    struct RelaySource *source = redirects.sources;
+    int waiting = 0;
+    ioctl(source->fd, FIONREAD, &waiting);
+    bool writing = true;
+    while (writing && waiting > 0) {
+      size_t size = waiting < SPLICE_CHUNK ? (size_t)waiting : SPLICE_CHUNK;
+      writing = relay_read(source, chunk, size);
+      waiting -= (int)size;
+    }
+    if (writing) {
+      write_all(source->target, source->carry, source->carryLength);
+    }
+    relay_drop_source(source);
+  }
+  pthread_mutex_unlock(&redirects.lock);
+}
+
+// Thread which copies the output of tasks sharing a redirect target into it
+// a line at a time, until it is stopped
+// Inputs: arg - unused
+// Returns: NULL
+void *redirect_relay_thread(void *arg) {
+  (void)arg;
+  struct epoll_event events[RELAY_MAX_EVENTS];
+  char *chunk = malloc(SPLICE_CHUNK);
+  bool stopping = false;
+  while (!stopping) {
+    int ready = epoll_wait(redirects.epollFd, events, RELAY_MAX_EVENTS, -1);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    for (int i = 0; i < ready; i++) {
+      struct RelaySource *source = events[i].data.ptr;
+      if (!source) {
+        epoll_ctl(redirects.epollFd, EPOLL_CTL_DEL, redirects.wakePipe[0],
+                  NULL);
+        stopping = true;
+        continue;
+      }
+      if (!relay_read(source, chunk, SPLICE_CHUNK)) {
+        pthread_mutex_lock(&redirects.lock);
+        relay_drop_source(source);
+        pthread_mutex_unlock(&redirects.lock);
+      }
+    }
+  }
+  relay_drain_sources(chunk);
+  free(chunk);
+  return NULL;
+}
+
+// Starts the relay thread the first time a redirect target is shared. The
+// caller holds redirects.lock.
+// Returns: true if the relay is running
+bool start_redirect_relay(void) {
+  if (redirects.relayStarted) {
+    return true;
+  }
+  redirects.epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (redirects.epollFd < 0) {
+    return false;
+  }
+  if (pipe2(redirects.wakePipe, O_CLOEXEC) == -1) {
+    close(redirects.epollFd);
+    return false;
+  }
+  struct epoll_event event = {0};
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  epoll_ctl(redirects.epollFd, EPOLL_CTL_ADD, redirects.wakePipe[0], &event);
+  if (pthread_create(&redirects.relayThread, NULL, redirect_relay_thread,
+                     NULL) != 0) {
+    close(redirects.wakePipe[0]);
+    close(redirects.wakePipe[1]);
+    close(redirects.epollFd);
+    return false;
+  }
+  redirects.relayStarted = true;
+  return true;
+}
+
+// Makes a pipe for one of a task's outputs and hands its read end to the relay
+// Inputs: target - descriptor of the shared redirect target
+// Returns: write end for the child, or -1 if no pipe could be made
+int relay_add_source(int target) {
+  int relayPipe[2];
+  if (pipe2(relayPipe, O_CLOEXEC) == -1) {
+    return -1;
+  }
+  struct RelaySource *source = calloc(1, sizeof(struct RelaySource));
+  source->fd = relayPipe[0];
+  source->target = target;
+  struct epoll_event event = {0};
+  event.events = EPOLLIN;
+  event.data.ptr = source;
+  pthread_mutex_lock(&redirects.lock);
+  source->next = redirects.sources;
+  if (source->next) {
+    source->next->prev = source;
+  }
+  redirects.sources = source;
+  epoll_ctl(redirects.epollFd, EPOLL_CTL_ADD, relayPipe[0], &event);
+  pthread_mutex_unlock(&redirects.lock);
+  return relayPipe[1];
+}
+
+// Finds where a task's output redirects go before it is forked. A file with
+// more than one writer is opened and truncated the first time it is used, and
+// the task writes to it through the relay. A file only this task writes to is
+// left for the child to open, as before. With --isolate the parent doesn't
+// open anything, so the child's mount namespace and --isolate-ro still apply;
+// the child appends to a shared file instead.
+// Inputs: pArgs - pointer to PArgs struct with the task loaded
+//         task - index of task
+//         taskRedirects - filled in with a descriptor for each output, or -1
+//                         to leave it to the child
+void redirect_prepare(const struct PArgs *pArgs, int task,
+                      struct TaskRedirects *taskRedirects) {
+  for (int stream = 0; stream < NUM_OUTPUT_STREAMS; stream++) {
+    taskRedirects->fds[stream] = -1;
+    taskRedirects->relayed[stream] = false;
+    taskRedirects->append[stream] = false;
+    char **targets = stream == 0 ? pArgs->stdoutFiles : pArgs->stderrFiles;
+    if (!targets || !targets[task]) {
+      continue;
+    }
+
+    pthread_mutex_lock(&redirects.lock);
+    size_t slot = find_redirect_slot(targets[task]);
+    // targets first seen at spawn time may be shared by tasks still to come
+    if (redirects.uses[slot] == 1 || isolation.enabled) {
+      taskRedirects->append[stream] = redirects.uses[slot] != 1;
+      pthread_mutex_unlock(&redirects.lock);
+      continue;
+    }
+    if (redirects.fds[slot] < 0) {
+      redirects.fds[slot] = open(
+          targets[task], O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+          READ_WRITE_PERMISSIONS);
+    }
+    int fd = redirects.fds[slot];
+    bool relay = fd >= 0 && start_redirect_relay();
+    pthread_mutex_unlock(&redirects.lock);
+
+    // if the open failed, the child tries again and reports it
+    taskRedirects->fds[stream] = fd;
+    int relayFd = relay ? relay_add_source(fd) : -1;
+    if (relayFd >= 0) {
+      taskRedirects->fds[stream] = relayFd;
+      taskRedirects->relayed[stream] = true;
+    }
+  }
+}
+
+// Closes the parent's copies of the pipes to the relay once a task is forked
+// Inputs: taskRedirects - descriptors from redirect_prepare()
+void redirect_forked(const struct TaskRedirects *taskRedirects) {
+  for (int stream = 0; stream < NUM_OUTPUT_STREAMS; stream++) {
+    if (taskRedirects->relayed[stream]) {
+      close(taskRedirects->fds[stream]);
+    }
+  }
+}
+
+// Has the relay write out everything tasks have written, then closes every
+// redirect target. Called once every task has been reaped.
+void stop_redirects(void) {
+  if (redirects.relayStarted) {
+    close(redirects.wakePipe[1]);
+    pthread_join(redirects.relayThread, NULL);
+    close(redirects.wakePipe[0]);
+    close(redirects.epollFd);
+  }
+  for (size_t i = 0; i < redirects.capacity; i++) {
+    if (redirects.fds[i] >= 0) {
+      close(redirects.fds[i]);
+    }
+    free(redirects.paths[i]);
+  }
+  free((void *)redirects.paths);
+  free(redirects.uses);
+  free(redirects.fds);
+  redirects.paths = NULL;
+  redirects.uses = NULL;
+  redirects.fds = NULL;
+  redirects.capacity = 0;
+  redirects.count = 0;
+  redirects.relayStarted = false;
+}
+
+// Gives back everything a reaped child held while it ran
+// Inputs: pid - process id of the child
+void release_child(pid_t pid) {
+  latency_reaped(pid);
+  slot_group_release(pid);
+  class_task_finished(pid);
+  isolation_release(pid);
+  stage_task_finished(pid);
+}
+
+// Records the exit status of a task whose child has been reaped
+// Inputs: pid - process id the task was started as
+//         status - status returned by wait
+//         lastExitStatus - set to the task's exit status
+void record_task_finished(pid_t pid, int status, int *lastExitStatus) {
+  if (WIFEXITED(status)) {
+    *lastExitStatus = WEXITSTATUS(status);
+  } else {
+    *lastExitStatus = SIGNAL_EXIT_NUM;
+  }
+  job_log_finished(pid, NO_TASK, *lastExitStatus,
+                   WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+  results_finished(pid, *lastExitStatus,
+                   WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+  stats_task_finished(*lastExitStatus);
+}
+
+// Children started by one scheduling loop and the task each one runs. They
+// are reaped by pid, so processes started for anything else, such as
+// isolation holders, are never taken for tasks.
+struct ChildTable {
+  pid_t *pids;
+  int *tasks;
+  struct pollfd *pollFds;
+  int count;
+  int capacity;
+};
+
+// Adds a newly forked child to a table
+// Inputs: table - table to add to
+//         pid - process id of the child
+//         task - index of the task the child runs
+void child_table_add(struct ChildTable *table, pid_t pid, int task) {
+  if (table->count == table->capacity) {
+    table->capacity = table->capacity ? table->capacity * 2 : JOB_LIMIT_MAX;
+    table->pids =
+        (pid_t *)realloc(table->pids, table->capacity * sizeof(pid_t));
+    table->tasks = (int *)realloc(table->tasks, table->capacity * sizeof(int));
+    table->pollFds = (struct pollfd *)realloc(
+        table->pollFds, table->capacity * sizeof(struct pollfd));
+  }
+  table->pids[table->count] = pid;
+  table->tasks[table->count] = task;
+  table->pollFds[table->count].fd = open_pidfd(pid);
+  table->pollFds[table->count].events = POLLIN;
+  table->count++;
+}
+
+// Waits until one of a table's children has terminated, then reaps it and
+// removes it from the table
+// Inputs: table - table with at least one child
+//         status - set to the status returned by waitpid
+//         task - set to the task the child ran, may be NULL
+// Returns: pid of the reaped child
+pid_t child_table_reap(struct ChildTable *table, int *status, int *task) {
+  while (true) {
+    bool fallback = false;
+    for (int i = 0; i < table->count; i++) {
+      fallback |= table->pollFds[i].fd < 0;
+      table->pollFds[i].revents = 0;
+    }
+    // without pidfds we have to check our children with WNOHANG periodically
+    if (poll(table->pollFds, table->count,
+             fallback ? PIDFD_FALLBACK_POLL_MS : -1) < 0) {
+      continue;
+    }
+    for (int i = 0; i < table->count; i++) {
+      struct pollfd *pollFd = &table->pollFds[i];
+      if ((pollFd->fd >= 0 && !(pollFd->revents & POLLIN)) ||
+          waitpid(table->pids[i], status, WNOHANG) <= 0) {
+        continue;
+      }
+      pid_t pid = table->pids[i];
+      if (task) {
+        *task = table->tasks[i];
+      }
+      if (pollFd->fd >= 0) {
+        close(pollFd->fd);
+      }
+      table->count--;
+      table->pids[i] = table->pids[table->count];
+      table->tasks[i] = table->tasks[table->count];
+      table->pollFds[i] = table->pollFds[table->count];
+      return pid;
+    }
+  }
+}
+
+// Frees a table whose children have all been reaped
+// Inputs: table - table to free
+void free_child_table(struct ChildTable *table) {
+  free(table->pids);
+  free(table->tasks);
+  free(table->pollFds);
+}
+
+// Waits for and processes the termination of a child started by the caller
+// Inputs: children - children started by the caller
+//         activeChildren - pointer to active child count
+//         lastExitStatus - pointer to last exit status
+//         task - set to the task the child ran, may be NULL
+// Returns: pid of the reaped child
+pid_t reap_child(struct ChildTable *children, int *activeChildren,
+                 int *lastExitStatus, int *task) {
+  int status;
+  pid_t pid = child_table_reap(children, &status, task);
+  UQ_TRACE(reap, pid, status);
+  release_child(pid);
+  (*activeChildren)--;
+  record_task_finished(pid, status, lastExitStatus);
+  return pid;
+}
+
+// Executes children in parallel using pipes. A stage with @replicas=K runs K
+// copies which share the previous stage's output as @split= says, and whose
+// lines are merged into the one pipe read by the next stage.
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+//         pArgs - pointer to PArgs struct
+// Returns: exit code from last child
+int make_pipe_babies(const struct CLArgs *cmdLineArgs, struct PArgs *pArgs) {
+  int numChildren = pArgs->numArgs;
+  int maxChildren = cmdLineArgs->jobLimit;
+  int activeChildren = 0;
+  int lastExitStatus = 0;
+  struct ChildTable children = {0};
+
+  // pipe() opens read and write ends of pipes
+  int pipes[numChildren - 1][2];
+  for (int i = 0; i < numChildren - 1; i++) {
+    if (pipe(pipes[i]) == -1) {
+      perror("pipe");
+      exit(1);
+    }
+  }
+
+  // every stage with replicas gets its input from a distributor thread
+  struct Distributor *distributors =
+      calloc(numChildren, sizeof(struct Distributor));
+  struct Collector *collectors = calloc(numChildren, sizeof(struct Collector));
+  long numProcesses = 0;
+  for (int i = 0; i < numChildren; i++) {
+    int replicas = pArgs->replicas ? pArgs->replicas[i] : 1;
+    numProcesses += replicas;
+    if (replicas > 1) {
+      // the distributor writing to a replica which has exited must not kill us
+      signal(SIGPIPE, SIG_IGN);
+      distributors[i].source = i > 0 ? pipes[i - 1][0] : STDIN_FILENO;
+      distributors[i].numTargets = replicas;
+      distributors[i].mode = pArgs->splitModes ? pArgs->splitModes[i] : 0;
+      distributors[i].targets = (int *)malloc(replicas * sizeof(int));
+      collectors[i].target = i < numChildren - 1 ? pipes[i][1] : STDOUT_FILENO;
+      collectors[i].numSources = replicas;
+      collectors[i].sources = (int *)malloc(replicas * sizeof(int));
+    }
+  }
+  __atomic_store_n(&runStats.total, numProcesses, __ATOMIC_RELAXED);
+
+  uint64_t slotFreedAt = latency_now();
+  for (int i = 0; i < numChildren; i++) {
+    for (int k = 0; k < (pArgs->replicas ? pArgs->replicas[i] : 1); k++) {
+      while (activeChildren >= maxChildren) {
+        reap_child(&children, &activeChildren, &lastExitStatus, NULL);
+        slotFreedAt = latency_now();
+      }
+      int inputFd = i > 0 ? pipes[i - 1][0] : -1;
+      int outputFd = i < numChildren - 1 ? pipes[i][1] : -1;
+      int replicaIn[2] = {-1, -1};
+      int replicaOut[2] = {-1, -1};
+      if (distributors[i].targets) {
+        if (pipe2(replicaIn, O_CLOEXEC) == -1 ||
+            pipe2(replicaOut, O_CLOEXEC) == -1) {
+          perror("pipe");
+          exit(1);
+        }
+        inputFd = replicaIn[0];
+        outputFd = replicaOut[1];
+        distributors[i].targets[k] = replicaIn[1];
+        collectors[i].sources[k] = replicaOut[0];
+      }
+
+      struct LatencySpawn spawn;
+      load_compiled_task(pArgs, i);
+      const char *path = task_command_path(pArgs, i);
+      latency_prepare_spawn(&spawn, slotFreedAt);
+      pid_t pid = fork();
+      if (pid == 0) {
+        exec_pipe_child(pArgs, i, numChildren, pipes, inputFd, outputFd,
+                        path);
+      } else if (pid > 0) {
+        UQ_TRACE(spawn, i, pid);
+        latency_spawned(&spawn, pid);
+        job_log_started(pArgs, i, pid);
+        unload_compiled_task(pArgs, i);
+        stats_task_started();
+        child_table_add(&children, pid, i);
+        activeChildren++;
+        if (replicaIn[0] >= 0) {
+          close(replicaIn[0]);
+          close(replicaOut[1]);
+        }
+      } else {
+        latency_spawned(&spawn, pid);
+        perror("fork");
+        return 1;
+      }
+    }
+    if (distributors[i].targets) {
+      pthread_create(&distributors[i].thread, NULL, distributor_thread,
+                     &distributors[i]);
+      pthread_create(&collectors[i].thread, NULL, collector_thread,
+                     &collectors[i]);
+    }
+  }
+  // Close unused pipe fds in parent, the threads close the ends they use
+  for (int i = 0; i < numChildren - 1; i++) {
+    if (!distributors[i + 1].targets) {
+      close(pipes[i][0]);
+    }
+    if (!collectors[i].sources) {
+      close(pipes[i][1]);
+    }
+  }
+  // Reap remaining children
+  while (activeChildren > 0) {
+    reap_child(&children, &activeChildren, &lastExitStatus, NULL);
+  }
+  free_child_table(&children);
+
+  for (int i = 0; i < numChildren; i++) {
+    if (distributors[i].targets) {
+      pthread_join(distributors[i].thread, NULL);
+      pthread_join(collectors[i].thread, NULL);
+      free(distributors[i].targets);
+      free(collectors[i].sources);
+    }
+  }
+  free(distributors);
+  free(collectors);
+  return lastExitStatus;
+}
+
+// Executes a single child without pipes
+// Inputs: pArgs - pointer to PArgs struct
+//         i - index of command to execute
+//         path - path of the command from resolve_command(), or NULL
+//         taskRedirects - descriptors from redirect_prepare(), or NULL to open
+//                         the task's redirect targets here
+void exec_child(const struct PArgs *pArgs, int i, const char *path,
+                const struct TaskRedirects *taskRedirects) {
+  if (!pArgs->args[i] || !pArgs->args[i][0]) {
+    fprintf(stderr, "uqparallel: unable to execute empty command\n");
+    exit(EMPTY_COMMAND_EXIT_NUM);
+  }
+
+  // Redirect stdout if needed
+  if (taskRedirects && taskRedirects->fds[0] >= 0) {
+    dup2(taskRedirects->fds[0], STDOUT_FILENO);
+  } else if (pArgs->stdoutFiles && pArgs->stdoutFiles[i]) {
+    bool append = taskRedirects && taskRedirects->append[0];
+    int fd = open(pArgs->stdoutFiles[i],
+                  O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC),
+                  READ_WRITE_PERMISSIONS);
+    if (fd < 0) {
+      fprintf(stderr, "uqparallel: cannot write to \"%s\"\n",
+              pArgs->stdoutFiles[i]);
+      raise(SIGUSR1);
+      exit(SIGNAL_EXIT_NUM);
+    }
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+  }
+
+  // Redirect stderr if needed
+  if (taskRedirects && taskRedirects->fds[1] >= 0) {
+    dup2(taskRedirects->fds[1], STDERR_FILENO);
+  } else if (pArgs->stderrFiles && pArgs->stderrFiles[i]) {
+    bool append = taskRedirects && taskRedirects->append[1];
+    int fd = open(pArgs->stderrFiles[i],
+                  O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC),
+                  READ_WRITE_PERMISSIONS);
+    if (fd < 0) {
+      fprintf(stderr, "uqparallel: cannot write to \"%s\"\n",
+              pArgs->stderrFiles[i]);
+      raise(SIGUSR1);
+      exit(SIGNAL_EXIT_NUM);
+    }
+    dup2(fd, STDERR_FILENO);
+    close(fd);
+  }
+
+  // redirects are opened before changing to the task's directory
+  char **env = prepare_task_environment(pArgs, i);
+  exec_command(path, pArgs->args[i], env);
+  fprintf(stderr, "uqparallel: cannot execute \"%s\"\n", pArgs->args[i][0]);
+  raise(SIGUSR1);
+  exit(SIGNAL_EXIT_NUM);
+}
+
+// Forks a child to run a task and records it for statistics and reports
+// Inputs: pArgs - pointer to PArgs struct
+//         task - index of task
+//         queuedAt - latency timestamp of when the task could have started
+// Returns: pid of the child, or -1 if fork failed
+pid_t spawn_task(struct PArgs *pArgs, int task, uint64_t queuedAt) {
+  struct LatencySpawn spawn;
+  load_compiled_task(pArgs, task);
+  bool staged = stage_wait(task);
+  const char *path = task_command_path(pArgs, task);
+  int resultNumber = results_prepare(task);
+  struct TaskRedirects taskRedirects;
+  redirect_prepare(pArgs, task, &taskRedirects);
+  speculation_prepare(pArgs, task, &taskRedirects);
+  spawn_rate_wait();
+  int lease = slot_group_acquire();
+  latency_prepare_spawn(&spawn, queuedAt);
+  int slot = isolation_prepare_fork();
+  pid_t pid = fork();
+  if (pid == 0) {
+    isolation_enter(slot);
+    stage_enter(pArgs, task, staged);
+    results_enter(pArgs, task, resultNumber);
+    speculation_enter();
+    exec_child(pArgs, task, path, &taskRedirects);
+  }
+  speculation_forked(pid);
+  redirect_forked(&taskRedirects);
+  slot_group_forked(lease, pid);
+  class_task_started(task, pid);
+  isolation_forked(slot, pid);
+  stage_task_started(task, pid);
+  results_started(resultNumber, pid);
+  latency_spawned(&spawn, pid);
+  if (pid > 0) {
+    UQ_TRACE(spawn, task, pid);
+    job_log_started(pArgs, task, pid);
+    stats_task_started();
+  }
+  unload_compiled_task(pArgs, task);
+  return pid;
+}
+
+// Handler for the signals which --speculate passes on. Only writes the signal
+// number down speculation.signalPipe for the scheduling loop to deal with.
+// Inputs: signalNumber - signal received
+void speculation_catch_signal(int signalNumber) {
+  int savedErrno = errno;
+  unsigned char byte = (unsigned char)signalNumber;
+  // if the pipe is full the loop has plenty of signals to handle already
+  ssize_t written = write(speculation.signalPipe[1], &byte, 1);
+  (void)written;
+  errno = savedErrno;
+}
+
+// Sends a signal to the process groups of every task under --speculate
+// Inputs: signalNumber - signal to send
+void speculation_signal_tasks(int signalNumber) {
+  for (int i = 0; i < speculation.numRunning; i++) {
+    kill(-speculation.running[i].pid, signalNumber);
+    if (speculation.running[i].copyPid > 0) {
+      kill(-speculation.running[i].copyPid, signalNumber);
+    }
+  }
+}
+
+// Passes on the signals caught since last time to the tasks under
+// --speculate, then does what the signal would have done to us: stops until
+// continued, which the tasks are told of too, or terminates
+void speculation_handle_signals(void) {
+  unsigned char byte;
+  while (read(speculation.signalPipe[0], &byte, 1) == 1) {
+    int signalNumber = byte;
+    speculation_signal_tasks(signalNumber);
+    int i = 0;
+    while (forwardedSignals[i] != signalNumber) {
+      i++;
+    }
+    struct sigaction action;
+    sigaction(signalNumber, &speculation.oldActions[i], &action);
+    raise(signalNumber);
+    // only a stop gets here, once we have been continued
+    sigaction(signalNumber, &action, NULL);
+    speculation_signal_tasks(SIGCONT);
+  }
+}
+
+// Sets up --speculate for the tasks run by make_babies()
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+//         pArgs - pointer to PArgs struct
+void start_speculation(const struct CLArgs *cmdLineArgs,
+                       const struct PArgs *pArgs) {
+  // tasks with dependencies are run by make_babies_graph(), which doesn't
+  // copy them
+  if (cmdLineArgs->speculateFactor == 0 || pArgs->graph) {
+    return;
+  }
+  speculation.enabled = true;
+  speculation.factor = cmdLineArgs->speculateFactor;
+  speculation.runtimes = (double *)malloc(pArgs->numArgs * sizeof(double));
+
+  // tasks are outside the terminal's foreground group, so its signals come
+  // to us and are passed on from the scheduling loop
+  if (pipe2(speculation.signalPipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+    perror("pipe");
+    exit(1);
+  }
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = speculation_catch_signal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  for (int i = 0; i < NUM_FORWARDED_SIGNALS; i++) {
+    sigaction(forwardedSignals[i], NULL, &speculation.oldActions[i]);
+    // signals ignored by whoever started us, as by nohup, stay ignored
+    if (speculation.oldActions[i].sa_handler != SIG_IGN) {
+      sigaction(forwardedSignals[i], &action, NULL);
+    }
+  }
+}
+
+// Tracks a task started by make_babies() under --speculate
+// Inputs: task - index of task
+//         pid - process id of the task
+void speculation_started(int task, pid_t pid) {
+  if (!speculation.enabled) {
+    return;
+  }
+  struct SpeculativeTask *entry =
+      &speculation.running[speculation.numRunning++];
+  entry->task = task;
+  entry->pid = pid;
+  entry->pidfd = open_pidfd(pid);
+  entry->output = speculation.pending;
+  entry->copyPid = NO_COPY;
+  entry->copyPidfd = -1;
+  memset(&entry->copyOutput, 0, sizeof(entry->copyOutput));
+  entry->copyOutput.fds[0] = entry->copyOutput.fds[1] = -1;
+  clock_gettime(CLOCK_MONOTONIC, &entry->started);
+}
+
+// Compares two runtimes for qsort()
+// Inputs: a, b - pointers to the runtimes
+// Returns: negative, zero or positive as a is less than, equal to or more
+// than b
+int compare_runtimes(const void *a, const void *b) {
+  double first = *(const double *)a;
+  double second = *(const double *)b;
+  return (first > second) - (first < second);
+}
+
+// Finds the median runtime of the tasks which have finished
+// Returns: median in seconds, or -1 if too few tasks have finished to tell
+double speculation_median(void) {
+  if (speculation.numRuntimes < SPECULATE_MIN_RUNTIMES) {
+    return -1;
+  }
+  // only sorted again once more tasks have finished
+  if (speculation.medianRuntimes != speculation.numRuntimes) {
+    qsort(speculation.runtimes, speculation.numRuntimes, sizeof(double),
+          compare_runtimes);
+    speculation.median = speculation.runtimes[speculation.numRuntimes / 2];
+    speculation.medianRuntimes = speculation.numRuntimes;
+  }
+  return speculation.median;
+}
+
+// Starts a copy of a straggling task, with its output held back like the
+// first run's. Tasks which redirect or stage files are never copied, as the
+// copy would write over the files of the first run.
+// Inputs: pArgs - pointer to PArgs struct
+//         entry - the straggling task
+// Returns: true if a copy was started
+bool spawn_speculative_copy(struct PArgs *pArgs,
+                            struct SpeculativeTask *entry) {
+  int task = entry->task;
+  load_compiled_task(pArgs, task);
+  if ((pArgs->stdoutFiles &&
+       (pArgs->stdoutFiles[task] || pArgs->stderrFiles[task])) ||
+      (pArgs->stageIn && pArgs->stageIn[task]) ||
+      (pArgs->stageOut && pArgs->stageOut[task]) || !class_has_room(task)) {
+    if (class_has_room(task)) {
+      entry->copyPid = NEVER_COPY;
+    }
+    unload_compiled_task(pArgs, task);
+    return false;
+  }
+
+  const char *path = task_command_path(pArgs, task);
+  struct TaskRedirects taskRedirects = {
+      .fds = {-1, -1}, .relayed = {false, false}, .append = {false, false}};
+  speculation_prepare(pArgs, task, &taskRedirects);
+  spawn_rate_wait();
+  int lease = slot_group_acquire();
+  pid_t pid = fork();
+  if (pid == 0) {
+    speculation_enter();
+    exec_child(pArgs, task, path, &taskRedirects);
+  }
+  speculation_forked(pid);
+  redirect_forked(&taskRedirects);
+  slot_group_forked(lease, pid);
+  class_task_started(task, pid);
+  unload_compiled_task(pArgs, task);
+  if (pid < 0) {
+    speculation_output_discard(&speculation.pending);
+    entry->copyPid = NEVER_COPY;
+    return false;
+  }
+  entry->copyPid = pid;
+  entry->copyPidfd = open_pidfd(pid);
+  entry->copyOutput = speculation.pending;
+  return true;
+}
+
+// Starts copies of tasks which have run for longer than --speculate allows,
+// while there are idle slots
+// Inputs: pArgs - pointer to PArgs struct
+//         activeChildren - number of running children, updated
+//         maxChildren - job limit
+// Returns: milliseconds until another task will have run too long, or -1 if
+// none will
+int speculate_stragglers(struct PArgs *pArgs, int *activeChildren,
+                         int maxChildren) {
+  double median = speculation_median();
+  if (median < 0) {
+    return -1;
+  }
+  double limit = median * speculation.factor;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double soonest = -1;
+  for (int i = 0; i < speculation.numRunning; i++) {
+    struct SpeculativeTask *entry = &speculation.running[i];
+    if (entry->copyPid != NO_COPY) {
+      continue;
+    }
+    double runtime =
+        (double)(now.tv_sec - entry->started.tv_sec) +
+        (double)(now.tv_nsec - entry->started.tv_nsec) / NANOSECONDS_PER_SECOND;
+    if (runtime < limit) {
+      if (soonest < 0 || limit - runtime < soonest) {
+        soonest = limit - runtime;
+      }
+    } else if (*activeChildren < maxChildren &&
+               spawn_speculative_copy(pArgs, entry)) {
+      (*activeChildren)++;
+    }
+  }
+  return soonest < 0 ? -1 : (int)(soonest * MILLISECONDS_PER_SECOND) + 1;
+}
+
+// Adds the output pipes of a process under --speculate to the poll set
+// Inputs: output - the process's output
+//         numFds - number of descriptors in speculation.pollFds, updated
+void speculation_poll_output(const struct SpeculativeOutput *output,
+                             int *numFds) {
+  for (int stream = 0; stream < NUM_OUTPUT_STREAMS; stream++) {
+    if (output->fds[stream] >= 0) {
+      speculation.pollFds[(*numFds)++].fd = output->fds[stream];
+    }
+  }
+}
+
+// Waits until a child tracked by --speculate has terminated or written
+// something, or a timeout has passed, and reads what the children have written
+// Inputs: timeout - milliseconds to wait, or -1 to wait for a child
+void speculation_poll(int timeout) {
+  int numFds = 0;
+  bool fallback = false;
+  for (int i = 0; i < speculation.numRunning; i++) {
+    struct SpeculativeTask *entry = &speculation.running[i];
+    speculation.pollFds[numFds++].fd = entry->pidfd;
+    fallback |= entry->pidfd < 0;
+    speculation_poll_output(&entry->output, &numFds);
+    if (entry->copyPid > 0) {
+      speculation.pollFds[numFds++].fd = entry->copyPidfd;
+      fallback |= entry->copyPidfd < 0;
+      speculation_poll_output(&entry->copyOutput, &numFds);
+    }
+  }
+  for (int i = 0; i < speculation.numLosers; i++) {
+    speculation.pollFds[numFds++].fd = speculation.losers[i].pidfd;
+    fallback |= speculation.losers[i].pidfd < 0;
+  }
+  speculation.pollFds[numFds++].fd = speculation.signalPipe[0];
+  for (int i = 0; i < numFds; i++) {
+    speculation.pollFds[i].events = POLLIN;
+  }
+  // without pidfds we have to check our children with WNOHANG periodically
+  if (fallback && (timeout < 0 || timeout > PIDFD_FALLBACK_POLL_MS)) {
+    timeout = PIDFD_FALLBACK_POLL_MS;
+  }
+  poll(speculation.pollFds, numFds, timeout);
+  speculation_handle_signals();
+  for (int i = 0; i < speculation.numRunning; i++) {
+    speculation_output_read(&speculation.running[i].output);
+    speculation_output_read(&speculation.running[i].copyOutput);
+  }
+}
+
+// Kills the twin of a task's winning process, and whatever it started in its
+// process group, and keeps it to be reaped
+// Inputs: pid - process id of the twin, NO_COPY or NEVER_COPY if none
+//         pidfd - pidfd of the twin
+//         output - output of the twin, thrown away
+void speculation_kill_twin(pid_t pid, int pidfd,
+                           struct SpeculativeOutput *output) {
+  speculation_output_discard(output);
+  if (pid <= 0) {
+    return;
+  }
+  // the group only fails to exist if setpgid() did on both sides
+  if (kill(-pid, SIGKILL) == -1) {
+    kill(pid, SIGKILL);
+  }
+  speculation.losers[speculation.numLosers].pid = pid;
+  speculation.losers[speculation.numLosers++].pidfd = pidfd;
+}
+
+// Records a child of make_babies() reaped under --speculate. The first of a
+// task and its copy to finish is the task's result, and the other is killed.
+// Inputs: pid - process id of the child
+//         status - status returned by wait
+//         lastExitStatus - set to the task's exit status if it finished
+void speculation_reaped(pid_t pid, int status, int *lastExitStatus) {
+  for (int i = 0; i < speculation.numLosers; i++) {
+    if (speculation.losers[i].pid == pid) {
+      if (speculation.losers[i].pidfd >= 0) {
+        close(speculation.losers[i].pidfd);
+      }
+      speculation.losers[i] = speculation.losers[--speculation.numLosers];
+      return;
+    }
+  }
+
+  for (int i = 0; i < speculation.numRunning; i++) {
+    struct SpeculativeTask *entry = &speculation.running[i];
+    if (entry->pid != pid && entry->copyPid != pid) {
+      continue;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    speculation.runtimes[speculation.numRuntimes++] =
+        (double)(now.tv_sec - entry->started.tv_sec) +
+        (double)(now.tv_nsec - entry->started.tv_nsec) / NANOSECONDS_PER_SECOND;
+    if (entry->pid == pid) {
+      if (entry->pidfd >= 0) {
+        close(entry->pidfd);
+      }
+      speculation_output_forward(&entry->output);
+      speculation_kill_twin(entry->copyPid, entry->copyPidfd,
+                            &entry->copyOutput);
+    } else {
+      if (entry->copyPidfd >= 0) {
+        close(entry->copyPidfd);
+      }
+      speculation_output_forward(&entry->copyOutput);
+      speculation_kill_twin(entry->pid, entry->pidfd, &entry->output);
+    }
+    // the task was logged under its first process
+    record_task_finished(entry->pid, status, lastExitStatus);
+    *entry = speculation.running[--speculation.numRunning];
+    return;
+  }
+  record_task_finished(pid, status, lastExitStatus);
+}
+
+// Reaps a process tracked by --speculate which has terminated, if any
+// Inputs: status - set to the status returned by wait
+// Returns: pid of the reaped process, or 0 if none has terminated
+pid_t speculation_wait(int *status) {
+  for (int i = 0; i < speculation.numRunning; i++) {
+    struct SpeculativeTask *entry = &speculation.running[i];
+    pid_t pid = waitpid(entry->pid, status, WNOHANG);
+    if (pid <= 0 && entry->copyPid > 0) {
+      pid = waitpid(entry->copyPid, status, WNOHANG);
+    }
+    if (pid > 0) {
+      return pid;
+    }
+  }
+  for (int i = 0; i < speculation.numLosers; i++) {
+    pid_t pid = waitpid(speculation.losers[i].pid, status, WNOHANG);
+    if (pid > 0) {
+      return pid;
+    }
+  }
+  return 0;
+}
+
+// Reaps a child of make_babies() under --speculate, waiting at most timeout
+// for one to terminate
+// Inputs: activeChildren - number of running children, updated
+//         lastExitStatus - set to the exit status of a finished task
+//         timeout - milliseconds to wait, or -1 to wait for a child
+// Returns: true if a child was reaped
+bool reap_speculating(int *activeChildren, int *lastExitStatus, int timeout) {
+  int status;
+  pid_t pid = speculation_wait(&status);
+  if (pid == 0) {
+    speculation_poll(timeout);
+    pid = speculation_wait(&status);
+  }
+  if (pid <= 0) {
+    return false;
+  }
+  UQ_TRACE(reap, pid, status);
+  release_child(pid);
+  (*activeChildren)--;
+  speculation_reaped(pid, status, lastExitStatus);
+  return true;
+}
+
+// Frees the state of --speculate
+void stop_speculation(void) {
+  if (!speculation.enabled) {
+    return;
+  }
+  for (int i = 0; i < NUM_FORWARDED_SIGNALS; i++) {
+    sigaction(forwardedSignals[i], &speculation.oldActions[i], NULL);
+  }
+  // anything caught after the last task was reaped has nobody to go to
+  speculation.numRunning = 0;
+  speculation_handle_signals();
+  close(speculation.signalPipe[0]);
+  close(speculation.signalPipe[1]);
+  free(speculation.runtimes);
+  memset(&speculation, 0, sizeof(speculation));
+}
+
+// Executes children in parallel using fork/exec without piping
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+//         pArgs - pointer to PArgs struct
+// Returns: exit code from last child, or of the first failed task with
+// --exit-on-error
+int make_babies(const struct CLArgs *cmdLineArgs, struct PArgs *pArgs) {
+  int maxChildren = cmdLineArgs->jobLimit;
+  int activeChildren = 0;
+  int lastExitStatus = 0;
+  int failedExitStatus = 0;
+  int numStarted = 0;
+  int position = 0;
+  struct ChildTable children = {0};
+
+  uint64_t slotFreedAt = latency_now();
+  while (true) {
+    // after a failure --exit-on-error only waits for the running tasks
+    while (failedExitStatus == 0 && activeChildren < maxChildren) {
+      // a task whose class is full waits for one of its class to finish
+      int task = class_next_task(pArgs, &position);
+      if (task == NO_TASK) {
+        break;
+      }
+      pid_t pid = spawn_task(pArgs, task, slotFreedAt);
+      if (pid < 0) {
+        perror("fork");
+        return 1;
+      }
+      if (speculation.enabled) {
+        speculation_started(task, pid);
+      } else {
+        child_table_add(&children, pid, task);
+      }
+      activeChildren++;
+      numStarted++;
+    }
+
+    // every task has finished once nothing is running or left to start
+    if (activeChildren == 0) {
+      break;
+    }
+    if (!speculation.enabled) {
+      reap_child(&children, &activeChildren, &lastExitStatus, NULL);
+    } else {
+      // once every task has started, idle slots go to copies of stragglers
+      int timeout = position >= pArgs->numArgs && !class_tasks_held() &&
+                            failedExitStatus == 0
+                        ? speculate_stragglers(pArgs, &activeChildren,
+                                               maxChildren)
+                        : -1;
+      if (!reap_speculating(&activeChildren, &lastExitStatus, timeout)) {
+        continue;
+      }
+    }
+    slotFreedAt = latency_now();
+    if (cmdLineArgs->exitOnErrorPresent && lastExitStatus != 0 &&
+        failedExitStatus == 0) {
+      failedExitStatus = lastExitStatus;
+    }
+  }
+
+  free_child_table(&children);
+  if (failedExitStatus != 0) {
+    stats_tasks_cancelled(pArgs->numArgs - numStarted);
+    return failedExitStatus;
+  }
+  return lastExitStatus;
+}
+
+// Cancels every task which depends, directly or not, on a failed task
+// Inputs: graph - task dependency graph
+//         failed - index of the failed task
+//         states - TASK_* state of each task, updated
+//         stack - scratch space for one entry per task
+// Returns: number of tasks cancelled
+int cancel_dependents(const struct TaskGraph *graph, int failed, char *states,
+                      int *stack) {
+  int numCancelled = 0;
+  int size = 0;
+  stack[size++] = failed;
+  while (size > 0) {
+    int task = stack[--size];
+    for (int e = graph->firstDependent[task];
+         e < graph->firstDependent[task + 1]; e++) {
+      int dependent = graph->dependents[e];
+      if (states[dependent] == TASK_WAITING) {
+        states[dependent] = TASK_CANCELLED;
+        stack[size++] = dependent;
+        numCancelled++;
+      }
+    }
+  }
+  return numCancelled;
+}
+
+// Executes tasks as their dependencies finish, keeping ready tasks in a heap
+// so that --order still decides between them
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+//         pArgs - pointer to PArgs struct with a dependency graph
+// Returns: exit code from last child, or of the first failed task if any
+// tasks were cancelled
+int make_babies_graph(const struct CLArgs *cmdLineArgs, struct PArgs *pArgs) {
+  const struct TaskGraph *graph = pArgs->graph;
+  int numTasks = pArgs->numArgs;
+  int maxChildren = cmdLineArgs->jobLimit;
+  int activeChildren = 0;
+  int lastExitStatus = 0;
+  int failedExitStatus = 0;
+  int numCancelled = 0;
+
+  // earlier in the run order means a larger key
+  long *keys = (long *)calloc(numTasks, sizeof(long));
+  for (int i = 0; pArgs->order && i < numTasks; i++) {
+    keys[pArgs->order[i]] = numTasks - i;
+  }
+  struct TaskHeap ready = {0};
+  ready.tasks = (int *)malloc(numTasks * sizeof(int));
+  ready.keys = keys;
+  int *remaining = (int *)malloc(numTasks * sizeof(int));
+  memcpy(remaining, graph->numParents, numTasks * sizeof(int));
+  char *states = (char *)calloc(numTasks, sizeof(char));
+  int *stack = (int *)malloc(numTasks * sizeof(int));
+  struct ChildTable children = {0};
+  int *deferred = (int *)malloc(numTasks * sizeof(int));
+  for (int i = 0; i < numTasks; i++) {
+    if (remaining[i] == 0) {
+      task_heap_push(&ready, i);
+    }
+  }
+
+  uint64_t slotFreedAt = latency_now();
+  while (ready.size > 0 || activeChildren > 0) {
+    int numDeferred = 0;
+    while (ready.size > 0 && activeChildren < maxChildren) {
+      int task = task_heap_pop(&ready);
+      // a task whose class is full goes back in the heap for next time
+      if (!class_has_room(task)) {
+        deferred[numDeferred++] = task;
+        continue;
+      }
+      pid_t pid = spawn_task(pArgs, task, slotFreedAt);
+      if (pid < 0) {
+        perror("fork");
+        exit(1);
+      }
+      states[task] = TASK_STARTED;
+      child_table_add(&children, pid, task);
+      activeChildren++;
+    }
+    for (int d = 0; d < numDeferred; d++) {
+      task_heap_push(&ready, deferred[d]);
+    }
+
+    int task;
+    reap_child(&children, &activeChildren, &lastExitStatus, &task);
+    slotFreedAt = latency_now();
+
+    if (lastExitStatus != 0) {
+      if (failedExitStatus == 0) {
+        failedExitStatus = lastExitStatus;
+      }
+      numCancelled += cancel_dependents(graph, task, states, stack);
+      continue;
+    }
+    for (int e = graph->firstDependent[task];
+         e < graph->firstDependent[task + 1]; e++) {
+      int dependent = graph->dependents[e];
+      if (--remaining[dependent] == 0 && states[dependent] == TASK_WAITING) {
+        task_heap_push(&ready, dependent);
+      }
+    }
+  }
+
+  if (numCancelled > 0) {
+    stats_tasks_cancelled(numCancelled);
+    fprintf(stderr, "uqparallel: %d tasks cancelled after a dependency "
+                    "failed\n", numCancelled);
+    lastExitStatus = failedExitStatus;
+  }
+  free(keys);
+  free(ready.tasks);
+  free(remaining);
+  free(states);
+  free(stack);
+  free_child_table(&children);
+  free(deferred);
+  return lastExitStatus;
+}
+
+// Work-stealing deque of task indices owned by one dispatcher thread. Tasks
+// are only ever added before the threads start, so the owner pops from the
+// bottom and other threads steal from the top without any locking.
+struct TaskDeque {
+  int *tasks;
+  long top;
+  long bottom;
+};
+
+// State for a single dispatcher thread, which forks and reaps its own children
+struct Dispatcher {
+  struct TaskDeque deque;
+  struct DispatchPool *pool;
+  int id;
+  int maxChildren;
+  int activeChildren;
+  pid_t *pids;
+  struct pollfd *pidfds;
+  uint64_t slotFreedAt;
+};
+
+// Shared state for all dispatcher threads, aka DispatchPool. lock guards the
+// exit statuses, stopping is also read without it.
+struct DispatchPool {
+  struct PArgs *pArgs;
+  struct Dispatcher *dispatchers;
+  int numDispatchers;
+  pthread_mutex_t lock;
+  int lastExitStatus;
+  int failedExitStatus;
+  bool exitOnError;
+  bool stopping;
+  int numStarted;
+  bool forkFailed;
+};
+
+// Pops a task from the bottom of a deque, only called by the owning thread
+// Inputs: deque - deque owned by the calling thread
+// Returns: task index, or NO_TASK if the deque is empty
+int deque_pop(struct TaskDeque *deque) {
+  long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+  if (top > bottom) {
+    // deque was already empty, restore bottom
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return NO_TASK;
+  }
+
+  int task = deque->tasks[bottom];
+  if (top == bottom) {
+    // last task, race any thieves for it
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      task = NO_TASK;
+    }
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return task;
+}
+
+// Steals a task from the top of another thread's deque
+// Inputs: deque - deque to steal from
+// Returns: task index, NO_TASK if empty or STEAL_RETRY if another thread won
+int deque_steal(struct TaskDeque *deque) {
+  long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+  if (top >= bottom) {
+    return NO_TASK;
+  }
+
+  int task = deque->tasks[top];
+  if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return STEAL_RETRY;
+  }
+  return task;
+}
+
+// Finds the next task for a dispatcher, stealing once its own deque is empty
+// Inputs: dispatcher - calling dispatcher thread
+// Returns: task index, or NO_TASK if every deque is empty
+int dispatcher_next_task(struct Dispatcher *dispatcher) {
+  int task = deque_pop(&dispatcher->deque);
+  if (task != NO_TASK) {
+    return task;
+  }
+
+  struct DispatchPool *pool = dispatcher->pool;
+  bool retry = true;
+  // tasks are never added back, so once every deque is empty we are done
+  while (retry) {
+    retry = false;
+    for (int i = 1; i < pool->numDispatchers; i++) {
+      int victim = (dispatcher->id + i) % pool->numDispatchers;
+      task = deque_steal(&pool->dispatchers[victim].deque);
+      if (task >= 0) {
+        return task;
+      }
+      if (task == STEAL_RETRY) {
+        retry = true;
+      }
+    }
+  }
+  return NO_TASK;
+}
+
+// Records the exit status of a child reaped by a dispatcher thread
+// Inputs: pool - shared dispatcher state
+//         pid - process id of the child
+//         status - status returned by waitpid
+void dispatcher_record_status(struct DispatchPool *pool, pid_t pid,
+                              int status) {
+  int exitStatus = SIGNAL_EXIT_NUM;
+  if (WIFEXITED(status)) {
+    exitStatus = WEXITSTATUS(status);
+  }
+  job_log_finished(pid, NO_TASK, exitStatus,
+                   WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+  results_finished(pid, exitStatus,
+                   WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+  stats_task_finished(exitStatus);
+
+  pthread_mutex_lock(&pool->lock);
+  pool->lastExitStatus = exitStatus;
+  if (exitStatus != 0 && pool->exitOnError && !pool->stopping) {
+    // --exit-on-error, no dispatcher starts another task
+    pool->failedExitStatus = exitStatus;
+    __atomic_store_n(&pool->stopping, true, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// Waits until at least one of a dispatcher's own children has terminated and
+// reaps every child that has finished
+// Inputs: dispatcher - calling dispatcher thread
+void dispatcher_reap(struct Dispatcher *dispatcher) {
+  bool fallback = false;
+  for (int i = 0; i < dispatcher->activeChildren; i++) {
+    if (dispatcher->pidfds[i].fd < 0) {
+      fallback = true;
+    }
+  }
+
+  // without pidfds we have to check our children with WNOHANG periodically
+  int timeout = fallback ? PIDFD_FALLBACK_POLL_MS : -1;
+  int ready = poll(dispatcher->pidfds, dispatcher->activeChildren, timeout);
+  if (ready < 0) {
+    return;
+  }
+
+  int writePointer = 0;
+  for (int i = 0; i < dispatcher->activeChildren; i++) {
+    int status;
+    bool exited = false;
+    if (dispatcher->pidfds[i].fd >= 0) {
+      if (dispatcher->pidfds[i].revents & POLLIN) {
+        exited = waitpid(dispatcher->pids[i], &status, 0) > 0;
+        close(dispatcher->pidfds[i].fd);
+      }
+    } else {
+      exited = waitpid(dispatcher->pids[i], &status, WNOHANG) > 0;
+    }
+
+    if (exited) {
+      UQ_TRACE(reap, dispatcher->pids[i], status);
+      latency_reaped(dispatcher->pids[i]);
+      slot_group_release(dispatcher->pids[i]);
+      isolation_release(dispatcher->pids[i]);
+      stage_task_finished(dispatcher->pids[i]);
+      dispatcher_record_status(dispatcher->pool, dispatcher->pids[i], status);
+      continue;
+    }
+    // child still running, keep it in the table
+    dispatcher->pids[writePointer] = dispatcher->pids[i];
+    dispatcher->pidfds[writePointer++] = dispatcher->pidfds[i];
+  }
+  dispatcher->activeChildren = writePointer;
+}
+
+// Main loop of a dispatcher thread, spawns tasks up to its share of the job
+// limit and reaps its own children until no tasks are left anywhere
+// Inputs: arg - pointer to this thread's Dispatcher struct
+// Returns: NULL
+void *dispatcher_thread(void *arg) {
+  struct Dispatcher *dispatcher = (struct Dispatcher *)arg;
+  struct DispatchPool *pool = dispatcher->pool;
+  bool tasksLeft = true;
+  dispatcher->slotFreedAt = latency_now();
+
+  while (tasksLeft || dispatcher->activeChildren > 0) {
+    while (tasksLeft && dispatcher->activeChildren < dispatcher->maxChildren) {
+      int task = __atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE)
+                     ? NO_TASK
+                     : dispatcher_next_task(dispatcher);
+      if (task == NO_TASK) {
+        tasksLeft = false;
+        break;
+      }
+
+      UQ_TRACE(dispatch, dispatcher->id, task);
+      pid_t pid = spawn_task(pool->pArgs, task, dispatcher->slotFreedAt);
+      if (pid < 0) {
+        perror("fork");
+        __atomic_store_n(&pool->forkFailed, true, __ATOMIC_RELAXED);
+        tasksLeft = false;
+        break;
+      }
+      __atomic_add_fetch(&pool->numStarted, 1, __ATOMIC_RELAXED);
+      int slot = dispatcher->activeChildren++;
+      dispatcher->pids[slot] = pid;
+      dispatcher->pidfds[slot].fd = open_pidfd(pid);
+      dispatcher->pidfds[slot].events = POLLIN;
+    }
+
+    if (dispatcher->activeChildren > 0) {
+      dispatcher_reap(dispatcher);
+      dispatcher->slotFreedAt = latency_now();
+    }
+  }
+  return NULL;
+}
+
+// Executes children in parallel using several dispatcher threads, each with
+// its own task deque and share of the job limit
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+//         pArgs - pointer to PArgs struct
+// Returns: exit code from last child, or of the first failed task with
+// --exit-on-error
+int make_babies_dispatched(const struct CLArgs *cmdLineArgs,
+                           struct PArgs *pArgs) {
+  struct DispatchPool pool = {0};
+  int numChildren = pArgs->numArgs;
+
+  // every dispatcher needs at least one job slot
+  pool.pArgs = pArgs;
+  pool.exitOnError = cmdLineArgs->exitOnErrorPresent;
+  pthread_mutex_init(&pool.lock, NULL);
+  pool.numDispatchers = cmdLineArgs->numDispatchers;
+  if (pool.numDispatchers > cmdLineArgs->jobLimit) {
+    pool.numDispatchers = cmdLineArgs->jobLimit;
+    fprintf(stderr, "uqparallel: --dispatchers is limited by --joblimit, "
+                    "using %d dispatchers\n", pool.numDispatchers);
+  }
+  pool.dispatchers = calloc(pool.numDispatchers, sizeof(struct Dispatcher));
+
+  for (int i = 0; i < pool.numDispatchers; i++) {
+    struct Dispatcher *dispatcher = &pool.dispatchers[i];
+    int first = (int)((long)numChildren * i / pool.numDispatchers);
+    int last = (int)((long)numChildren * (i + 1) / pool.numDispatchers);
+
+    dispatcher->pool = &pool;
+    dispatcher->id = i;
+    dispatcher->maxChildren = cmdLineArgs->jobLimit / pool.numDispatchers +
+                              (i < cmdLineArgs->jobLimit % pool.numDispatchers);
+    dispatcher->pids = malloc(dispatcher->maxChildren * sizeof(pid_t));
+    dispatcher->pidfds =
+        malloc(dispatcher->maxChildren * sizeof(struct pollfd));
+
+    // store the block reversed so the owner pops tasks in their run order
+    dispatcher->deque.tasks = malloc((last - first + 1) * sizeof(int));
+    for (int j = last - 1; j >= first; j--) {
+      dispatcher->deque.tasks[dispatcher->deque.bottom++] = task_at(pArgs, j);
+    }
+  }
+
+  pthread_t *threads = malloc(pool.numDispatchers * sizeof(pthread_t));
+  for (int i = 0; i < pool.numDispatchers; i++) {
+    pthread_create(&threads[i], NULL, dispatcher_thread, &pool.dispatchers[i]);
+  }
+  for (int i = 0; i < pool.numDispatchers; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  for (int i = 0; i < pool.numDispatchers; i++) {
+    free(pool.dispatchers[i].deque.tasks);
+    free(pool.dispatchers[i].pids);
+    free(pool.dispatchers[i].pidfds);
+  }
+  free(threads);
+  free(pool.dispatchers);
+  pthread_mutex_destroy(&pool.lock);
+
+  if (pool.forkFailed) {
+    return 1;
+  }
+  if (pool.stopping) {
+    stats_tasks_cancelled(numChildren - pool.numStarted);
+    return pool.failedExitStatus;
+  }
+  return pool.lastExitStatus;
+}
+
+// A persistent worker process which runs tasks sent to it over a pipe
+struct ZygoteWorker {
+  pid_t pid;
+  int taskFd;
+  int statusFd;
+  int task;
+  int statusLength;
+  char statusLine[ZYGOTE_STATUS_BUFFER];
+};
+
+// Appends a string to a task line wrapped in single quotes so the worker's
+// shell treats it as exactly one word
+// Inputs: line - task line being built, must have room for the quoted arg
+//         writePointer - pointer to current end of line
+//         arg - argument to quote
+void append_shell_quoted(char *line, int *writePointer, const char *arg) {
+  line[(*writePointer)++] = '\'';
+  for (int i = 0; arg[i] != '\0'; i++) {
+    // a single quote can't appear inside single quotes, so close the quoted
+    // section, add an escaped quote and reopen it
+    if (arg[i] == '\'') {
+      memcpy(line + *writePointer, "'\\''", SHELL_QUOTE_ESCAPE_LENGTH);
+      *writePointer += SHELL_QUOTE_ESCAPE_LENGTH;
+    } else {
+      line[(*writePointer)++] = arg[i];
+    }
+  }
+  line[(*writePointer)++] = '\'';
+}
+
+// Returns the length of a string once it has been single quoted
+// Inputs: arg - argument to measure
+// Returns: number of characters append_shell_quoted() will write
+int shell_quoted_length(const char *arg) {
+  int length = 2;
+  for (int i = 0; arg[i] != '\0'; i++) {
+    length += (arg[i] == '\'') ? SHELL_QUOTE_ESCAPE_LENGTH : 1;
+  }
+  return length;
+}
+
+// Creates the line sent to a zygote worker for a task: shell quoted words,
+// followed by any redirections and a newline
+// Inputs: pArgs - pointer to PArgs struct
+//         i - index of task
+// Returns: task line, caller must free
+char *create_zygote_task_line(const struct PArgs *pArgs, int i) {
+  const char *stdoutTarget = pArgs->stdoutFiles ? pArgs->stdoutFiles[i] : NULL;
+  const char *stderrTarget = pArgs->stderrFiles ? pArgs->stderrFiles[i] : NULL;
+  int length = NULL_TERMINATOR + 1;
+
+  // work out space needed for the line before building it
+  for (int j = 0; pArgs->args[i][j]; j++) {
+    length += shell_quoted_length(pArgs->args[i][j]) + 1;
+  }
+  if (stdoutTarget) {
+    length += shell_quoted_length(stdoutTarget) + STDOUT_FILE_HEADER_LENGTH + 1;
+  }
+  if (stderrTarget) {
+    length += shell_quoted_length(stderrTarget) + STDERR_FILE_HEADER_LENGTH + 1;
+  }
+
+  char *line = malloc(length);
+  int writePointer = 0;
+  for (int j = 0; pArgs->args[i][j]; j++) {
+    if (j > 0) {
+      line[writePointer++] = ' ';
+    }
+    append_shell_quoted(line, &writePointer, pArgs->args[i][j]);
+  }
+  if (stdoutTarget) {
+    line[writePointer++] = ' ';
+    line[writePointer++] = stdoutFile;
+    append_shell_quoted(line, &writePointer, stdoutTarget);
+  }
+  if (stderrTarget) {
+    writePointer += sprintf(line + writePointer, " %s", stderrFile);
+    append_shell_quoted(line, &writePointer, stderrTarget);
+  }
+  line[writePointer++] = '\n';
+  line[writePointer] = '\0';
+
+  return line;
+}
+
+// Starts a zygote worker with tasks arriving on stdin, exit statuses
+// reported on ZYGOTE_STATUS_FD and our stdin on ZYGOTE_INPUT_FD for its tasks
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+//         worker - worker to start, updated with its pid and pipes
+// Returns: true if the worker was started
+bool start_zygote_worker(const struct CLArgs *cmdLineArgs,
+                         struct ZygoteWorker *worker) {
+  int taskPipe[2];
+  int statusPipe[2];
+  if (pipe(taskPipe) == -1) {
+    return false;
+  }
+  if (pipe(statusPipe) == -1) {
+    close(taskPipe[0]);
+    close(taskPipe[1]);
+    return false;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // kept above the pipes until they have been moved into place
+    int input = fcntl(STDIN_FILENO, F_DUPFD, ZYGOTE_INPUT_FD + 1);
+
+    // the status pipe may already be on ZYGOTE_STATUS_FD, so move the task
+    // pipe first and only close ends which weren't dup'd onto themselves
+    close(taskPipe[1]);
+    close(statusPipe[0]);
+    dup2(taskPipe[0], STDIN_FILENO);
+    dup2(statusPipe[1], ZYGOTE_STATUS_FD);
+    if (taskPipe[0] != STDIN_FILENO && taskPipe[0] != ZYGOTE_STATUS_FD) {
+      close(taskPipe[0]);
+    }
+    if (statusPipe[1] != ZYGOTE_STATUS_FD) {
+      close(statusPipe[1]);
+    }
+    if (input < 0) {
+      input = open("/dev/null", O_RDONLY);
+    }
+    dup2(input, ZYGOTE_INPUT_FD);
+    close(input);
+    // the shell can't undo a SIGPIPE ignored on entry, and its tasks would
+    // inherit it
+    signal(SIGPIPE, SIG_DFL);
+
+    const char *script = cmdLineArgs->zygoteWorker ? cmdLineArgs->zygoteWorker
+                                                   : zygoteShellScript;
+    execl("/bin/sh", "sh", "-c", script, (char *)NULL);
+    fprintf(stderr, "uqparallel: cannot execute \"/bin/sh\"\n");
+    raise(SIGUSR1);
+    exit(SIGNAL_EXIT_NUM);
+  }
+
+  close(taskPipe[0]);
+  close(statusPipe[1]);
+  if (pid < 0) {
+    close(taskPipe[1]);
+    close(statusPipe[0]);
+    return false;
+  }
+
+  // the parent must not hand its end of one worker's pipes to the others
+  fcntl(taskPipe[1], F_SETFD, FD_CLOEXEC);
+  fcntl(statusPipe[0], F_SETFD, FD_CLOEXEC);
+  worker->pid = pid;
+  worker->taskFd = taskPipe[1];
+  worker->statusFd = statusPipe[0];
+  worker->task = NO_TASK;
+  worker->statusLength = 0;
+  return true;
+}
+
+// Closes a zygote worker's pipes and reaps it
+// Inputs: worker - worker to stop
+void stop_zygote_worker(struct ZygoteWorker *worker) {
+  // closing the task pipe gives the worker EOF, which makes it exit
+  close(worker->taskFd);
+  close(worker->statusFd);
+  waitpid(worker->pid, NULL, 0);
+}
+
+// Reads exit status output from a busy worker
+// Inputs: worker - busy worker whose status pipe is readable
+//         lastExitStatus - pointer to last exit status
+// Returns: true if the worker's task has finished and the worker is usable
+bool read_zygote_status(struct ZygoteWorker *worker, int *lastExitStatus) {
+  int space = ZYGOTE_STATUS_BUFFER - 1 - worker->statusLength;
+  ssize_t numRead =
+      read(worker->statusFd, worker->statusLine + worker->statusLength, space);
+
+  if (numRead <= 0) {
+    // worker died part way through a task, count the task as killed
+    *lastExitStatus = SIGNAL_EXIT_NUM;
+    stats_task_finished(*lastExitStatus);
+    job_log_finished(worker->pid, worker->task, *lastExitStatus, 0);
+    worker->task = NO_TASK;
+    return false;
+  }
+
+  worker->statusLength += (int)numRead;
+  worker->statusLine[worker->statusLength] = '\0';
+  if (!strchr(worker->statusLine, '\n')) {
+    return true;
+  }
+
+  // killed tasks count as SIGNAL_EXIT_NUM, as they do when forked directly
+  int signalNumber = 0;
+  if (strncmp(worker->statusLine, ZYGOTE_SIGNAL_PREFIX,
+              strlen(ZYGOTE_SIGNAL_PREFIX)) == 0) {
+    signalNumber = atoi(worker->statusLine + strlen(ZYGOTE_SIGNAL_PREFIX));
+    *lastExitStatus = SIGNAL_EXIT_NUM;
+  } else {
+    *lastExitStatus = atoi(worker->statusLine);
+  }
+  stats_task_finished(*lastExitStatus);
+  job_log_finished(worker->pid, worker->task, *lastExitStatus, signalNumber);
+  worker->statusLength = 0;
+  worker->task = NO_TASK;
+  return true;
+}
+
+// Waits for at least one busy zygote worker to finish its task, replacing any
+// workers which have died
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+//         workers - array of workers
+//         numWorkers - number of workers
+//         lastExitStatus - pointer to last exit status
+// Returns: false if a dead worker couldn't be replaced
+bool wait_zygote_workers(const struct CLArgs *cmdLineArgs,
+                         struct ZygoteWorker *workers, int numWorkers,
+                         int *lastExitStatus) {
+  struct pollfd pollFds[numWorkers];
+  for (int i = 0; i < numWorkers; i++) {
+    // poll ignores negative fds, so idle workers are skipped
+    pollFds[i].fd = workers[i].task == NO_TASK ? -1 : workers[i].statusFd;
+    pollFds[i].events = POLLIN;
+  }
+
+  if (poll(pollFds, numWorkers, -1) < 0) {
+    return true;
+  }
+
+  for (int i = 0; i < numWorkers; i++) {
+    if (!(pollFds[i].revents & (POLLIN | POLLHUP))) {
+      continue;
+    }
+    if (!read_zygote_status(&workers[i], lastExitStatus)) {
+      stop_zygote_worker(&workers[i]);
+      if (!start_zygote_worker(cmdLineArgs, &workers[i])) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Executes tasks on a pool of persistent workers instead of fork/exec per task
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+//         pArgs - pointer to PArgs struct
+// Returns: exit code from last task
+int make_zygote_babies(const struct CLArgs *cmdLineArgs,
+                       struct PArgs *pArgs) {
+  int numTasks = pArgs->numArgs;
+  int numWorkers = cmdLineArgs->jobLimit < numTasks ? cmdLineArgs->jobLimit
+                                                    : numTasks;
+  int lastExitStatus = 0;
+  struct ZygoteWorker *workers =
+      calloc(numWorkers, sizeof(struct ZygoteWorker));
+
+  // a worker which dies mid-task shouldn't kill us when we write to it
+  signal(SIGPIPE, SIG_IGN);
+
+  for (int i = 0; i < numWorkers; i++) {
+    if (!start_zygote_worker(cmdLineArgs, &workers[i])) {
+      perror("fork");
+      exit(1);
+    }
+  }
+
+  int next = 0;
+  int busyWorkers = 0;
+  bool workersOk = true;
+  while (workersOk && (next < numTasks || busyWorkers > 0)) {
+    // hand out tasks to every idle worker
+    for (int i = 0; i < numWorkers && next < numTasks; i++) {
+      if (workers[i].task != NO_TASK) {
+        continue;
+      }
+      int task = task_at(pArgs, next++);
+      load_compiled_task(pArgs, task);
+      if (!pArgs->args[task] || !pArgs->args[task][0]) {
+        fprintf(stderr, "uqparallel: unable to execute empty command\n");
+        lastExitStatus = EMPTY_COMMAND_EXIT_NUM;
+        stats_task_started();
+        stats_task_finished(lastExitStatus);
+        unload_compiled_task(pArgs, task);
+        continue;
+      }
+      // if the worker has died the write fails, and the closed status pipe
+      // reports the task as killed when we next wait
+      char *line = create_zygote_task_line(pArgs, task);
+      job_log_started(pArgs, task, workers[i].pid);
+      unload_compiled_task(pArgs, task);
+      stats_task_started();
+      workers[i].task = task;
+      if (write(workers[i].taskFd, line, strlen(line)) < 0 &&
+          errno != EPIPE) {
+        perror("write");
+      }
+      free(line);
+    }
+
+    busyWorkers = 0;
+    for (int i = 0; i < numWorkers; i++) {
+      busyWorkers += workers[i].task != NO_TASK;
+    }
+    if (busyWorkers > 0) {
+      workersOk = wait_zygote_workers(cmdLineArgs, workers, numWorkers,
+                                      &lastExitStatus);
+    }
+  }
+
+  for (int i = 0; i < numWorkers; i++) {
+    stop_zygote_worker(&workers[i]);
+  }
+  free(workers);
+
+  if (!workersOk) {
+    perror("fork");
+    return 1;
+  }
+  return lastExitStatus;
+}
+
+// Growable buffer which splits a socket's byte stream into frames. Each frame
+// is a uint32 length (in host byte order, workers are always local), a type
+// byte and a type specific payload.
+struct FrameBuffer {
+  char *data;
+  size_t length;
+  size_t capacity;
+};
+
+// A task run by a --serve daemon on behalf of its client
+struct RemoteTask {
+  uint32_t id;
+  int client;
+  pid_t pid;
+  int pidfd;
+  int outputFds[NUM_OUTPUT_STREAMS];
+};
+
+// A --workers client connected to a --serve daemon. Its slot is reused once
+// it has disconnected and none of its tasks are still running.
+struct ServeClient {
+  bool inUse;
+  int conn;
+  struct FrameBuffer buffer;
+  int numRunning;
+};
+
+// A --serve daemon that a --workers client sends tasks to
+struct RemoteWorker {
+  int fd;
+  bool connected;
+  int credits;
+  struct FrameBuffer buffer;
+  int *outstanding;
+  int numOutstanding;
+};
+
+// Creates a socket for a worker address, either a Unix socket path or
+// host:port for TCP
+// Inputs: address - socket address given on the command line
+//         listening - true to bind and listen, false to connect
+// Returns: socket fd, or -1 on error
+int open_socket_address(const char *address, bool listening) {
+  const char *colon = strrchr(address, ':');
+
+  // anything with a port and no path separator is a TCP address
+  if (colon && !strchr(address, '/')) {
+    char *host = strndup(address, colon - address);
+    struct addrinfo hints = {0};
+    struct addrinfo *result;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int error = getaddrinfo(host, colon + 1, &hints, &result);
+    free(host);
+    if (error != 0) {
+      return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    bool ok = listening ? (bind(fd, result->ai_addr, result->ai_addrlen) == 0 &&
+                           listen(fd, SOMAXCONN) == 0)
+                        : connect(fd, result->ai_addr, result->ai_addrlen) == 0;
+    freeaddrinfo(result);
+    if (!ok) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  struct sockaddr_un unixAddress = {0};
+  unixAddress.sun_family = AF_UNIX;
+  if (strlen(address) >= sizeof(unixAddress.sun_path)) {
+    return -1;
   }
-  // if child isn't last, open stdout for next child to read
-  if (i < numChildren - 1) {
-    dup2(pipes[i][1], STDOUT_FILENO);
+  strcpy(unixAddress.sun_path, address);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  bool ok;
+  if (listening) {
+    // remove a socket left behind by a previous daemon
+    unlink(address);
+    ok = bind(fd, (struct sockaddr *)&unixAddress, sizeof(unixAddress)) == 0 &&
+         listen(fd, SOMAXCONN) == 0;
+  } else {
+    ok = connect(fd, (struct sockaddr *)&unixAddress, sizeof(unixAddress)) == 0;
+  }
+  if (!ok) {
+    close(fd);
+    return -1;
   }
+  return fd;
+}
 
-  for (int j = 0; j < numChildren - 1; j++) {
-    close(pipes[j][0]);
-    close(pipes[j][1]);
+// Sends a frame made up of a fixed header and a variable length body
+// Inputs: fd - socket to send the frame on
+//         type - FRAME_* type of the frame
+//         header - fixed size part of the payload
+//         headerLength - size of header
+//         body - variable size part of the payload, may be NULL
+//         bodyLength - size of body
+// Returns: true if the frame was sent
+bool send_frame(int fd, uint8_t type, const void *header, size_t headerLength,
+                const void *body, size_t bodyLength) {
+  uint32_t frameLength =
+      (uint32_t)(FRAME_PREFIX_LENGTH + headerLength + bodyLength);
+  char *frame = malloc(frameLength);
+
+  memcpy(frame, &frameLength, sizeof(frameLength));
+  frame[sizeof(frameLength)] = (char)type;
+  memcpy(frame + FRAME_PREFIX_LENGTH, header, headerLength);
+  if (bodyLength > 0) {
+    memcpy(frame + FRAME_PREFIX_LENGTH + headerLength, body, bodyLength);
   }
 
-  if (!pArgs->args[i] || !pArgs->args[i][0]) {
-    fprintf(stderr, "uqparallel: unable to execute empty command\n");
-    exit(EMPTY_COMMAND_EXIT_NUM);
+  bool sent = send_all(fd, frame, frameLength);
+  free(frame);
+  return sent;
+}
+
+// Reads whatever is available on a socket into a frame buffer
+// Inputs: fd - socket to read from
+//         buffer - buffer to append to
+// Returns: false on EOF or error
+bool fill_frame_buffer(int fd, struct FrameBuffer *buffer) {
+  if (buffer->capacity - buffer->length < FRAME_READ_SIZE) {
+    buffer->capacity = buffer->length + FRAME_READ_SIZE * 2;
+    buffer->data = realloc(buffer->data, buffer->capacity);
   }
 
-  execvp(pArgs->args[i][0], pArgs->args[i]);
-  fprintf(stderr, "uqparallel: cannot execute \"%s\"\n", pArgs->args[i][0]);
-  raise(SIGUSR1);
-  exit(SIGNAL_EXIT_NUM);
+  ssize_t numRead = read(fd, buffer->data + buffer->length,
+                         buffer->capacity - buffer->length);
+  if (numRead < 0 && errno == EINTR) {
+    return true;
+  }
+  if (numRead <= 0) {
+    return false;
+  }
+  buffer->length += numRead;
+  return true;
 }
 
-// Waits for and processes a child process termination
-// Inputs: activeChildren - pointer to active child count
-//         lastExitStatus - pointer to last exit status
-void reap_child(int *activeChildren, int *lastExitStatus) {
+// Returns the size of the first frame in a buffer if it has fully arrived
+// Inputs: buffer - frame buffer to check
+// Returns: frame size including its prefix, or 0 if it is incomplete
+uint32_t complete_frame_size(const struct FrameBuffer *buffer) {
+  uint32_t frameLength;
+  if (buffer->length < FRAME_PREFIX_LENGTH) {
+    return 0;
+  }
+  memcpy(&frameLength, buffer->data, sizeof(frameLength));
+  if (frameLength < FRAME_PREFIX_LENGTH || buffer->length < frameLength) {
+    return 0;
+  }
+  return frameLength;
+}
+
+// Removes the first frame from a buffer
+// Inputs: buffer - frame buffer
+//         frameLength - size of the first frame
+void consume_frame(struct FrameBuffer *buffer, uint32_t frameLength) {
+  buffer->length -= frameLength;
+  memmove(buffer->data, buffer->data + frameLength, buffer->length);
+}
+
+// Serializes a task as a FRAME_TASK body: argc followed by each argument, then
+// the stdout and stderr targets, all NUL terminated (empty if not redirected)
+// Inputs: pArgs - pointer to PArgs struct
+//         i - index of task
+//         length - set to the size of the returned body
+// Returns: serialized task, caller must free
+char *serialize_task(const struct PArgs *pArgs, int i, size_t *length) {
+  const char *stdoutTarget = pArgs->stdoutFiles ? pArgs->stdoutFiles[i] : NULL;
+  const char *stderrTarget = pArgs->stderrFiles ? pArgs->stderrFiles[i] : NULL;
+  uint32_t argc = 0;
+  size_t size = sizeof(argc) + NULL_TERMINATOR * 2;
+
+  for (; pArgs->args[i] && pArgs->args[i][argc]; argc++) {
+    size += strlen(pArgs->args[i][argc]) + NULL_TERMINATOR;
+  }
+  size += stdoutTarget ? strlen(stdoutTarget) : 0;
+  size += stderrTarget ? strlen(stderrTarget) : 0;
+
+  char *body = malloc(size);
+  size_t writePointer = sizeof(argc);
+  memcpy(body, &argc, sizeof(argc));
+  for (uint32_t j = 0; j < argc; j++) {
+    strcpy(body + writePointer, pArgs->args[i][j]);
+    writePointer += strlen(pArgs->args[i][j]) + NULL_TERMINATOR;
+  }
+  strcpy(body + writePointer, stdoutTarget ? stdoutTarget : "");
+  writePointer += strlen(body + writePointer) + NULL_TERMINATOR;
+  strcpy(body + writePointer, stderrTarget ? stderrTarget : "");
+
+  *length = size;
+  return body;
+}
+
+// Checks that a FRAME_TASK payload holds an id, a non-zero argc and that many
+// arguments plus two targets, each NUL terminated inside the payload
+// Inputs: payload - FRAME_TASK payload
+//         length - size of the payload
+// Returns: true if start_remote_task() can safely parse the payload
+bool valid_task_payload(const char *payload, size_t length) {
+  uint32_t argc;
+  size_t position = sizeof(uint32_t) + sizeof(argc);
+  if (length < position) {
+    return false;
+  }
+  memcpy(&argc, payload + sizeof(uint32_t), sizeof(argc));
+  // every string takes at least its terminator, which bounds argc
+  if (argc == 0 || argc > length - position) {
+    return false;
+  }
+  for (uint32_t j = 0; j < argc + NUM_OUTPUT_STREAMS; j++) {
+    const char *end = memchr(payload + position, '\0', length - position);
+    if (!end) {
+      return false;
+    }
+    position = (size_t)(end - payload) + NULL_TERMINATOR;
+  }
+  return true;
+}
+
+// Starts a task received from a --workers client, capturing its output unless
+// the task redirects it to a file
+// Inputs: payload - FRAME_TASK payload, id followed by a serialized task,
+//                   checked by valid_task_payload()
+//         task - filled in with the running task
+// Returns: true if the task was started
+bool start_remote_task(char *payload, struct RemoteTask *task) {
+  uint32_t argc;
+  memcpy(&task->id, payload, sizeof(task->id));
+  memcpy(&argc, payload + sizeof(task->id), sizeof(argc));
+
+  // build an argv which points into the payload
+  char **argv = malloc((argc + NULL_TERMINATOR) * sizeof(char *));
+  char *position = payload + sizeof(task->id) + sizeof(argc);
+  for (uint32_t j = 0; j < argc; j++) {
+    argv[j] = position;
+    position += strlen(position) + NULL_TERMINATOR;
+  }
+  argv[argc] = NULL;
+  char *targets[NUM_OUTPUT_STREAMS];
+  targets[0] = position;
+  targets[1] = position + strlen(position) + NULL_TERMINATOR;
+
+  int pipes[NUM_OUTPUT_STREAMS][2];
+  for (int stream = 0; stream < NUM_OUTPUT_STREAMS; stream++) {
+    pipes[stream][0] = -1;
+    pipes[stream][1] = -1;
+    if (targets[stream][0] != '\0') {
+      continue;
+    }
+    targets[stream] = NULL;
+    if (pipe2(pipes[stream], O_CLOEXEC) == -1) {
+      free((void *)argv);
+      return false;
+    }
+    fcntl(pipes[stream][0], F_SETFL, O_NONBLOCK);
+  }
+
+  // exec_child() handles redirects and errors the same way as a local task
+  struct PArgs taskArgs = {0};
+  taskArgs.args = &argv;
+  taskArgs.numArgs = 1;
+  taskArgs.stdoutFiles = &targets[0];
+  taskArgs.stderrFiles = &targets[1];
+
+  const char *path = resolve_command(argv[0]);
+  task->pid = fork();
+  if (task->pid == 0) {
+    for (int stream = 0; stream < NUM_OUTPUT_STREAMS; stream++) {
+      if (pipes[stream][1] >= 0) {
+        dup2(pipes[stream][1], stream == 0 ? STDOUT_FILENO : STDERR_FILENO);
+      }
+    }
+    exec_child(&taskArgs, 0, path, NULL);
+  }
+
+  free((void *)argv);
+  for (int stream = 0; stream < NUM_OUTPUT_STREAMS; stream++) {
+    if (pipes[stream][1] >= 0) {
+      close(pipes[stream][1]);
+    }
+    task->outputFds[stream] = pipes[stream][0];
+  }
+  if (task->pid < 0) {
+    perror("fork");
+    return false;
+  }
+  task->pidfd = open_pidfd(task->pid);
+  return true;
+}
+
+// Forwards any available output from a remote task to its client
+// Inputs: conn - client connection, or -1 if the client has gone
+//         task - running task
+//         stream - index of the output stream to read
+void forward_remote_output(int conn, struct RemoteTask *task, int stream) {
+  char data[FRAME_READ_SIZE];
+  uint8_t header[sizeof(uint32_t) + 1];
+  memcpy(header, &task->id, sizeof(task->id));
+  header[sizeof(task->id)] = (uint8_t)(stream + 1);
+
+  // read until the pipe is empty so nothing is lost once the task exits
+  while (task->outputFds[stream] >= 0) {
+    ssize_t numRead = read(task->outputFds[stream], data, sizeof(data));
+    if (numRead < 0 && (errno == EAGAIN || errno == EINTR)) {
+      return;
+    }
+    if (numRead <= 0) {
+      close(task->outputFds[stream]);
+      task->outputFds[stream] = -1;
+      return;
+    }
+    if (conn >= 0) {
+      send_frame(conn, FRAME_OUTPUT, header, sizeof(header), data, numRead);
+    }
+  }
+}
+
+// Reports a task's exit status to the client
+// Inputs: conn - client connection, or -1 if the client has gone
+//         id - id of the task given by the client
+//         exitStatus - exit status of the task
+void send_remote_result(int conn, uint32_t id, int32_t exitStatus) {
+  if (conn < 0) {
+    return;
+  }
+  uint8_t result[sizeof(id) + sizeof(exitStatus)];
+  memcpy(result, &id, sizeof(id));
+  memcpy(result + sizeof(id), &exitStatus, sizeof(exitStatus));
+  send_frame(conn, FRAME_RESULT, result, sizeof(result), NULL, 0);
+}
+
+// Reaps a finished remote task and reports its exit status to the client
+// Inputs: conn - client connection, or -1 if the client has gone
+//         task - finished task
+void finish_remote_task(int conn, struct RemoteTask *task) {
   int status;
-  wait(&status);
-  (*activeChildren)--;
+  waitpid(task->pid, &status, 0);
+  for (int stream = 0; stream < NUM_OUTPUT_STREAMS; stream++) {
+    forward_remote_output(conn, task, stream);
+    if (task->outputFds[stream] >= 0) {
+      close(task->outputFds[stream]);
+    }
+  }
+  if (task->pidfd >= 0) {
+    close(task->pidfd);
+  }
+
+  int32_t exitStatus = SIGNAL_EXIT_NUM;
   if (WIFEXITED(status)) {
-    *lastExitStatus = WEXITSTATUS(status);
-  } else {
-    *lastExitStatus = SIGNAL_EXIT_NUM;
+    exitStatus = WEXITSTATUS(status);
   }
+  send_remote_result(conn, task->id, exitStatus);
 }
 
-// Executes children in parallel using pipes
-// Inputs: cmdLineArgs - pointer to CLArgs struct
-//         pArgs - pointer to PArgs struct
-// Returns: exit code from last child
-int make_pipe_babies(const struct CLArgs *cmdLineArgs, struct PArgs *pArgs) {
-  int numChildren = pArgs->numArgs;
-  int maxChildren = cmdLineArgs->jobLimit;
-  int activeChildren = 0;
-  int lastExitStatus = 0;
+// Accepts a new client and greets it with its number of credits
+// Inputs: listenFd - listening socket
+//         clients - client slots, grown if they are all in use
+//         numClients - number of client slots, updated
+//         maxTasks - number of tasks which may run at once
+void accept_serve_client(int listenFd, struct ServeClient **clients,
+                         int *numClients, int maxTasks) {
+  int conn = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+  if (conn < 0) {
+    return;
+  }
+  // each client is given one credit per job slot, extra tasks queue here
+  uint32_t jobLimitValue = (uint32_t)maxTasks;
+  if (!send_frame(conn, FRAME_HELLO, &jobLimitValue, sizeof(jobLimitValue),
+                  NULL, 0)) {
+    close(conn);
+    return;
+  }
 
-  // pipe() opens read and write ends of pipes
-  int pipes[numChildren - 1][2];
-  for (int i = 0; i < numChildren - 1; i++) {
-    if (pipe(pipes[i]) == -1) {
-      perror("pipe");
-      exit(1);
+  int slot = 0;
+  while (slot < *numClients && (*clients)[slot].inUse) {
+    slot++;
+  }
+  if (slot == *numClients) {
+    (*numClients)++;
+    *clients = (struct ServeClient *)realloc(
+        *clients, *numClients * sizeof(struct ServeClient));
+  }
+  memset(&(*clients)[slot], 0, sizeof(struct ServeClient));
+  (*clients)[slot].inUse = true;
+  (*clients)[slot].conn = conn;
+}
+
+// Starts the next task a client has sent, if it has sent a whole one
+// Inputs: clients - client slots
+//         index - slot of the client
+//         task - filled in with the started task
+// Returns: true if a frame was taken from the client's buffer
+bool start_serve_client_task(struct ServeClient *clients, int index,
+                             struct RemoteTask *task) {
+  struct ServeClient *client = &clients[index];
+  uint32_t frameLength = client->conn >= 0
+                             ? complete_frame_size(&client->buffer)
+                             : 0;
+  if (frameLength == 0) {
+    return false;
+  }
+  char *payload = client->buffer.data + FRAME_PREFIX_LENGTH;
+  if (client->buffer.data[sizeof(uint32_t)] == FRAME_TASK &&
+      !valid_task_payload(payload, frameLength - FRAME_PREFIX_LENGTH)) {
+    // a client sending malformed tasks is dropped like one which has gone
+    close(client->conn);
+    client->conn = -1;
+    task->pid = -1;
+  } else if (client->buffer.data[sizeof(uint32_t)] == FRAME_TASK) {
+    // a task which can't be started still gets a result
+    if (start_remote_task(payload, task)) {
+      task->client = index;
+      client->numRunning++;
+    } else {
+      send_remote_result(client->conn, task->id, SIGNAL_EXIT_NUM);
+      task->pid = -1;
     }
+  } else {
+    task->pid = -1;
   }
-  for (int i = 0; i < numChildren; i++) {
-    while (activeChildren >= maxChildren) {
-      int status;
-      wait(&status);
-      activeChildren--;
-      if (WIFEXITED(status)) {
-        lastExitStatus = WEXITSTATUS(status);
+  consume_frame(&client->buffer, frameLength);
+  return true;
+}
+
+// Runs tasks for every connected client, sharing the daemon's job slots
+// between them. Clients take turns to start tasks, so one with a long queue
+// doesn't hold up short batches sent by others.
+// Inputs: listenFd - listening socket
+//         maxTasks - number of tasks which may run at once
+void serve_clients(int listenFd, int maxTasks) {
+  struct RemoteTask *running = calloc(maxTasks, sizeof(struct RemoteTask));
+  struct ServeClient *clients = NULL;
+  struct pollfd *pollFds = NULL;
+  int numClients = 0;
+  int numRunning = 0;
+  int nextClient = 0;
+
+  while (true) {
+    bool fallback = false;
+    pollFds = (struct pollfd *)realloc(
+        pollFds, (1 + numClients + maxTasks * POLLFDS_PER_REMOTE_TASK) *
+                     sizeof(struct pollfd));
+    pollFds[0].fd = listenFd;
+    for (int c = 0; c < numClients; c++) {
+      pollFds[1 + c].fd = clients[c].inUse ? clients[c].conn : -1;
+    }
+    struct pollfd *taskPollFds = pollFds + 1 + numClients;
+    for (int i = 0; i < numRunning; i++) {
+      struct pollfd *taskFds = &taskPollFds[i * POLLFDS_PER_REMOTE_TASK];
+      taskFds[0].fd = running[i].outputFds[0];
+      taskFds[1].fd = running[i].outputFds[1];
+      taskFds[2].fd = running[i].pidfd;
+      fallback = fallback || running[i].pidfd < 0;
+    }
+    int numPollFds = 1 + numClients + numRunning * POLLFDS_PER_REMOTE_TASK;
+    for (int i = 0; i < numPollFds; i++) {
+      pollFds[i].events = POLLIN;
+      pollFds[i].revents = 0;
+    }
+
+    int timeout = fallback ? PIDFD_FALLBACK_POLL_MS : -1;
+    if (poll(pollFds, numPollFds, timeout) < 0) {
+      continue;
+    }
+
+    // forward output and reap any tasks which have finished
+    int writePointer = 0;
+    for (int i = 0; i < numRunning; i++) {
+      struct pollfd *taskFds = &taskPollFds[i * POLLFDS_PER_REMOTE_TASK];
+      struct ServeClient *client = &clients[running[i].client];
+      for (int stream = 0; stream < NUM_OUTPUT_STREAMS; stream++) {
+        if (taskFds[stream].revents) {
+          forward_remote_output(client->conn, &running[i], stream);
+        }
+      }
+      bool exited = (taskFds[2].revents & POLLIN) != 0;
+      if (running[i].pidfd < 0) {
+        // peek at the child without reaping it so finish_remote_task() can
+        siginfo_t info = {0};
+        waitid(P_PID, running[i].pid, &info, WEXITED | WNOHANG | WNOWAIT);
+        exited = info.si_pid != 0;
+      }
+      if (exited) {
+        finish_remote_task(client->conn, &running[i]);
+        client->numRunning--;
+        continue;
+      }
+      running[writePointer++] = running[i];
+    }
+    numRunning = writePointer;
+
+    // read what clients have sent, and drop the queue of any which has gone
+    for (int c = 0; c < numClients; c++) {
+      struct ServeClient *client = &clients[c];
+      if (client->inUse && client->conn >= 0 && pollFds[1 + c].revents &&
+          !fill_frame_buffer(client->conn, &client->buffer)) {
+        close(client->conn);
+        client->conn = -1;
+      }
+      if (client->inUse && client->conn < 0 && client->numRunning == 0) {
+        free(client->buffer.data);
+        client->inUse = false;
+      }
+    }
+
+    // clients take turns, one task each, until the slots are full
+    int idle = 0;
+    while (numRunning < maxTasks && idle < numClients) {
+      int c = nextClient;
+      nextClient = (nextClient + 1) % numClients;
+      if (clients[c].inUse &&
+          start_serve_client_task(clients, c, &running[numRunning])) {
+        idle = 0;
+        if (running[numRunning].pid > 0) {
+          numRunning++;
+        }
       } else {
-        lastExitStatus = SIGNAL_EXIT_NUM;
+        idle++;
       }
     }
-    pid_t pid = fork();
-    if (pid == 0) {
-      exec_pipe_child(pArgs, i, numChildren, pipes);
-    } else if (pid > 0) {
-      activeChildren++;
-    } else {
-      perror("fork");
-      return 1;
+
+    if (pollFds[0].revents) {
+      accept_serve_client(listenFd, &clients, &numClients, maxTasks);
     }
   }
-  // Close unused pipe fds in parent
-  for (int i = 0; i < numChildren - 1; i++) {
-    close(pipes[i][0]);
-    close(pipes[i][1]);
+}
+
+// Runs as a daemon, executing tasks sent by any number of --workers clients
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+// Returns: exit code, only on error
+int serve_tasks(const struct CLArgs *cmdLineArgs) {
+  int listenFd = open_socket_address(cmdLineArgs->serveAddress, true);
+  if (listenFd < 0) {
+    fprintf(stderr, "uqparallel: cannot listen on \"%s\"\n",
+            cmdLineArgs->serveAddress);
+    return WORKER_ERROR_EXIT_NUM;
   }
-  // Reap remaining children
-  while (activeChildren-- > 0) {
-    reap_child(&activeChildren, &lastExitStatus);
+  serve_clients(listenFd, cmdLineArgs->jobLimit);
+  return 0;
+}
+
+// Connects to a --serve daemon and waits for its greeting
+// Inputs: address - address of the daemon
+//         worker - worker to fill in
+// Returns: true if connected
+bool connect_remote_worker(const char *address, struct RemoteWorker *worker) {
+  worker->fd = open_socket_address(address, false);
+  if (worker->fd < 0) {
+    return false;
   }
 
-  return lastExitStatus;
+  uint32_t frameLength;
+  while ((frameLength = complete_frame_size(&worker->buffer)) == 0) {
+    if (!fill_frame_buffer(worker->fd, &worker->buffer)) {
+      close(worker->fd);
+      return false;
+    }
+  }
+
+  // the greeting holds the daemon's job limit, which is our credit
+  uint32_t jobLimitValue;
+  if (frameLength < FRAME_PREFIX_LENGTH + sizeof(jobLimitValue)) {
+    close(worker->fd);
+    return false;
+  }
+  memcpy(&jobLimitValue, worker->buffer.data + FRAME_PREFIX_LENGTH,
+         sizeof(jobLimitValue));
+  consume_frame(&worker->buffer, frameLength);
+  worker->connected = true;
+  worker->credits = (int)jobLimitValue;
+  worker->outstanding = malloc(worker->credits * sizeof(int));
+  return true;
 }
 
-// Executes a single child without pipes
-// Inputs: pArgs - pointer to PArgs struct
-//         i - index of command to execute
-void exec_child(const struct PArgs *pArgs, int i) {
-  if (!pArgs->args[i] || !pArgs->args[i][0]) {
-    fprintf(stderr, "uqparallel: unable to execute empty command\n");
-    exit(EMPTY_COMMAND_EXIT_NUM);
+// Handles a frame received from a --serve daemon
+// Inputs: worker - worker the frame came from
+//         frame - complete frame
+//         frameLength - size of the frame
+//         lastExitStatus - pointer to last exit status
+// Returns: true if the frame completed a task
+bool handle_remote_frame(struct RemoteWorker *worker, const char *frame,
+                         uint32_t frameLength, int *lastExitStatus) {
+  const char *payload = frame + FRAME_PREFIX_LENGTH;
+  uint32_t id;
+  int32_t exitStatus;
+  // output frames hold an id and stream number, results an id and status
+  if (frameLength < FRAME_PREFIX_LENGTH + sizeof(id) + 1 ||
+      (frame[sizeof(uint32_t)] == FRAME_RESULT &&
+       frameLength < FRAME_PREFIX_LENGTH + sizeof(id) + sizeof(exitStatus))) {
+    return false;
   }
+  memcpy(&id, payload, sizeof(id));
 
-  // Redirect stdout if needed
-  if (pArgs->stdoutFiles && pArgs->stdoutFiles[i]) {
-    int fd = open(pArgs->stdoutFiles[i], O_WRONLY | O_CREAT | O_TRUNC,
-                  READ_WRITE_PERMISSIONS);
-    if (fd < 0) {
-      fprintf(stderr, "uqparallel: cannot write to \"%s\"\n",
-              pArgs->stdoutFiles[i]);
-      raise(SIGUSR1);
-      exit(SIGNAL_EXIT_NUM);
+  if (frame[sizeof(uint32_t)] == FRAME_OUTPUT) {
+    int fd = payload[sizeof(id)] == 1 ? STDOUT_FILENO : STDERR_FILENO;
+    size_t headerLength = FRAME_PREFIX_LENGTH + sizeof(id) + 1;
+    write_all(fd, frame + headerLength, frameLength - headerLength);
+    return false;
+  }
+  if (frame[sizeof(uint32_t)] != FRAME_RESULT) {
+    return false;
+  }
+
+  memcpy(&exitStatus, payload + sizeof(id), sizeof(exitStatus));
+  *lastExitStatus = exitStatus;
+  stats_task_finished(exitStatus);
+  job_log_finished(0, (int)id, exitStatus, 0);
+  worker->credits++;
+  for (int i = 0; i < worker->numOutstanding; i++) {
+    if (worker->outstanding[i] == (int)id) {
+      worker->outstanding[i] = worker->outstanding[--worker->numOutstanding];
+      break;
     }
-    dup2(fd, STDOUT_FILENO);
-    close(fd);
   }
+  return true;
+}
+
+// Sends a task to a worker, using up one of its credits
+// Inputs: worker - worker with at least one credit
+//         pArgs - pointer to PArgs struct
+//         i - index of task
+// Returns: false if the worker has disconnected
+bool send_remote_task(struct RemoteWorker *worker, struct PArgs *pArgs,
+                      int i) {
+  size_t bodyLength;
+  load_compiled_task(pArgs, i);
+  char *body = serialize_task(pArgs, i, &bodyLength);
+  job_log_started(pArgs, i, 0);
+  unload_compiled_task(pArgs, i);
+  uint32_t id = (uint32_t)i;
+  bool sent = send_frame(worker->fd, FRAME_TASK, &id, sizeof(id), body,
+                         bodyLength);
+  free(body);
+
+  // track the task even if sending failed so it gets handed to another worker
+  worker->credits--;
+  worker->outstanding[worker->numOutstanding++] = i;
+  stats_task_started();
+  return sent;
+}
+
+// Drops a worker which has disconnected, returning its unfinished tasks
+// Inputs: worker - disconnected worker
+//         retry - stack of tasks to run again
+//         numRetry - pointer to number of tasks in retry
+void drop_remote_worker(struct RemoteWorker *worker, int *retry,
+                        int *numRetry) {
+  for (int i = 0; i < worker->numOutstanding; i++) {
+    retry[(*numRetry)++] = worker->outstanding[i];
+  }
+  stats_tasks_requeued(worker->numOutstanding);
+  worker->numOutstanding = 0;
+  worker->connected = false;
+  close(worker->fd);
+}
 
-  // Redirect stderr if needed
-  if (pArgs->stderrFiles && pArgs->stderrFiles[i]) {
-    int fd = open(pArgs->stderrFiles[i], O_WRONLY | O_CREAT | O_TRUNC,
-                  READ_WRITE_PERMISSIONS);
-    if (fd < 0) {
-      fprintf(stderr, "uqparallel: cannot write to \"%s\"\n",
-              pArgs->stderrFiles[i]);
-      raise(SIGUSR1);
-      exit(SIGNAL_EXIT_NUM);
+// Executes tasks on --serve daemons, sending each daemon no more tasks than
+// its job limit allows at once
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+//         pArgs - pointer to PArgs struct
+// Returns: exit code from last task
+int make_remote_babies(const struct CLArgs *cmdLineArgs,
+                       struct PArgs *pArgs) {
+  char *addresses = strdup(cmdLineArgs->workerAddresses);
+  int numWorkers = 1;
+  for (int i = 0; addresses[i] != '\0'; i++) {
+    numWorkers += addresses[i] == ',';
+  }
+  struct RemoteWorker *workers =
+      calloc(numWorkers, sizeof(struct RemoteWorker));
+  struct pollfd *pollFds = calloc(numWorkers, sizeof(struct pollfd));
+  int *retry = malloc(pArgs->numArgs * sizeof(int));
+  int numRetry = 0;
+
+  char *savePointer = NULL;
+  char *address = strtok_r(addresses, ",", &savePointer);
+  for (int i = 0; address; i++) {
+    if (!connect_remote_worker(address, &workers[i])) {
+      fprintf(stderr, "uqparallel: cannot connect to worker \"%s\"\n",
+              address);
     }
-    dup2(fd, STDERR_FILENO);
-    close(fd);
+    address = strtok_r(NULL, ",", &savePointer);
   }
+  free(addresses);
 
-  execvp(pArgs->args[i][0], pArgs->args[i]);
-  fprintf(stderr, "uqparallel: cannot execute \"%s\"\n", pArgs->args[i][0]);
-  raise(SIGUSR1);
-  exit(SIGNAL_EXIT_NUM);
+  int next = 0;
+  int completed = 0;
+  int lastExitStatus = 0;
+  while (completed < pArgs->numArgs) {
+    // hand out tasks one at a time to whichever worker has the most credit
+    bool anyConnected = false;
+    while (numRetry > 0 || next < pArgs->numArgs) {
+      struct RemoteWorker *best = NULL;
+      for (int i = 0; i < numWorkers; i++) {
+        anyConnected = anyConnected || workers[i].connected;
+        if (workers[i].connected && workers[i].credits > 0 &&
+            (!best || workers[i].credits > best->credits)) {
+          best = &workers[i];
+        }
+      }
+      if (!best) {
+        break;
+      }
+      int task = numRetry > 0 ? retry[--numRetry] : task_at(pArgs, next++);
+      if (!send_remote_task(best, pArgs, task)) {
+        drop_remote_worker(best, retry, &numRetry);
+      }
+    }
+
+    for (int i = 0; i < numWorkers; i++) {
+      anyConnected = anyConnected || workers[i].connected;
+      pollFds[i].fd = workers[i].connected ? workers[i].fd : -1;
+      pollFds[i].events = POLLIN;
+    }
+    if (!anyConnected) {
+      fprintf(stderr, "uqparallel: no workers available\n");
+      lastExitStatus = WORKER_ERROR_EXIT_NUM;
+      break;
+    }
+    if (poll(pollFds, numWorkers, -1) < 0) {
+      continue;
+    }
+
+    for (int i = 0; i < numWorkers; i++) {
+      if (!pollFds[i].revents) {
+        continue;
+      }
+      if (!fill_frame_buffer(workers[i].fd, &workers[i].buffer)) {
+        drop_remote_worker(&workers[i], retry, &numRetry);
+        continue;
+      }
+      uint32_t frameLength;
+      while ((frameLength = complete_frame_size(&workers[i].buffer)) > 0) {
+        completed += handle_remote_frame(&workers[i], workers[i].buffer.data,
+                                         frameLength, &lastExitStatus);
+        consume_frame(&workers[i].buffer, frameLength);
+      }
+    }
+  }
+
+  for (int i = 0; i < numWorkers; i++) {
+    if (workers[i].connected) {
+      close(workers[i].fd);
+    }
+    free(workers[i].buffer.data);
+    free(workers[i].outstanding);
+  }
+  free(workers);
+  free(pollFds);
+  free(retry);
+  return lastExitStatus;
+}
+
+// Returns seconds elapsed since the statistics reporter was started
+// Returns: elapsed time in seconds
+double stats_elapsed_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)(now.tv_sec - statsReporter.startTime.tv_sec) +
+         (double)(now.tv_nsec - statsReporter.startTime.tv_nsec) /
+             NANOSECONDS_PER_SECOND;
+}
+
+// Takes a consistent enough copy of the run statistics for reporting
+// Returns: snapshot of the counters with derived rates
+struct StatsSnapshot take_stats_snapshot(void) {
+  struct StatsSnapshot snapshot;
+  snapshot.total = __atomic_load_n(&runStats.total, __ATOMIC_RELAXED);
+  snapshot.done = __atomic_load_n(&runStats.done, __ATOMIC_RELAXED);
+  snapshot.failed = __atomic_load_n(&runStats.failed, __ATOMIC_RELAXED);
+  snapshot.started = __atomic_load_n(&runStats.started, __ATOMIC_RELAXED);
+  snapshot.running = snapshot.started - snapshot.done;
+  if (snapshot.running < 0) {
+    snapshot.running = 0;
+  }
+
+  snapshot.elapsed = stats_elapsed_seconds();
+  snapshot.rate = snapshot.elapsed > 0 ? snapshot.done / snapshot.elapsed : 0;
+  // an unknown total (stdin) or no finished tasks yet means no ETA
+  snapshot.eta = -1;
+  if (snapshot.total > 0 && snapshot.rate > 0) {
+    snapshot.eta = (snapshot.total - snapshot.done) / snapshot.rate;
+  }
+  return snapshot;
+}
+
+// Formats a statistics snapshot as a single line of JSON
+// Inputs: snapshot - statistics to format
+//         buffer - buffer to write into
+//         size - size of buffer
+void format_stats_json(const struct StatsSnapshot *snapshot, char *buffer,
+                       size_t size) {
+  snprintf(buffer, size,
+           "{\"total\":%ld,\"started\":%ld,\"running\":%ld,"
+           "\"done\":%ld,\"failed\":%ld,\"elapsed_seconds\":%.3f,"
+           "\"tasks_per_second\":%.3f,\"eta_seconds\":%.1f}\n",
+           snapshot->total, snapshot->started, snapshot->running,
+           snapshot->done, snapshot->failed, snapshot->elapsed,
+           snapshot->rate, snapshot->eta);
+}
+
+// Formats a statistics snapshot in the Prometheus text exposition format
+// Inputs: snapshot - statistics to format
+//         buffer - buffer to write into
+//         size - size of buffer
+void format_stats_prometheus(const struct StatsSnapshot *snapshot,
+                             char *buffer, size_t size) {
+  snprintf(buffer, size,
+           "# TYPE uqparallel_tasks gauge\n"
+           "uqparallel_tasks %ld\n"
+           "# TYPE uqparallel_tasks_started_total counter\n"
+           "uqparallel_tasks_started_total %ld\n"
+           "# TYPE uqparallel_tasks_running gauge\n"
+           "uqparallel_tasks_running %ld\n"
+           "# TYPE uqparallel_tasks_done_total counter\n"
+           "uqparallel_tasks_done_total %ld\n"
+           "# TYPE uqparallel_tasks_failed_total counter\n"
+           "uqparallel_tasks_failed_total %ld\n"
+           "# TYPE uqparallel_elapsed_seconds gauge\n"
+           "uqparallel_elapsed_seconds %.3f\n"
+           "# TYPE uqparallel_tasks_per_second gauge\n"
+           "uqparallel_tasks_per_second %.3f\n",
+           snapshot->total, snapshot->started, snapshot->running,
+           snapshot->done, snapshot->failed, snapshot->elapsed,
+           snapshot->rate);
+}
+
+// Prints a progress line to stderr, overwriting the previous one
+// Inputs: final - true to finish the line once the run is over
+void print_progress(bool final) {
+  struct StatsSnapshot snapshot = take_stats_snapshot();
+  char eta[STATS_BUFFER_SIZE] = "?";
+  if (snapshot.eta >= 0) {
+    long seconds = (long)snapshot.eta;
+    snprintf(eta, sizeof(eta), "%ld:%02ld:%02ld", seconds / SECONDS_PER_HOUR,
+             seconds / SECONDS_PER_MINUTE % SECONDS_PER_MINUTE,
+             seconds % SECONDS_PER_MINUTE);
+  }
+
+  // stdin runs don't know their total
+  char total[STATS_BUFFER_SIZE] = "";
+  if (snapshot.total > 0) {
+    snprintf(total, sizeof(total), "/%ld", snapshot.total);
+  }
+
+  fprintf(stderr,
+          "\ruqparallel: %ld%s done, %ld running, %ld failed, "
+          "%.1f tasks/s, ETA %s   %s",
+          snapshot.done, total, snapshot.running, snapshot.failed,
+          snapshot.rate, eta, final ? "\n" : "");
+}
+
+// Writes a JSON snapshot to the --stats-fd file descriptor
+void write_stats_fd(void) {
+  char buffer[STATS_RESPONSE_SIZE];
+  struct StatsSnapshot snapshot = take_stats_snapshot();
+  format_stats_json(&snapshot, buffer, sizeof(buffer));
+  write_all_nosigpipe(statsReporter.statsFd, buffer, strlen(buffer));
+}
+
+// Answers a single connection to the --stats-socket endpoint. The client may
+// ask for "prometheus" (or "metrics"), anything else gets JSON.
+// Inputs: conn - accepted connection, closed before returning
+void answer_stats_request(int conn) {
+  char request[STATS_BUFFER_SIZE] = "";
+  char buffer[STATS_RESPONSE_SIZE];
+  struct pollfd pollFd;
+  pollFd.fd = conn;
+  pollFd.events = POLLIN;
+
+  // don't let a silent client hold up the reporter
+  if (poll(&pollFd, 1, STATS_REQUEST_TIMEOUT_MS) > 0) {
+    ssize_t numRead = read(conn, request, sizeof(request) - 1);
+    request[numRead > 0 ? numRead : 0] = '\0';
+  }
+
+  struct StatsSnapshot snapshot = take_stats_snapshot();
+  if (strncmp(request, "prometheus", strlen("prometheus")) == 0 ||
+      strncmp(request, "metrics", strlen("metrics")) == 0) {
+    format_stats_prometheus(&snapshot, buffer, sizeof(buffer));
+  } else {
+    format_stats_json(&snapshot, buffer, sizeof(buffer));
+  }
+  send_all(conn, buffer, strlen(buffer));
+  close(conn);
+}
+
+// Main loop of the statistics reporter thread. All reporting happens here, so
+// the spawn loops only ever increment counters.
+// Inputs: arg - unused
+// Returns: NULL
+void *stats_reporter_thread(void *arg) {
+  (void)arg;
+  struct pollfd pollFds[2];
+  pollFds[0].fd = statsReporter.wakePipe[0];
+  pollFds[0].events = POLLIN;
+  pollFds[1].fd = statsReporter.listenFd;
+  pollFds[1].events = POLLIN;
+
+  while (true) {
+    int ready = poll(pollFds, 2, PROGRESS_INTERVAL_MS);
+    if (ready > 0 && pollFds[0].revents) {
+      return NULL;
+    }
+    if (ready > 0 && pollFds[1].revents) {
+      int conn = accept4(statsReporter.listenFd, NULL, NULL, SOCK_CLOEXEC);
+      if (conn >= 0) {
+        answer_stats_request(conn);
+      }
+      continue;
+    }
+    if (statsReporter.progress) {
+      print_progress(false);
+    }
+    if (statsReporter.statsFd >= 0) {
+      write_stats_fd();
+    }
+  }
 }
 
-// Executes children in parallel using fork/exec without piping
+// Starts the statistics reporter thread if any reporting was asked for
 // Inputs: cmdLineArgs - pointer to CLArgs struct
-//         pArgs - pointer to PArgs struct
-// Returns: exit code from last child
-int make_babies(const struct CLArgs *cmdLineArgs, struct PArgs *pArgs) {
-  int maxChildren = cmdLineArgs->jobLimit;
-  int numChildren = pArgs->numArgs;
-  int activeChildren = 0;
-  int lastExitStatus = 0;
-
-  for (int i = 0; i < numChildren; i++) {
-    while (activeChildren >= maxChildren) {
-      reap_child(&activeChildren, &lastExitStatus);
+//         numTasks - number of tasks in the run, 0 if unknown
+void start_stats_reporter(const struct CLArgs *cmdLineArgs, long numTasks) {
+  runStats.total = numTasks;
+  clock_gettime(CLOCK_MONOTONIC, &statsReporter.startTime);
+  statsReporter.progress = cmdLineArgs->progressPresent;
+  statsReporter.statsFd = cmdLineArgs->statsFd;
+  statsReporter.listenFd = -1;
+
+  if (!statsReporter.progress && statsReporter.statsFd < 0 &&
+      !cmdLineArgs->statsSocket) {
+    return;
+  }
+  if (cmdLineArgs->statsSocket) {
+    statsReporter.listenFd =
+        open_socket_address(cmdLineArgs->statsSocket, true);
+    if (statsReporter.listenFd < 0) {
+      fprintf(stderr, "uqparallel: cannot listen on \"%s\"\n",
+              cmdLineArgs->statsSocket);
     }
+  }
 
-    pid_t pid = fork();
-    if (pid == 0) {
-      exec_child(pArgs, i);
-    } else if (pid > 0) {
-      activeChildren++;
-    } else {
-      perror("fork");
-      return 1;
-    }
+  if (pipe2(statsReporter.wakePipe, O_CLOEXEC) == -1) {
+    return;
   }
+  statsReporter.running = pthread_create(&statsReporter.thread, NULL,
+                                         stats_reporter_thread, NULL) == 0;
+}
 
-  // Wait for all children to finish to reap them
-  while (activeChildren-- > 0) {
-    reap_child(&activeChildren, &lastExitStatus);
+// Stops the statistics reporter thread and prints the final statistics
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+void stop_stats_reporter(const struct CLArgs *cmdLineArgs) {
+  if (!statsReporter.running) {
+    return;
   }
+  close(statsReporter.wakePipe[1]);
+  pthread_join(statsReporter.thread, NULL);
+  close(statsReporter.wakePipe[0]);
+  statsReporter.running = false;
 
-  return lastExitStatus;
+  if (statsReporter.progress) {
+    print_progress(true);
+  }
+  if (statsReporter.statsFd >= 0) {
+    write_stats_fd();
+  }
+  if (statsReporter.listenFd >= 0) {
+    close(statsReporter.listenFd);
+    // only remove Unix sockets, TCP addresses have nothing to clean up
+    if (strchr(cmdLineArgs->statsSocket, '/') ||
+        !strchr(cmdLineArgs->statsSocket, ':')) {
+      unlink(cmdLineArgs->statsSocket);
+    }
+  }
 }
 
 // Tokenizes and prepares a line of stdin input for execution, then sends to
@@ -960,6 +8822,10 @@ void process_stdin_line(const struct CLArgs *cmdLineArgs, struct PArgs *pArgs,
                         char *line) {
   line[strcspn(line, "\n")] = '\0';
   char *processedLine = modify_string(line);
+  if (!unique_task_is_new(processedLine, strlen(processedLine))) {
+    free(processedLine);
+    return;
+  }
   int numTokens = 0;
   char **tokens = split_space_not_quote(processedLine, &numTokens);
   int i = 0, writePointer = pArgs->stdinArgsPosition;
@@ -990,6 +8856,12 @@ void process_stdin_line(const struct CLArgs *cmdLineArgs, struct PArgs *pArgs,
         free(pArgs->stderrFiles[i]);
         pArgs->stderrFiles[i] = strdup(tokens[j] + STDERR_FILE_HEADER_LENGTH);
       }
+    } else if (cmdLineArgs->directivesPresent &&
+               is_task_directive(tokens[j])) {
+      // stdin tasks run as they arrive, so directives have nothing to do
+      pArgs->numElements[i]--;
+      pArgs->args[i] = (char **)realloc((void *)pArgs->args[i],
+                                        pArgs->numElements[i] * sizeof(char *));
     } else {
       free(pArgs->args[i][writePointer + 1]);
       pArgs->args[i][writePointer++] = strdup(tokens[j]);
@@ -1006,18 +8878,125 @@ void process_stdin_line(const struct CLArgs *cmdLineArgs, struct PArgs *pArgs,
   free((void *)tokens);
 }
 
+// Runs a record read from stdin with -0 or --delimiter as a single argument
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+//         pArgs - pointer to PArgs struct
+//         record - record to run
+void process_stdin_record(const struct CLArgs *cmdLineArgs,
+                          struct PArgs *pArgs, const char *record) {
+  if (!unique_task_is_new(record, strlen(record))) {
+    return;
+  }
+  int position = pArgs->stdinArgsPosition;
+  if (pArgs->numElements[0] > position) {
+    free(pArgs->args[0][position]);
+  }
+  pArgs->numElements[0] = position + PER_TASK_ARG + NULL_TERMINATOR;
+  pArgs->args[0] = (char **)realloc((void *)pArgs->args[0],
+                                    pArgs->numElements[0] * sizeof(char *));
+  pArgs->args[0][position] = strdup(record);
+  pArgs->args[0][position + 1] = NULL;
+  make_babies(cmdLineArgs, pArgs);
+}
+
 // Reads stdin line-by-line and sends them to process_stdin_line()
 // Inputs: cmdLineArgs - pointer to CLArgs struct
 //         pArgs - pointer to PArgs struct
 void make_babies_stdin_helper(const struct CLArgs *cmdLineArgs,
                               struct PArgs *pArgs) {
+  if (cmdLineArgs->delimiterPresent) {
+    struct RecordReader reader = {0};
+    reader.fd = STDIN_FILENO;
+    reader.delimiter = cmdLineArgs->delimiter;
+    uint64_t recordNumber = 0;
+    char *record;
+    size_t length;
+    while ((record = read_record(&reader, &length))) {
+      if (in_shard(cmdLineArgs, recordNumber++, 0, record, length)) {
+        process_stdin_record(cmdLineArgs, pArgs, record);
+        fflush(stdout);
+      }
+    }
+    free(reader.buffer);
+    return;
+  }
+
   char line[LINE_BUFFER];
+  uint64_t lineNumber = 0;
   while (fgets(line, sizeof(line), stdin)) {
+    // stdin has no known end, so only index and hash shards are allowed
+    if (!in_shard(cmdLineArgs, lineNumber++, 0, line, strcspn(line, "\n"))) {
+      continue;
+    }
     process_stdin_line(cmdLineArgs, pArgs, line);
     fflush(stdout);
   }
 }
 
+// Warns that --dispatchers was given to a run which uses a single scheduling
+// loop
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+//         reason - what makes the run use a single loop
+void warn_single_dispatcher(const struct CLArgs *cmdLineArgs,
+                            const char *reason) {
+  if (cmdLineArgs->numDispatchers > 1) {
+    fprintf(stderr, "uqparallel: --dispatchers is ignored with %s, using one "
+                    "dispatcher\n", reason);
+  }
+}
+
+// Runs every task with the executor selected on the command line
+// Inputs: cmdLineArgs - pointer to CLArgs struct
+//         pArgs - pointer to PArgs struct
+// Returns: exit code from last task
+int run_tasks(const struct CLArgs *cmdLineArgs, struct PArgs *pArgs) {
+  if (pArgs->graph) {
+    // dependencies are tracked by the parent, so tasks have to run locally
+    if (cmdLineArgs->pipePresent || cmdLineArgs->workerAddresses ||
+        cmdLineArgs->zygotePresent) {
+      fprintf(stderr, "uqparallel: task dependencies can't be used with "
+                      "--pipe, --zygote or --workers\n");
+      return DEPENDENCY_ERROR_EXIT_NUM;
+    }
+    warn_single_dispatcher(cmdLineArgs, "task dependencies");
+    return make_babies_graph(cmdLineArgs, pArgs);
+  }
+  if ((pArgs->taskEnv || pArgs->taskCwd) &&
+      (cmdLineArgs->workerAddresses || cmdLineArgs->zygotePresent)) {
+    fprintf(stderr, "uqparallel: @env= and @cwd= can't be used with "
+                    "--zygote or --workers\n");
+    return USAGE_ERROR_EXIT_NUM;
+  }
+  if ((pArgs->stageIn || pArgs->stageOut) &&
+      (cmdLineArgs->pipePresent || cmdLineArgs->workerAddresses ||
+       cmdLineArgs->zygotePresent)) {
+    fprintf(stderr, "uqparallel: @stage-in= and @stage-out= can't be used "
+                    "with --pipe, --zygote or --workers\n");
+    return USAGE_ERROR_EXIT_NUM;
+  }
+  if (cmdLineArgs->pipePresent) {
+    warn_single_dispatcher(cmdLineArgs, "--pipe");
+    return make_pipe_babies(cmdLineArgs, pArgs);
+  }
+  if (cmdLineArgs->workerAddresses) {
+    warn_single_dispatcher(cmdLineArgs, "--workers");
+    return make_remote_babies(cmdLineArgs, pArgs);
+  }
+  if (cmdLineArgs->zygotePresent) {
+    warn_single_dispatcher(cmdLineArgs, "--zygote");
+    return make_zygote_babies(cmdLineArgs, pArgs);
+  }
+  // classes and speculative copies are handled by a single scheduling loop
+  if (taskClasses.enabled) {
+    warn_single_dispatcher(cmdLineArgs, "--class");
+  } else if (speculation.enabled) {
+    warn_single_dispatcher(cmdLineArgs, "--speculate");
+  } else if (cmdLineArgs->numDispatchers > 1) {
+    return make_babies_dispatched(cmdLineArgs, pArgs);
+  }
+  return make_babies(cmdLineArgs, pArgs);
+}
+
 // Handles execution logic, either dry-run or spawning children
 // Inputs: cmdLineArgs - pointer to CLArgs struct
 //         pArgs - pointer to PArgs struct
@@ -1028,17 +9007,108 @@ int execute_commands(const struct CLArgs *cmdLineArgs, struct PArgs *pArgs) {
     return 0;
   }
 
+  if (cmdLineArgs->serveAddress) {
+    return serve_tasks(cmdLineArgs);
+  }
+
+  if (cmdLineArgs->compileOutput) {
+    return compile_argsfile(cmdLineArgs);
+  }
+
   if (cmdLineArgs->perTaskPresent || cmdLineArgs->argsFilePresent) {
-    if (cmdLineArgs->pipePresent) {
-      return make_pipe_babies(cmdLineArgs, pArgs);
-    }
-    return make_babies(cmdLineArgs, pArgs);
+    order_tasks(cmdLineArgs, pArgs);
+    build_task_graph(pArgs);
+    start_isolation(cmdLineArgs);
+    build_task_environment(cmdLineArgs);
+    start_staging(cmdLineArgs, pArgs);
+    start_slot_group(cmdLineArgs);
+    start_task_classes(cmdLineArgs, pArgs);
+    start_spawn_rate(cmdLineArgs);
+    start_speculation(cmdLineArgs, pArgs);
+    open_job_log(cmdLineArgs);
+    start_results(cmdLineArgs, false);
+    start_stats_reporter(cmdLineArgs, pArgs->numArgs);
+    start_latency_report(cmdLineArgs);
+    int exitCode = run_tasks(cmdLineArgs, pArgs);
+    stop_latency_report();
+    stop_stats_reporter(cmdLineArgs);
+    stop_results();
+    stop_redirects();
+    close_job_log();
+    stop_speculation();
+    stop_task_classes();
+    stop_slot_group();
+    stop_staging();
+    free_task_environment();
+    stop_isolation();
+    return exitCode;
   }
 
+  // the number of tasks on stdin isn't known up front
+  warn_single_dispatcher(cmdLineArgs, "tasks read from stdin");
+  start_isolation(cmdLineArgs);
+  build_task_environment(cmdLineArgs);
+  start_slot_group(cmdLineArgs);
+  start_spawn_rate(cmdLineArgs);
+  open_job_log(cmdLineArgs);
+  start_results(cmdLineArgs, true);
+  start_stats_reporter(cmdLineArgs, 0);
+  start_latency_report(cmdLineArgs);
   make_babies_stdin_helper(cmdLineArgs, pArgs);
+  stop_latency_report();
+  stop_stats_reporter(cmdLineArgs);
+  stop_results();
+  stop_redirects();
+  close_job_log();
+  stop_slot_group();
+  free_task_environment();
+  stop_isolation();
   return 0;
 }
 
+// Returns true if the given option must be followed by a value
+// Inputs: arg - command-line argument to check
+// Returns: true if arg is an option which takes a value
+bool option_takes_value(const char *arg) {
+  return strcmp(arg, jobLimit) == 0 || strcmp(arg, argsFile) == 0 ||
+         strcmp(arg, dispatchers) == 0 || strcmp(arg, zygoteWorker) == 0 ||
+         strcmp(arg, serve) == 0 || strcmp(arg, workers) == 0 ||
+         strcmp(arg, compileArgsFile) == 0 || strcmp(arg, shard) == 0 ||
+         strcmp(arg, statsFd) == 0 || strcmp(arg, statsSocket) == 0 ||
+         strcmp(arg, orderOption) == 0 || strcmp(arg, jobLogOption) == 0 ||
+         strcmp(arg, envOption) == 0 || strcmp(arg, workdirOption) == 0 ||
+         strcmp(arg, stageDirOption) == 0 ||
+         strcmp(arg, stageAheadOption) == 0 ||
+         strcmp(arg, delimiterOption) == 0 ||
+         strcmp(arg, resultsOption) == 0 ||
+         strcmp(arg, slotsGroupOption) == 0 ||
+         strcmp(arg, classOption) == 0 || strcmp(arg, rateOption) == 0 ||
+         strcmp(arg, speculateOption) == 0 ||
+         strcmp(arg, uniqueFalsePositiveOption) == 0;
+}
+
+// Returns true if the given option is a valid option without a value
+// Inputs: arg - command-line argument to check
+// Returns: true if arg is a known flag
+bool option_is_flag(const char *arg) {
+  return strcmp(arg, pipeOption) == 0 || strcmp(arg, exitOnError) == 0 ||
+         strcmp(arg, dryRun) == 0 || strcmp(arg, zygote) == 0 ||
+         strcmp(arg, progress) == 0 || strcmp(arg, latencyReportOption) == 0 ||
+         strcmp(arg, isolateOption) == 0 ||
+         strcmp(arg, isolateReadOnlyOption) == 0 ||
+         strcmp(arg, nullOption) == 0 || strcmp(arg, nullShortOption) == 0 ||
+         strcmp(arg, uniqueOption) == 0 ||
+         strcmp(arg, directivesOption) == 0;
+}
+
+// Returns true if an argument is written as an option rather than a command
+// Inputs: arg - command-line argument to check
+// Returns: true if arg starts with -- or is -0
+bool looks_like_option(const char *arg) {
+  return strncmp(arg, "--", OPTION_HEADER_LENGTH) == 0 ||
+         strcmp(arg, nullShortOption) == 0;
+}
+
 // Validates --pipe usage based on presence of argsFile or :::
 // Inputs: argc - argument count
 //         argv - array of command-line arguments
@@ -1082,8 +9152,8 @@ bool empty_string_validation(int argc, char *argv[]) {
   }
 
   for (int i = 0; i < argc; i++) {
-    // argsFile and jobLimit cant have empty string after it.
-    if ((strcmp(argv[i], argsFile) == 0) || (strcmp(argv[i], jobLimit) == 0)) {
+    // options that take a value cant have empty string after it.
+    if (option_takes_value(argv[i])) {
       // If a command or perTask has been seen, it will be treated as an
       // argument and can be followed by an empty string.
       if ((commandSeen == false) && (perTaskSeen == false)) {
@@ -1095,33 +9165,310 @@ bool empty_string_validation(int argc, char *argv[]) {
     // anything starting with . - or / can't have an empty string before it
     // this makes sure a command isn't an empty string
     else if ((argv[i][0] == '.' || argv[i][0] == '-' || argv[i][0] == '/') &&
-             (strncmp(argv[i], "--", OPTION_HEADER_LENGTH) != 0)) {
+             !looks_like_option(argv[i])) {
       if ((i > 0) && (strcmp(argv[i - 1], "") == 0)) {
         return false;
       }
     } else if (strcmp(argv[i], perTask) == 0) {
       perTaskSeen = true;
-    } else if (strncmp(argv[i], "--", OPTION_HEADER_LENGTH) != 0) {
+    } else if (!looks_like_option(argv[i])) {
       commandSeen = true;
     }
   }
   return true;
 }
 
+// Checks an integer option is in a valid range
+// Inputs: argc - argument count
+//         argv - array of arguments
+//         option - option whose value is checked
+//         min - smallest valid value
+//         max - largest valid value
+// Returns: true if option is not present or if option is followed by an
+// integer between min and max
+bool option_range_check(int argc, char *argv[], const char *option, int min,
+                        int max) {
+  for (int i = 0; i < argc; i++) {
+    if (strcmp(argv[i], option) == 0) {
+      int value = atoi(argv[i + 1]);
+      if ((value < min) || (value > max)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
 // Checks jobLimit is in valid range
 // Inputs: argc - argument count
 //         argv - array of arguments
 // Returns: true if jobLimit is not present or if jobLimit is followed by an
-// integer between 1 and 20
+// integer between 1 and 120
 bool job_limit_range_check(int argc, char *argv[]) {
+  return option_range_check(argc, argv, jobLimit, JOB_LIMIT_MIN,
+                            JOB_LIMIT_MAX);
+}
+
+// Returns true if an option is present anywhere in the arguments
+// Inputs: argc - argument count
+//         argv - array of arguments
+//         option - option to look for
+// Returns: true if option is in argv
+bool option_present(int argc, char *argv[], const char *option) {
   for (int i = 0; i < argc; i++) {
-    if (strcmp(argv[i], jobLimit) == 0) {
-      int jobLimitValue = atoi(argv[i + 1]);
-      if ((jobLimitValue < JOB_LIMIT_MIN) || (jobLimitValue > JOB_LIMIT_MAX)) {
+    if (strcmp(argv[i], option) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Checks any --shard value is valid
+// Inputs: argc - argument count
+//         argv - array of arguments
+// Returns: true if --shard is absent or has a valid value for the input mode
+bool valid_shard_option(int argc, char *argv[]) {
+  for (int i = 0; i < argc - 1; i++) {
+    if (strcmp(argv[i], shard) != 0) {
+      continue;
+    }
+    int index;
+    int count;
+    int mode;
+    if (!parse_shard(argv[i + 1], &index, &count, &mode)) {
+      return false;
+    }
+    if (mode == SHARD_RANGE && !option_present(argc, argv, argsFile) &&
+        !option_present(argc, argv, perTask)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Checks any --order value is valid
+// Inputs: argc - argument count
+//         argv - array of arguments
+// Returns: true if --order is absent, or has a valid value and a known list
+// of tasks to order which isn't run as a --pipe chain
+bool valid_order_option(int argc, char *argv[]) {
+  for (int i = 0; i < argc - 1; i++) {
+    if (strcmp(argv[i], orderOption) != 0) {
+      continue;
+    }
+    int mode;
+    const char *argument;
+    if (!parse_order(argv[i + 1], &mode, &argument)) {
+      return false;
+    }
+    if (option_present(argc, argv, pipeOption) ||
+        (!option_present(argc, argv, argsFile) &&
+         !option_present(argc, argv, perTask))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Checks --isolate and --isolate-ro are only used with executors which fork
+// tasks from this process
+// Inputs: argc - argument count
+//         argv - array of arguments
+// Returns: true if the isolation options are valid
+bool valid_isolate_option(int argc, char *argv[]) {
+  if (!option_present(argc, argv, isolateOption) &&
+      !option_present(argc, argv, isolateReadOnlyOption)) {
+    return true;
+  }
+  return !option_present(argc, argv, pipeOption) &&
+         !option_present(argc, argv, zygote) &&
+         !option_present(argc, argv, zygoteWorker) &&
+         !option_present(argc, argv, workers) &&
+         !option_present(argc, argv, serve);
+}
+
+// Checks --results is only used with executors which fork tasks themselves
+// Inputs: argc - argument count
+//         argv - array of arguments
+// Returns: true if --results is absent or can be used
+bool valid_results_option(int argc, char *argv[]) {
+  if (!option_present(argc, argv, resultsOption)) {
+    return true;
+  }
+  return !option_present(argc, argv, pipeOption) &&
+         !option_present(argc, argv, zygote) &&
+         !option_present(argc, argv, zygoteWorker) &&
+         !option_present(argc, argv, workers) &&
+         !option_present(argc, argv, serve);
+}
+
+// Checks a --slots-group value is well formed and that it is only used with
+// executors which fork tasks themselves
+// Inputs: argc - argument count
+//         argv - array of arguments
+// Returns: true if --slots-group is absent or valid
+bool valid_slots_group_option(int argc, char *argv[]) {
+  for (int i = 0; i < argc - 1; i++) {
+    if (strcmp(argv[i], perTask) == 0) {
+      break;
+    }
+    if (strcmp(argv[i], slotsGroupOption) != 0) {
+      continue;
+    }
+    size_t nameLength;
+    int size;
+    if (!parse_slots_group(argv[i + 1], &nameLength, &size)) {
+      return false;
+    }
+    if (option_present(argc, argv, pipeOption) ||
+        option_present(argc, argv, zygote) ||
+        option_present(argc, argv, zygoteWorker) ||
+        option_present(argc, argv, workers) ||
+        option_present(argc, argv, serve)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Checks every --class value is of the form NAME=N with no class given twice,
+// any --rate value can be parsed, and that both are only used with executors
+// which fork tasks themselves
+// Inputs: argc - argument count
+//         argv - array of arguments
+// Returns: true if the scheduling options are valid
+bool valid_scheduling_options(int argc, char *argv[]) {
+  bool present = false;
+  for (int i = 0; i < argc - 1; i++) {
+    if (strcmp(argv[i], perTask) == 0) {
+      break;
+    }
+    size_t nameLength;
+    int limit;
+    uint64_t interval;
+    if (strcmp(argv[i], rateOption) == 0) {
+      present = true;
+      if (!parse_rate(argv[i + 1], &interval)) {
+        return false;
+      }
+    }
+    if (strcmp(argv[i], classOption) != 0) {
+      continue;
+    }
+    present = true;
+    if (!parse_class_limit(argv[i + 1], &nameLength, &limit)) {
+      return false;
+    }
+    for (int j = 0; j < i; j++) {
+      if (strcmp(argv[j], classOption) == 0 &&
+          strncmp(argv[j + 1], argv[i + 1], nameLength + 1) == 0) {
+        return false;
+      }
+    }
+  }
+  return !present || (!option_present(argc, argv, pipeOption) &&
+                      !option_present(argc, argv, zygote) &&
+                      !option_present(argc, argv, zygoteWorker) &&
+                      !option_present(argc, argv, workers) &&
+                      !option_present(argc, argv, serve));
+}
+
+// Checks any --speculate value is a factor of at least 1, and that it is only
+// used when make_babies() runs the tasks and they are known up front
+// Inputs: argc - argument count
+//         argv - array of arguments
+// Returns: true if --speculate is absent or valid
+bool valid_speculate_option(int argc, char *argv[]) {
+  for (int i = 0; i < argc - 1; i++) {
+    if (strcmp(argv[i], perTask) == 0) {
+      break;
+    }
+    if (strcmp(argv[i], speculateOption) != 0) {
+      continue;
+    }
+    char *end;
+    double factor = strtod(argv[i + 1], &end);
+    if (end == argv[i + 1] || *end != '\0' || !(factor >= 1) ||
+        factor > INT_MAX) {
+      return false;
+    }
+    if ((!option_present(argc, argv, argsFile) &&
+         !option_present(argc, argv, perTask)) ||
+        option_present(argc, argv, pipeOption) ||
+        option_present(argc, argv, zygote) ||
+        option_present(argc, argv, zygoteWorker) ||
+        option_present(argc, argv, workers) ||
+        option_present(argc, argv, serve) ||
+        option_present(argc, argv, resultsOption) ||
+        option_present(argc, argv, isolateOption) ||
+        option_present(argc, argv, isolateReadOnlyOption)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Checks any --unique-fp value is a rate below 1, and that --unique isn't used
+// with --pipe, whose lines are stages rather than tasks
+// Inputs: argc - argument count
+//         argv - array of arguments
+// Returns: true if the --unique options are absent or valid
+bool valid_unique_options(int argc, char *argv[]) {
+  bool present = option_present(argc, argv, uniqueOption);
+  for (int i = 0; i < argc - 1; i++) {
+    if (strcmp(argv[i], perTask) == 0) {
+      break;
+    }
+    double rate;
+    if (strcmp(argv[i], uniqueFalsePositiveOption) == 0) {
+      present = true;
+      if (!parse_false_positive_rate(argv[i + 1], &rate)) {
+        return false;
+      }
+    }
+  }
+  return !present || !option_present(argc, argv, pipeOption);
+}
+
+// Checks every --env value is of the form NAME=VALUE, and that --env and
+// --workdir are only used with executors which exec tasks themselves
+// Inputs: argc - argument count
+//         argv - array of arguments
+// Returns: true if the environment options are valid
+bool valid_environment_options(int argc, char *argv[]) {
+  bool present = option_present(argc, argv, workdirOption);
+  for (int i = 0; i < argc - 1; i++) {
+    if (strcmp(argv[i], perTask) == 0) {
+      break;
+    }
+    if (strcmp(argv[i], envOption) == 0) {
+      present = true;
+      if (argv[i + 1][0] == '=' || !strchr(argv[i + 1], '=')) {
         return false;
       }
     }
   }
+  return !present || (!option_present(argc, argv, zygote) &&
+                      !option_present(argc, argv, zygoteWorker) &&
+                      !option_present(argc, argv, workers) &&
+                      !option_present(argc, argv, serve));
+}
+
+// Checks any --delimiter value can be parsed
+// Inputs: argc - argument count
+//         argv - array of arguments
+// Returns: true if --delimiter is absent or has a valid value
+bool valid_delimiter_option(int argc, char *argv[]) {
+  for (int i = 0; i < argc - 1; i++) {
+    if (strcmp(argv[i], perTask) == 0) {
+      break;
+    }
+    char delimiter;
+    if (strcmp(argv[i], delimiterOption) == 0 &&
+        !parse_delimiter(argv[i + 1], &delimiter)) {
+      return false;
+    }
+  }
   return true;
 }
 
@@ -1156,25 +9503,21 @@ bool invalid_options(int argc, char *argv[]) {
     if (strcmp(argv[i], perTask) == 0) {
       return false;
     }
-    // iterate past joblimit and argsfile arguments if found
-    if (strcmp(argv[i], jobLimit) == 0 && i != argc - 1) {
-      i++;
-    }
-    if (strcmp(argv[i], argsFile) == 0 && i != argc - 1) {
-      i++;
+    // iterate past options which take a value if found
+    if (option_takes_value(argv[i])) {
+      if (i != argc - 1) {
+        i++;
+      }
+      continue;
     }
     // commands can have invalid options after them
-    if (strncmp(argv[i], "--", OPTION_HEADER_LENGTH) != 0) {
+    if (!looks_like_option(argv[i])) {
       return false;
     }
-    // we already skip past joblimit and argsfile before this point
-    // so if this command is not pipe, exit on error, or dry run
-    // then it is invalid
-    if (strncmp(argv[i], "--", OPTION_HEADER_LENGTH) == 0) {
-      if (strcmp(argv[i], pipeOption) != 0 &&
-          strcmp(argv[i], exitOnError) != 0 && strcmp(argv[i], dryRun) != 0) {
-        return true;
-      }
+    // we already skip past options with values before this point
+    // so if this option is not a known flag then it is invalid
+    if (!option_is_flag(argv[i])) {
+      return true;
     }
   }
   return false;
@@ -1200,6 +9543,62 @@ bool valid_command_line_args(int argc, char *argv[]) {
     return false;
   }
 
+  // compiling needs an argsfile to compile
+  if (option_present(argc, argv, compileArgsFile) &&
+      !option_present(argc, argv, argsFile)) {
+    return false;
+  }
+
+  // check the statistics file descriptor is a usable descriptor
+  if (option_range_check(argc, argv, statsFd, 0, INT_MAX) == false) {
+    return false;
+  }
+
+  // check the shard is well formed, range shards need a known task list
+  if (!valid_shard_option(argc, argv)) {
+    return false;
+  }
+
+  // check the run order is well formed and there are tasks to reorder
+  if (!valid_order_option(argc, argv)) {
+    return false;
+  }
+
+  // isolated tasks have to be forked by us
+  if (!valid_isolate_option(argc, argv)) {
+    return false;
+  }
+
+  // task output can only be stored for tasks forked by us
+  if (!valid_results_option(argc, argv)) {
+    return false;
+  }
+
+  // host-wide slots are taken by tasks forked by us
+  if (!valid_slots_group_option(argc, argv)) {
+    return false;
+  }
+
+  // classes and the spawn rate are enforced when we fork tasks
+  if (!valid_scheduling_options(argc, argv)) {
+    return false;
+  }
+
+  // repeated tasks can only be dropped when there are tasks rather than stages
+  if (!valid_unique_options(argc, argv)) {
+    return false;
+  }
+
+  // copies of stragglers are started by the plain fork loop
+  if (!valid_speculate_option(argc, argv)) {
+    return false;
+  }
+
+  // check --env values are variable assignments which we can apply
+  if (!valid_environment_options(argc, argv)) {
+    return false;
+  }
+
   // check that commands or certain arguments aren't empty strings
   if (empty_string_validation(argc, argv) == false) {
     return false;
@@ -1210,6 +9609,23 @@ bool valid_command_line_args(int argc, char *argv[]) {
     return false;
   }
 
+  // check that the number of dispatcher threads is in range
+  if (option_range_check(argc, argv, dispatchers, DISPATCHERS_MIN,
+                         DISPATCHERS_MAX) == false) {
+    return false;
+  }
+
+  // check the record delimiter is a single byte
+  if (!valid_delimiter_option(argc, argv)) {
+    return false;
+  }
+
+  // check how far ahead inputs are staged is in range
+  if (option_range_check(argc, argv, stageAheadOption, STAGE_AHEAD_MIN,
+                         STAGE_AHEAD_MAX) == false) {
+    return false;
+  }
+
   // check for any invalid options
   if (invalid_options(argc, argv)) {
     return false;
@@ -1218,11 +9634,18 @@ bool valid_command_line_args(int argc, char *argv[]) {
   return true;
 }
 
+// main is left out when the benchmarks include this file
+#ifndef UQPARALLEL_NO_MAIN
 // Main entry point. Parses args, runs execution (makes babies), and frees
 // memory. Inputs: argc - number of command-line arguments
 //         argv - command-line arguments array
 // Returns: program exit code
 int main(int argc, char *argv[]) {
+  if (argc == 2 && strcmp(argv[1], helpOption) == 0) {
+    printf("%s%s", usageErrorMessage, helpMessage);
+    return 0;
+  }
+
   // validate command line arguments, don't send argv[0]
   if (argc > 1) {
     if (valid_command_line_args(argc - 1, argv + 1) == false) {
@@ -1246,3 +9669,4 @@ int main(int argc, char *argv[]) {
 
   return exitCode;
 }
+#endif
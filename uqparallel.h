@@ -0,0 +1,103 @@
+//
+// uqparallel.h
+//
+// Embeddable API of libuqparallel, which runs commands in parallel with the
+// same spawning, redirect and exec paths as the uqparallel binary.
+//
+// Tasks are submitted to a scheduler, which runs up to its job limit of them
+// at once and queues the rest. Nothing happens in the background: finished
+// tasks are reaped, queued ones started and callbacks run from inside
+// uq_poll() and the uq_wait calls, on the calling thread. A scheduler must
+// only be used by one thread at a time, and only reaps the processes it
+// started.
+//
+
+#ifndef UQPARALLEL_H
+#define UQPARALLEL_H
+
+#include <sys/types.h>
+
+#define UQ_API __attribute__((visibility("default")))
+
+// Exit status of a task killed by a signal or whose command couldn't be run
+#define UQ_SIGNAL_EXIT_STATUS 78
+
+struct UqScheduler;
+struct UqTask;
+
+// Called once a task has finished
+// Inputs: task - the finished task
+//         exitStatus - its exit status, or UQ_SIGNAL_EXIT_STATUS
+//         data - pointer given to uq_submit()
+typedef void (*UqTaskCallback)(struct UqTask *task, int exitStatus,
+                               void *data);
+
+// Creates a scheduler
+// Inputs: jobLimit - number of tasks which may run at once, at least 1
+// Returns: new scheduler, or NULL if jobLimit is invalid
+UQ_API struct UqScheduler *uq_scheduler_create(int jobLimit);
+
+// Submits a task, starting it straight away if there is a free job slot. A
+// task which can't be forked finishes, with UQ_SIGNAL_EXIT_STATUS, in the
+// next uq_poll() or uq_wait call. Its command is searched for in $PATH as it
+// is when the task starts.
+// Inputs: scheduler - scheduler to run the task
+//         argv - NULL terminated command and arguments, copied
+//         stdoutFile - file to send stdout to, or NULL to keep ours
+//         stderrFile - file to send stderr to, or NULL to keep ours
+//         callback - called when the task finishes, or NULL
+//         data - passed to callback
+// Returns: handle of the task, or NULL if argv is empty
+UQ_API struct UqTask *uq_submit(struct UqScheduler *scheduler,
+                                char *const argv[], const char *stdoutFile,
+                                const char *stderrFile,
+                                UqTaskCallback callback, void *data);
+
+// Submits a task written as an argsfile line, with the same quoting and
+// >file and 2>file redirects
+// Inputs: scheduler - scheduler to run the task
+//         line - task line
+//         callback - called when the task finishes, or NULL
+//         data - passed to callback
+// Returns: handle of the task, or NULL if the line has no command
+UQ_API struct UqTask *uq_submit_line(struct UqScheduler *scheduler,
+                                     const char *line, UqTaskCallback callback,
+                                     void *data);
+
+// Reaps finished tasks and starts queued ones without blocking
+// Inputs: scheduler - scheduler to update
+// Returns: number of tasks running or queued
+UQ_API int uq_poll(struct UqScheduler *scheduler);
+
+// Waits for a task to finish
+// Inputs: scheduler - scheduler running the task
+//         task - task to wait for
+// Returns: exit status of the task, or UQ_SIGNAL_EXIT_STATUS
+UQ_API int uq_wait(struct UqScheduler *scheduler, struct UqTask *task);
+
+// Waits for every submitted task to finish
+// Inputs: scheduler - scheduler to wait for
+// Returns: exit status of the last task to finish, or 0 if there were none
+UQ_API int uq_wait_all(struct UqScheduler *scheduler);
+
+// Returns the exit status of a task
+// Inputs: task - task to check
+// Returns: exit status, or -1 if the task hasn't finished
+UQ_API int uq_task_status(const struct UqTask *task);
+
+// Returns the process running a task
+// Inputs: task - task to check
+// Returns: pid, or 0 if the task hasn't started
+UQ_API pid_t uq_task_pid(const struct UqTask *task);
+
+// Frees a finished task's handle. Handles which aren't freed stay valid until
+// their scheduler is destroyed.
+// Inputs: scheduler - scheduler which ran the task
+//         task - finished task
+UQ_API void uq_task_free(struct UqScheduler *scheduler, struct UqTask *task);
+
+// Waits for every task to finish, then frees the scheduler and its handles
+// Inputs: scheduler - scheduler to destroy
+UQ_API void uq_scheduler_destroy(struct UqScheduler *scheduler);
+
+#endif